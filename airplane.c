@@ -5,66 +5,90 @@
 #include <string.h>
 
 #include "airplane.h"
+#include "planepool.h"
+#include "metrics.h"
+
+// Transition hooks, by the state entered (see plane_on_enter)
+
+static plane_hook hooks[PLANE_NSTATES][PLANE_MAXHOOKS];
+static int nhooks[PLANE_NSTATES];
+
+// The states each state can be entered from, as bitmasks of (1 << state)
+
+#define FROM(s) (1 << (s))
+
+static const int valid_from[PLANE_NSTATES] = {
+    [PLANE_UNREG] = 0,
+    [PLANE_ATTERMINAL] = FROM(PLANE_UNREG),
+    [PLANE_TAXIING] = FROM(PLANE_ATTERMINAL),
+    [PLANE_CLEAR] = FROM(PLANE_TAXIING),
+    [PLANE_INAIR] = FROM(PLANE_CLEAR),
+    [PLANE_DONE] = FROM(PLANE_UNREG) | FROM(PLANE_ATTERMINAL) |
+        FROM(PLANE_TAXIING) | FROM(PLANE_CLEAR) | FROM(PLANE_INAIR),
+};
 
 /************************************************************************
  * plane_init initializes an airplane structure in the initial PLANE_UNREG
- * state, with given send and receive FILE objects.
+ * state, for socket "fd" with a FILE object "fp_send" for writing to it.
  */
-void airplane_init(airplane *plane, FILE *fp_send, FILE *fp_recv) {
+void airplane_init(airplane *plane, int fd, FILE *fp_send) {
     plane->state = PLANE_UNREG;
+    plane->proto = 0;  // PROTO_TEXT
+    plane->fd = fd;
     plane->fp_send = fp_send;
-    plane->fp_recv = fp_recv;
-    plane->id[0] = '\0';
+    plane->out = NULL;
+    plane->fid = FLIGHTID_NONE;
+    plane->airport = 0;
+    plane->taxi_ticket = 0;
+    plane->runway = 0;
+    plane->cleared_at = 0;
+    rxbuf_init(&plane->rx);
+    plane->epoll_fd = -1;
+    plane->hangup = 0;
+    plane->shard = -1;
+    plane->pending = NULL;
 }
 
 /************************************************************************
- * new_airplane allocates an airplane struct and initializes it for
- * file descriptor "comm_fd". If any of the setup fails, this returns
- * NULL (should never happen?).
+ * new_airplane takes an airplane struct from the plane pool and
+ * initializes it for file descriptor "comm_fd". If any of the setup
+ * fails, this returns NULL (should never happen?).
+ *
+ * Only the sending side goes through stdio, into the plane's outbound
+ * queue (see outq.c), so writing to a plane never blocks. Receiving reads
+ * the socket directly into the plane's rxbuf, so one fd serves both
+ * directions.
  */
 airplane *new_airplane(int comm_fd) {
-    airplane *ret = malloc(sizeof(airplane));
-    if (ret == NULL) {
-        perror("new_airplane");
-        exit(1);
-    }
-
-    // Duplicate the file descriptor so we have separare read and write fds
-    // There may be a better way to do this, but using the same fd for both
-    // read and write seems to confuse the position in I/O buffering.
-    int dup_fd = dup(comm_fd);
-    if (dup_fd < 0) {
-        perror("new_airplane dup");
-        free(ret);
-        return NULL;
-    }
-
-    // Wrap the original fd in a FILE* for buffered/formatted writing
-    FILE *sender = fdopen(comm_fd, "w");
+    // Wrap the fd in a FILE* for buffered/formatted writing
+    outq *out;
+    FILE *sender = outq_open(comm_fd, &out);
     if (sender == NULL) {
-        perror("new_airplane fd_open sender");
-        close(dup_fd);
+        perror("new_airplane outq_open sender");
         close(comm_fd);
-        free(ret);
         return NULL;
     }
 
-    // Wrap the duplicate fd in a FILE* for buffered/formatted reading
-    FILE *receiver = fdopen(dup_fd, "r");
-    if (receiver == NULL) {
-        perror("new_airplane fd_open receiver");
-        fclose(sender);
-        close(dup_fd);
-        free(ret);
-        return NULL;
-    }
+    airplane *plane = new_airplane_writer(comm_fd, sender);
+    plane->out = out;
+    return plane;
+}
+
+/************************************************************************
+ * new_airplane_writer is new_airplane for a connection whose sending
+ * side is some other kind of FILE* than a plain fdopen()ed socket (the
+ * io_uring backend sends through a stdio cookie stream). The plane owns
+ * "sender" from here on, and closes it when destroyed.
+ */
+airplane *new_airplane_writer(int comm_fd, FILE *sender) {
+    airplane *ret = planepool_get();
 
-    // Set both FILE*'s to be line buffered (line-oriented app protocol)
+    // Line buffered, since this is a line-oriented app protocol
 
     setvbuf(sender, NULL, _IOLBF, 0);
-    setvbuf(receiver, NULL, _IOLBF, 0);
 
-    airplane_init(ret, sender, receiver);
+    airplane_init(ret, comm_fd, sender);
+    metrics_count(MET_CONNECTS);
     return ret;
 }
 
@@ -75,7 +99,77 @@ airplane *new_airplane(int comm_fd) {
  * again) before it is destroyed.
  */
 void airplane_destroy(airplane *plane) {
-    plane->state = PLANE_DONE;  // Just to make sure....
-    fclose(plane->fp_send);
-    fclose(plane->fp_recv);
-}
\ No newline at end of file
+    plane_done(plane);  // Just to make sure....
+    fclose(plane->fp_send);     // Also closes plane->fd
+    flightid_release(plane->fid);
+    plane->fid = FLIGHTID_NONE;
+    metrics_count(MET_DISCONNECTS);
+}
+
+/************************************************************************
+ * plane_state returns a plane's current state. Other threads may move it
+ * on at any time (the taxi queue clears planes for takeoff from the timer
+ * thread), so it is only a snapshot unless the caller is the only one
+ * that can make the next transition.
+ */
+int plane_state(airplane *plane) {
+    return __atomic_load_n(&plane->state, __ATOMIC_ACQUIRE);
+}
+
+/************************************************************************
+ * run_hooks calls the hooks for a plane that has just entered state "to"
+ * from state "from".
+ */
+static void run_hooks(airplane *plane, int from, int to) {
+    for (int i=0; i<nhooks[to]; i++)
+        hooks[to][i](plane, from);
+}
+
+/************************************************************************
+ * plane_transition moves a plane from state "from" to state "to", if it
+ * is in state "from" and that is a valid move, and then calls the hooks
+ * for "to". Returns 1 if the plane moved, or 0 if it didn't (so the
+ * caller that loses a race, like a clearance against a BYE, finds out
+ * and the plane is never moved twice).
+ */
+int plane_transition(airplane *plane, int from, int to) {
+    if (!(valid_from[to] & FROM(from)))
+        return 0;
+    if (!__atomic_compare_exchange_n(&plane->state, &from, to, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+    run_hooks(plane, from, to);
+    return 1;
+}
+
+/************************************************************************
+ * plane_done moves a plane to PLANE_DONE from whatever state it is in,
+ * unless it is there already.
+ */
+void plane_done(airplane *plane) {
+    int from = __atomic_exchange_n(&plane->state, PLANE_DONE, __ATOMIC_ACQ_REL);
+    if (from != PLANE_DONE)
+        run_hooks(plane, from, PLANE_DONE);
+}
+
+/************************************************************************
+ * plane_restore puts a plane straight into "state", without checking the
+ * move or calling any hooks. It is only for a plane that nothing else can
+ * reach yet, being rebuilt with the state it had in another process (see
+ * handoff.c).
+ */
+void plane_restore(airplane *plane, int state) {
+    __atomic_store_n(&plane->state, state, __ATOMIC_RELEASE);
+}
+
+/************************************************************************
+ * plane_on_enter registers "hook" to be called whenever a plane enters
+ * "state". Hooks are registered at startup, before any plane connects.
+ */
+void plane_on_enter(int state, plane_hook hook) {
+    if (nhooks[state] == PLANE_MAXHOOKS) {
+        fprintf(stderr, "plane_on_enter: too many hooks for state %d\n", state);
+        exit(1);
+    }
+    hooks[state][nhooks[state]++] = hook;
+}
@@ -4,14 +4,20 @@
 #include <stdio.h>
 #include <pthread.h>
 
+#include "flightid.h"
+#include "outq.h"
+#include "rxbuf.h"
+#include "workpool.h"
+
 // The maximum length of a plane id
 
 #define PLANE_MAXID 20
 
 // These are the valid states of an airplane. The numbers don't mean
-// anything, and just need to be all different. Note that a more "modern"
-// way of doing this would be to use an "enum", but most C programmers
-// stick to this old-fashioned way of doing things - so we will too!
+// anything, and just need to be all different (and below PLANE_NSTATES).
+// Note that a more "modern" way of doing this would be to use an "enum",
+// but most C programmers stick to this old-fashioned way of doing things
+// - so we will too!
 
 #define PLANE_UNREG 0
 #define PLANE_DONE 1
@@ -19,22 +25,63 @@
 #define PLANE_TAXIING 3
 #define PLANE_CLEAR 4
 #define PLANE_INAIR 5
+#define PLANE_NSTATES 6
+
+// A plane only ever moves forward through its states:
+//
+//   UNREG -> ATTERMINAL -> TAXIING -> CLEAR -> INAIR
+//
+// and can go to DONE from any of them. Once a plane is in the system its
+// state is only changed by plane_transition, which checks the move is
+// one of these, makes it atomically, and then calls the hooks for the
+// new state. Before that, plane_restore may put a plane straight into
+// the state it had somewhere else. The most hooks that can be registered
+// for one state:
+
+#define PLANE_MAXHOOKS 4
 
 // The struct to keep track of all information about an airplane in
 // the system.
 
 typedef struct airplane {
-    int state;
+    int state;               // Read with plane_state, set with plane_transition
+    int proto;               // PROTO_TEXT or PROTO_BINARY (airs_protocol.h)
     pthread_t thread;
-    FILE *fp_send;
-    FILE *fp_recv;
-    char id[PLANE_MAXID+1];
+    int fd;          // The plane's socket
+    FILE *fp_send;   // Buffered writer on fd
+    outq *out;       // Outbound queue behind fp_send (NULL in io_uring mode)
+    flightid fid;            // Flight id, once registered (see flightid.h)
+    int airport;             // Airport the plane is at (see airport.h)
+    struct airplane *pnext;  // Next plane in a plane pool freelist
+    long taxi_ticket;        // Ticket in the taxi queue, or 0 if not queued
+    int runway;              // Runway the plane was queued for (0 = none)
+    long cleared_at;         // When cleared for takeoff (metrics_now())
+    rxbuf rx;                // Received bytes not yet run as commands
+    int epoll_fd;            // Epoll set the plane is in (event mode only)
+    int hangup;              // Peer has closed; close once input is run
+    work job;                // Runs the plane's commands on the worker pool
+    int shard;               // Home shard (sharded mode only, else -1)
+    int pending_cmd;         // Command handed to another shard to run,
+    char *pending;           //   with its arguments (or binary frame)
+    int pending_len;         //   and the frame's length
 } airplane;
 
 // Basic initializer and destructor functions
 
-void airplane_init(airplane *plane, FILE *fp_send, FILE *fp_recv);
+void airplane_init(airplane *plane, int fd, FILE *fp_send);
 airplane *new_airplane(int comm_fd);
+airplane *new_airplane_writer(int comm_fd, FILE *sender);
 void airplane_destroy(airplane *plane);
 
+// Called on the thread that made the transition, with the state the plane
+// came from
+
+typedef void (*plane_hook)(airplane *plane, int from);
+
+int plane_state(airplane *plane);
+int plane_transition(airplane *plane, int from, int to);
+void plane_done(airplane *plane);
+void plane_restore(airplane *plane, int state);
+void plane_on_enter(int state, plane_hook hook);
+
 #endif  // _AIRPLANE_H
\ No newline at end of file
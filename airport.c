@@ -0,0 +1,145 @@
+// The airport module keeps track of the airports a server hosts (see
+// airport.h), and finds them by code for REG. Planes can only name the
+// airports the server was started with; only the journal and a handoff
+// set up airports of their own, to restore the queues they held. An
+// airport's code never
+// changes once it is set up, and the count is only raised once the
+// airport is ready (its taxi queues opened), so reading either takes no
+// lock; only finding and adding airports does.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "airport.h"
+#include "taxiqueue.h"
+
+#define AIRPORT_BUCKETS 1024
+
+typedef struct {
+    char code[AIRPORT_MAXCODE+1];
+    int next;                // Next airport in the same hash bucket, or -1
+} airport;
+
+static airport airports[AIRPORT_MAX];
+static int nairports;        // Airports set up so far (read unlocked)
+static int buckets[AIRPORT_BUCKETS];  // First airport in each bucket, or -1
+static int multi_mode;
+
+static pthread_mutex_t airport_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int code_hash(const char *code) {
+    unsigned int h = 2166136261u;
+    while (*code != '\0') {
+        h ^= (unsigned char)*code++;
+        h *= 16777619u;
+    }
+    return h % AIRPORT_BUCKETS;
+}
+
+/************************************************************************
+ * airport_add sets up a new airport with code "code". Returns its
+ * number, or -1 if the server already hosts AIRPORT_MAX airports. Must
+ * hold airport_lock.
+ */
+static int airport_add(const char *code) {
+    int number = nairports;
+    if (number == AIRPORT_MAX)
+        return -1;
+
+    airport *ap = &airports[number];
+    strncpy(ap->code, code, AIRPORT_MAXCODE);
+    ap->code[AIRPORT_MAXCODE] = '\0';
+    unsigned int b = code_hash(ap->code);
+    ap->next = buckets[b];
+    buckets[b] = number;
+
+    taxiqueue_open(number);
+    __atomic_store_n(&nairports, number + 1, __ATOMIC_RELEASE);
+    return number;
+}
+
+/************************************************************************
+ * airport_init sets up the airports: just airport 0 for a single-airport
+ * server if "codes" is NULL, or else every airport in "codes", a comma
+ * separated list of codes. A bad list is fatal. The taxi queues must
+ * already be initialized.
+ */
+void airport_init(const char *codes) {
+    multi_mode = (codes != NULL);
+    for (int b=0; b<AIRPORT_BUCKETS; b++)
+        buckets[b] = -1;
+
+    if (!multi_mode) {
+        pthread_mutex_lock(&airport_lock);
+        airport_add("");
+        pthread_mutex_unlock(&airport_lock);
+        return;
+    }
+
+    while (1) {
+        char code[AIRPORT_MAXCODE+1];
+        int len = strcspn(codes, ",");
+        if ((len == 0) || (len > AIRPORT_MAXCODE)) {
+            fprintf(stderr, "Bad airport code in list: %.*s\n", len, codes);
+            exit(1);
+        }
+        memcpy(code, codes, len);
+        code[len] = '\0';
+        if (airport_find(code, 1) < 0) {
+            fprintf(stderr, "Too many airports (most is %d)\n", AIRPORT_MAX);
+            exit(1);
+        }
+        if (codes[len] == '\0')
+            break;
+        codes += len + 1;
+    }
+}
+
+/************************************************************************
+ * Returns 1 if the server hosts many airports (named at REG), or 0 if it
+ * is a single airport.
+ */
+int airport_multi(void) {
+    return multi_mode;
+}
+
+/************************************************************************
+ * airport_find returns the number of the airport with code "code",
+ * setting it up first if it isn't hosted yet and "create" is set.
+ * Returns -1 if there is no such airport (or no room for another one).
+ * A single-airport server is the airport for every code. Only the
+ * server's own state (its airport list, journal or handoff) may create
+ * airports: never a plane, since airports are never taken down again.
+ */
+int airport_find(const char *code, int create) {
+    if (!multi_mode)
+        return 0;
+    if ((code[0] == '\0') || (strlen(code) > AIRPORT_MAXCODE))
+        return -1;
+
+    pthread_mutex_lock(&airport_lock);
+    int number = buckets[code_hash(code)];
+    while ((number >= 0) && (strcmp(airports[number].code, code) != 0))
+        number = airports[number].next;
+    if ((number < 0) && create)
+        number = airport_add(code);
+    pthread_mutex_unlock(&airport_lock);
+    return number;
+}
+
+/************************************************************************
+ * Returns the code of airport "number" ("" for a single airport).
+ */
+const char *airport_code(int number) {
+    return airports[number].code;
+}
+
+/************************************************************************
+ * Returns the number of airports set up so far. Airports 0 to one less
+ * than this are all ready to use.
+ */
+int airport_count(void) {
+    return __atomic_load_n(&nairports, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,25 @@
+// Types and function prototypes for the airports a server hosts
+
+#ifndef _AIRPORT_H
+#define _AIRPORT_H
+
+// A server is normally a single airport: airport 0, with no code, which
+// every plane is at. A server hosting many airports (gndcontrol -A, with
+// the list of their codes) has planes name their airport when they
+// register ("REG KJFK AA100"), and each airport gets its own flight ids
+// and its own runways and taxi queues. Planes can't name airports that
+// aren't on the list. Airports are numbered from 0 in the order they are
+// set up, and are never taken down again.
+
+// Longest airport code, and the most airports one server hosts
+
+#define AIRPORT_MAXCODE 8
+#define AIRPORT_MAX 4096
+
+void airport_init(const char *codes);
+int airport_multi(void);
+int airport_find(const char *code, int create);
+const char *airport_code(int number);
+int airport_count(void);
+
+#endif  // _AIRPORT_H
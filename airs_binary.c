@@ -0,0 +1,149 @@
+// Module to encode and decode the binary framing of the ground control
+// protocol (the frame layout is described in airs_binary.h). Decoding
+// works in place on frames in the plane's receive buffer and encoding
+// writes straight into the plane's send stream, so neither allocates.
+// Commands are run by the same handlers as the text protocol, through
+// runcommand() in airs_protocol.c.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "airplane.h"
+#include "airport.h"
+#include "airs_protocol.h"
+#include "airs_binary.h"
+
+// Most flight ids that fit in one REQAHEAD reply frame
+
+#define BIN_MAXAHEAD ((0xFFFF - 3) / PLANE_MAXID)
+
+static const char zeros[PLANE_MAXID];
+
+/************************************************************************
+ * Writes a frame header for a reply of type "type" with "len" bytes of
+ * payload to follow. The caller must hold the send stream's lock.
+ */
+static void put_header(FILE *fp, int type, int len) {
+    int flen = len + 1;
+    putc_unlocked((flen >> 8) & 0xFF, fp);
+    putc_unlocked(flen & 0xFF, fp);
+    putc_unlocked(type, fp);
+}
+
+/************************************************************************
+ * Sends one complete frame. The send stream is locked for the whole frame
+ * so that a frame from another thread (say, a TAKEOFF) can't land in the
+ * middle of it, and flushed at the end, since line buffering never kicks
+ * in for binary data.
+ */
+void bin_send(airplane *plane, int type, const void *payload, int len) {
+    flockfile(plane->fp_send);
+    put_header(plane->fp_send, type, len);
+    if (len > 0)
+        fwrite_unlocked(payload, 1, len, plane->fp_send);
+    fflush_unlocked(plane->fp_send);
+    funlockfile(plane->fp_send);
+}
+
+/************************************************************************
+ * Sends a frame whose payload is one 4-byte big-endian integer.
+ */
+void bin_send_u32(airplane *plane, int type, unsigned int val) {
+    unsigned char buf[4] = { val >> 24, val >> 16, val >> 8, val };
+    bin_send(plane, type, buf, sizeof(buf));
+}
+
+/************************************************************************
+ * Sends the OK reply to REQPOS: the position and the runway.
+ */
+void bin_send_pos(airplane *plane, int pos, int runway) {
+    unsigned char buf[5] = { pos >> 24, pos >> 16, pos >> 8, pos, runway };
+    bin_send(plane, BIN_OK, buf, sizeof(buf));
+}
+
+/************************************************************************
+ * Sends the OK reply to REQAHEAD. "list" is the taxi queue's rendering
+ * of the "count" flights ahead ("ID1, ID2"), which is re-encoded on the
+ * fly as fixed-width ids.
+ */
+void bin_send_ahead(airplane *plane, const char *list, int len, int count) {
+    if (count > BIN_MAXAHEAD)
+        count = BIN_MAXAHEAD;
+
+    FILE *fp = plane->fp_send;
+    flockfile(fp);
+    put_header(fp, BIN_OK, 2 + count * PLANE_MAXID);
+    putc_unlocked((count >> 8) & 0xFF, fp);
+    putc_unlocked(count & 0xFF, fp);
+
+    const char *p = list;
+    const char *end = list + len;
+    for (int i=0; i<count; i++) {
+        const char *comma = memchr(p, ',', end - p);
+        int idlen = (comma != NULL) ? comma - p : end - p;
+        fwrite_unlocked(p, 1, idlen, fp);
+        fwrite_unlocked(zeros, 1, PLANE_MAXID - idlen, fp);
+        p += idlen + 2;  // Skip the ", " separator
+    }
+
+    fflush_unlocked(fp);
+    funlockfile(fp);
+}
+
+/************************************************************************
+ * Reads a 2-byte big-endian integer.
+ */
+static int get_u16(const unsigned char *p) {
+    return (p[0] << 8) | p[1];
+}
+
+/************************************************************************
+ * Decodes one frame (without its length prefix) from a plane in binary
+ * mode and runs the command it holds. Arguments are turned back into
+ * the form the text handlers take, in buffers on the stack.
+ */
+void docommand_binary(airplane *plane, unsigned char *frame, int len) {
+    if (len == 0)
+        return;  // Empty frame, like an empty line -- just ignore it
+
+    int op = frame[0];
+    unsigned char *payload = frame + 1;
+    int plen = len - 1;
+
+    if (op == CMD_REG) {
+        // Fixed-width id, NUL-padded; anything past the padding is an
+        // over-long id, or else the airport code. The text handler takes
+        // the code first, so the arguments are built as "code id".
+        char args[AIRPORT_MAXCODE + PLANE_MAXID + 4];
+        int off = 0;
+        int idmax = PLANE_MAXID;
+        if (airport_multi()) {
+            unsigned char *code = payload + PLANE_MAXID;
+            int codelen = plen - PLANE_MAXID;
+            while ((off < codelen) && (off <= AIRPORT_MAXCODE) && (code[off] != 0)) {
+                args[off] = code[off];
+                off++;
+            }
+            if (off > 0)
+                args[off++] = ' ';
+            idmax--;   // Only the code can run past the id
+        }
+        int idlen = 0;
+        while ((idlen < plen) && (idlen <= idmax) && (payload[idlen] != 0)) {
+            args[off + idlen] = payload[idlen];
+            idlen++;
+        }
+        args[off + idlen] = '\0';
+        runcommand(plane, op, (idlen > 0) ? args : NULL);
+    } else if (op == CMD_REQAHEAD) {
+        char args[24];
+        int max = (plen >= 2) ? get_u16(payload) : BIN_NOLIMIT;
+        int skip = (plen >= 4) ? get_u16(payload + 2) : 0;
+        if (max == BIN_NOLIMIT)
+            max = 1000000;  // Largest limit REQAHEAD accepts
+        snprintf(args, sizeof(args), "%d %d", max, skip);
+        runcommand(plane, op, args);
+    } else {
+        runcommand(plane, op, NULL);
+    }
+}
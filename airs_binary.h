@@ -0,0 +1,50 @@
+// The binary framing of the ground control protocol
+//
+// A plane switches from the (default) text protocol by sending the text
+// command "BINARY"; after the "OK" reply, everything in both directions is
+// framed as:
+//
+//   2 bytes   frame length N (big-endian), not counting these 2 bytes
+//   1 byte    opcode (plane to server) or reply type (server to plane)
+//   N-1 bytes payload
+//
+// Plane opcodes are the CMD_* numbers in airs_protocol.h, and run the same
+// handlers as the text commands. Payloads:
+//   REG       flight id, NUL-padded to PLANE_MAXID bytes; a server
+//             hosting many airports then takes the airport code,
+//             NUL-padded to AIRPORT_MAXCODE bytes
+//   REQAHEAD  optional 2-byte max (0xFFFF for no limit), optional 2-byte
+//             skip
+//   others    none
+//
+// Server reply types and payloads (all integers big-endian):
+//   BIN_OK      none; after REQPOS, 4-byte position and 1-byte runway;
+//               after REQAHEAD, 2-byte count then count flight ids, each
+//               NUL-padded to PLANE_MAXID bytes
+//   BIN_ERR     1-byte ERR_* code
+//   BIN_TAKEOFF none
+//   BIN_POS     4-byte position
+//   BIN_NOTICE  text
+
+#ifndef _AIRS_BINARY_H
+#define _AIRS_BINARY_H
+
+#include "airplane.h"
+
+#define BIN_OK 0
+#define BIN_ERR 1
+#define BIN_TAKEOFF 2
+#define BIN_POS 3
+#define BIN_NOTICE 4
+
+// REQAHEAD max meaning "no limit"
+
+#define BIN_NOLIMIT 0xFFFF
+
+void bin_send(airplane *plane, int type, const void *payload, int len);
+void bin_send_u32(airplane *plane, int type, unsigned int val);
+void bin_send_pos(airplane *plane, int pos, int runway);
+void bin_send_ahead(airplane *plane, const char *list, int len, int count);
+void docommand_binary(airplane *plane, unsigned char *frame, int len);
+
+#endif  // _AIRS_BINARY_H
@@ -8,82 +8,240 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 
 
-#include "util.h"
 #include "airplane.h"
+#include "airport.h"
 #include "airs_protocol.h"
+#include "airs_binary.h"
+#include "metrics.h"
 #include "planelist.h"
 #include "taxiqueue.h"
 
 static pthread_mutex_t queue_mutex;
 
+// "POS n" updates go out to every subscriber behind a departing plane, so
+// the lines for the common positions are encoded once and shared by all
+// planes rather than formatted again for each one.
+
+#define POS_CACHE 1024
+#define POS_LINEMAX 24
+
+static char pos_lines[POS_CACHE][POS_LINEMAX];
+static int pos_lens[POS_CACHE];
+static pthread_once_t pos_once = PTHREAD_ONCE_INIT;
+
+// Character classes for the command tokenizer and flight id (and airport
+// code) checks, so each byte of a command line is classified with a
+// single table lookup.
+
+#define CC_SPACE 1    // Whitespace (what isspace() accepts)
+#define CC_EOL 2      // Ends the arguments: '\r', '\n' or NUL
+#define CC_ID 4       // Allowed in a flight id (what isalnum() accepts)
+
+static const unsigned char charclass[256] = {
+    ['\0'] = CC_EOL,
+    [' '] = CC_SPACE, ['\t'] = CC_SPACE, ['\v'] = CC_SPACE, ['\f'] = CC_SPACE,
+    ['\r'] = CC_SPACE | CC_EOL, ['\n'] = CC_SPACE | CC_EOL,
+    ['0' ... '9'] = CC_ID, ['A' ... 'Z'] = CC_ID, ['a' ... 'z'] = CC_ID,
+};
+
+// Text of each ERR_* code, as sent by the text protocol
+
+static const char *err_text[] = {
+    [ERR_UNKNOWN] = "Unknown command",
+    [ERR_TOOLONG] = "Command too long",
+    [ERR_REGISTERED] = "Already registered as %s",
+    [ERR_NOID] = "REG missing flightid",
+    [ERR_BADID] = "Invalid flight id -- only alphanumeric characters allowed",
+    [ERR_IDLEN] = "Invalid flight id -- too long",
+    [ERR_DUPID] = "Duplicate flight id",
+    [ERR_UNREG] = "Unregistered plane -- cannot process request",
+    [ERR_NOTATTERMINAL] = "Plane must be at the terminal to request taxi",
+    [ERR_NOTTAXIING] = "Plane not taxiing -- cannot process request",
+    [ERR_NOTQUEUED] = "Plane not in taxi queue",
+    [ERR_BADARGS] = "Invalid REQAHEAD arguments -- expected [max [skip]]",
+    [ERR_NOTCLEAR] = "Plane not cleared for takeoff -- cannot process INAIR command",
+    [ERR_NOAIRPORT] = "REG missing airport -- expected REG airport flightid",
+    [ERR_BADAIRPORT] = "Invalid airport code",
+};
+
 /************************************************************************
  * Call this response function if a command was accepted
  */
 void send_ok(airplane *plane) {
+    if (plane->proto == PROTO_BINARY) {
+        bin_send(plane, BIN_OK, NULL, 0);
+        return;
+    }
     fprintf(plane->fp_send, "OK\n");
 }
 
 /************************************************************************
  * Call this response function if an error can be described by a simple
- * string.
+ * string (the text for error "code").
  */
-void send_err(airplane *plane, char *desc) {
-    fprintf(plane->fp_send, "ERR %s\n", desc);
+void send_err(airplane *plane, int code) {
+    metrics_error(code);
+    if (plane->proto == PROTO_BINARY) {
+        unsigned char bcode = code;
+        bin_send(plane, BIN_ERR, &bcode, 1);
+        return;
+    }
+    fprintf(plane->fp_send, "ERR %s\n", err_text[code]);
 }
 
 /************************************************************************
  * Call this response function if you want to embed a specific string
- * argument (sarg) into an error reply (which is now a format string).
+ * argument (sarg) into an error reply (the text for "code" is then a
+ * format string). The binary protocol only sends the code.
  */
-void send_err_sarg(airplane *plane, char *fmtstring, char *sarg) {
+void send_err_sarg(airplane *plane, int code, const char *sarg) {
+    if (plane->proto == PROTO_BINARY) {
+        send_err(plane, code);
+        return;
+    }
+    metrics_error(code);
+    flockfile(plane->fp_send);
     fprintf(plane->fp_send, "ERR ");
-    fprintf(plane->fp_send, fmtstring, sarg);
+    fprintf(plane->fp_send, err_text[code], sarg);
     fprintf(plane->fp_send, "\n");
+    funlockfile(plane->fp_send);
+}
+
+/************************************************************************
+ * Tells a plane it is cleared for takeoff.
+ */
+void send_takeoff(airplane *plane) {
+    if (plane->proto == PROTO_BINARY) {
+        bin_send(plane, BIN_TAKEOFF, NULL, 0);
+        return;
+    }
+    fprintf(plane->fp_send, "TAKEOFF\n");
+    fflush(plane->fp_send); // Ensure the message is sent immediately
+}
+
+/************************************************************************
+ * Sends an informational notice to a plane.
+ */
+static void send_notice(airplane *plane, char *text) {
+    if (plane->proto == PROTO_BINARY) {
+        bin_send(plane, BIN_NOTICE, text, strlen(text));
+        return;
+    }
+    fprintf(plane->fp_send, "NOTICE %s\n", text);
+}
+
+/************************************************************************
+ * Fills in the shared table of encoded "POS n" lines (run once).
+ */
+static void pos_lines_init(void) {
+    for (int i=0; i<POS_CACHE; i++)
+        pos_lens[i] = snprintf(pos_lines[i], POS_LINEMAX, "POS %d\n", i);
+}
+
+/************************************************************************
+ * Sends an unsolicited position update to a subscribed plane.
+ */
+void send_pos(airplane *plane, int pos) {
+    if (plane->proto == PROTO_BINARY) {
+        bin_send_u32(plane, BIN_POS, pos);
+        return;
+    }
+
+    pthread_once(&pos_once, pos_lines_init);
+    if ((pos >= 0) && (pos < POS_CACHE)) {
+        fwrite(pos_lines[pos], 1, pos_lens[pos], plane->fp_send);
+    } else {
+        fprintf(plane->fp_send, "POS %d\n", pos);
+    }
+}
+
+/************************************************************************
+ * Returns 1 if "word" is made up only of characters in class "cc", or 0.
+ * Sets "*len" to its length. The check is one pass, with no branch per
+ * character.
+ */
+static int all_in_class(const char *word, unsigned char cc, int *len) {
+    unsigned char allowed = cc;
+    const unsigned char *cp = (const unsigned char *)word;
+    while (*cp != '\0')
+        allowed &= charclass[*cp++];
+    *len = (const char *)cp - word;
+    return allowed != 0;
 }
 
 /************************************************************************
- * Handle the "REG" command.
+ * Handle the "REG" command. A server hosting many airports (see
+ * airport.h) takes the airport first: "REG KJFK AA100".
  */
 static void cmd_reg(airplane *plane, char *rest) {
-    if (plane->state != PLANE_UNREG) {
-        send_err_sarg(plane, "Already registered as %s", plane->id);
+    if (plane_state(plane) != PLANE_UNREG) {
+        send_err_sarg(plane, ERR_REGISTERED, flightid_name(plane->fid));
         return;
     }
 
     if (rest == NULL) {
-        send_err(plane, "REG missing flightid");
+        send_err(plane, ERR_NOID);
         return;
     }
 
-    char *cp = rest;
-    while (*cp != '\0') {
-        if (!isalnum(*cp)) {
-            send_err(plane, "Invalid flight id -- only alphanumeric characters allowed");
+    char *code = NULL;
+    if (airport_multi()) {
+        unsigned char *p = (unsigned char *)rest;
+        while (!(charclass[*p] & (CC_SPACE | CC_EOL)))
+            p++;
+        if (*p == '\0') {
+            send_err(plane, ERR_NOAIRPORT);
+            return;
+        }
+        *p++ = '\0';
+        while (charclass[*p] & CC_SPACE)
+            p++;
+        code = rest;
+        rest = (char *)p;
+
+        int len;
+        if (!all_in_class(code, CC_ID, &len) || (len > AIRPORT_MAXCODE)) {
+            send_err(plane, ERR_BADAIRPORT);
             return;
         }
-        cp++;
     }
 
-    if (strlen(rest) > PLANE_MAXID) {
-        send_err(plane, "Invalid flight id -- too long");
+    int len;
+    if (!all_in_class(rest, CC_ID, &len)) {
+        send_err(plane, ERR_BADID);
         return;
     }
 
-    // Check for a duplicate flight number
-    if (planelist_find(rest) != NULL) {
-        send_err(plane, "Duplicate flight id");
+    if (len > PLANE_MAXID) {
+        send_err(plane, ERR_IDLEN);
         return;
     }
 
-    // Using a "planelist" function to change id for an atomic update
-    planelist_changeid(plane, rest);
-    plane->state = PLANE_ATTERMINAL;
+    // Only airports the server hosts; planes never set new ones up
+    if (code != NULL) {
+        int airport = airport_find(code, 0);
+        if (airport < 0) {
+            send_err(plane, ERR_BADAIRPORT);
+            return;
+        }
+        plane->airport = airport;
+    }
+
+    // Using a "planelist" function to change id for an atomic update, which
+    // also checks for a duplicate flight number in the same step. The id
+    // is interned here, once, and handled as a flightid from then on.
+    flightid fid = flightid_intern(plane->airport, rest);
+    if (planelist_changeid(plane, fid) < 0) {
+        flightid_release(fid);
+        send_err(plane, ERR_DUPID);
+        return;
+    }
+    plane_transition(plane, PLANE_UNREG, PLANE_ATTERMINAL);
 
     send_ok(plane);
 }
@@ -92,45 +250,46 @@ static void cmd_reg(airplane *plane, char *rest) {
  * Handle the "REQTAXI" command.
  */
 static void cmd_reqtaxi(airplane *plane, char *rest) {
-    if (plane->state == PLANE_UNREG) {
-        send_err(plane, "Unregistered plane -- cannot process request");
+    if (plane_state(plane) == PLANE_UNREG) {
+        send_err(plane, ERR_UNREG);
         return;
     }
 
-     if (plane->state != PLANE_ATTERMINAL) {
-        send_err(plane, "Plane must be at the terminal to request taxi");
+     if (plane_state(plane) != PLANE_ATTERMINAL) {
+        send_err(plane, ERR_NOTATTERMINAL);
         return;
     }
 
-    taxiqueue_add(plane->id);
-    plane->state = PLANE_TAXIING;
+    // The OK has to go out first, since the taxi queue may clear the plane
+    // (and send TAKEOFF) as soon as it is added
+    plane_transition(plane, PLANE_ATTERMINAL, PLANE_TAXIING);
     send_ok(plane);
-
-
-    if (taxiqueue_getpos(plane->id) == 1) {
-        fprintf(plane->fp_send, "TAKEOFF\n");
-        plane->state = PLANE_CLEAR;
-        printf("Clearing flight %s\n", plane->id);
-    }
+    taxiqueue_add(plane);
 }
 
 /************************************************************************
- * Handle the "REQPOS" command.
+ * Handle the "REQPOS" command. The position is within the plane's own
+ * runway queue; with more than one runway, the runway number follows.
  */
 static void cmd_reqpos(airplane *plane, char *rest) {
-    if (plane->state == PLANE_UNREG) {
-        send_err(plane, "Unregistered plane -- cannot process request");
+    if (plane_state(plane) == PLANE_UNREG) {
+        send_err(plane, ERR_UNREG);
         return;
     }
 
-    if (plane->state != PLANE_TAXIING) {
-        send_err(plane, "Plane not taxiing -- cannot process request");
+    if (plane_state(plane) != PLANE_TAXIING) {
+        send_err(plane, ERR_NOTTAXIING);
         return;
     }
 
-    int pos = taxiqueue_getpos(plane->id);
+    int pos = taxiqueue_getpos(plane);
     if (pos == 0) {
-        send_err(plane, "Plane not in taxi queue");
+        send_err(plane, ERR_NOTQUEUED);
+    } else if (plane->proto == PROTO_BINARY) {
+        bin_send_pos(plane, pos, plane->runway);
+    } else if (taxiqueue_runways() > 1) {
+        // Positions are per runway, so say which runway this one is for
+        fprintf(plane->fp_send, "OK %d RUNWAY %d\n", pos, plane->runway);
     } else {
         char response[50];
         sprintf(response, "OK %d", pos);
@@ -140,27 +299,95 @@ static void cmd_reqpos(airplane *plane, char *rest) {
 
 
 /************************************************************************
- * Handle the "REQAHEAD" command.
+ * Handle the "SUBSCRIBE" command. Replies OK and then the plane's current
+ * position as a "POS n" line; after that, a new "POS n" line is sent only
+ * when the position changes, so the plane no longer needs to poll REQPOS.
  */
-static void cmd_reqahead(airplane *plane, char *rest) {
-    if (plane->state != PLANE_TAXIING) {
-        send_err(plane, "Plane not taxiing -- cannot process request");
+static void cmd_subscribe(airplane *plane, char *rest) {
+    if (plane_state(plane) != PLANE_TAXIING) {
+        send_err(plane, ERR_NOTTAXIING);
         return;
     }
 
-    char *aheadList = taxiqueue_getahead(plane->id);
-    if (!aheadList) {
-        send_err(plane, "Server error: unable to retrieve planes ahead");
+    // OK goes out first, so that no update can get ahead of it
+    send_ok(plane);
+    taxiqueue_subscribe(plane, 1, 1);
+}
+
+/************************************************************************
+ * Handle the "UNSUBSCRIBE" command, which stops position updates.
+ */
+static void cmd_unsubscribe(airplane *plane, char *rest) {
+    if (plane_state(plane) == PLANE_UNREG) {
+        send_err(plane, ERR_UNREG);
         return;
     }
 
-    if (strlen(aheadList) > 0) {
-        fprintf(plane->fp_send, "OK %s\n", aheadList);
+    taxiqueue_subscribe(plane, 0, 0);
+    send_ok(plane);
+}
+
+/************************************************************************
+ * Writes a REQAHEAD reply for the list handed over by taxiqueue_getahead.
+ * The list points into the taxi queue's own rendering of the queue, so it
+ * goes straight out to the plane without being copied anywhere first.
+ */
+static void send_ahead(airplane *plane, const char *list, int len, int count) {
+    if (plane->proto == PROTO_BINARY) {
+        bin_send_ahead(plane, list, len, count);
+    } else if (len > 0) {
+        fprintf(plane->fp_send, "OK %.*s\n", len, list);
     } else {
         fprintf(plane->fp_send, "OK No planes ahead\n");
     }
+}
+
+/************************************************************************
+ * Parses an optional non-negative integer argument off the front of
+ * "*rest", advancing *rest past it. Returns the value, "def" if there are
+ * no more arguments, or -2 if the argument is not a valid number.
+ */
+static int next_count_arg(char **rest, int def) {
+    if (*rest == NULL)
+        return def;
+
+    char *saveptr;
+    char *arg = strtok_r(*rest, " \t", &saveptr);
+    *rest = strtok_r(NULL, "", &saveptr);
+    if (arg == NULL)
+        return def;
+
+    char *end;
+    long val = strtol(arg, &end, 10);
+    if ((*end != '\0') || (val < 0) || (val > 1000000))
+        return -2;
+    return (int)val;
+}
+
+/************************************************************************
+ * Handle the "REQAHEAD" command. Takes two optional arguments: the most
+ * flights to list, and how many flights (counting back from the head of
+ * the queue) to skip first, so long lists can be paged through as
+ * "REQAHEAD 10", "REQAHEAD 10 10", and so on.
+ */
+static void cmd_reqahead(airplane *plane, char *rest) {
+    if (plane_state(plane) != PLANE_TAXIING) {
+        send_err(plane, ERR_NOTTAXIING);
+        return;
+    }
+
+    int max = next_count_arg(&rest, -1);
+    int skip = next_count_arg(&rest, 0);
+    if ((max == -2) || (skip == -2) || (rest != NULL)) {
+        send_err(plane, ERR_BADARGS);
+        return;
+    }
+
+    if (taxiqueue_getahead(plane, max, skip, send_ahead) < 0) {
+        send_err(plane, ERR_NOTQUEUED);
+        return;
+    }
     fflush(plane->fp_send); // Flush the stream to ensure the response is sent immediately
-    free(aheadList); // Free the memory allocated by taxiqueue_getahead
 }
 
 
@@ -169,20 +396,20 @@ static void cmd_reqahead(airplane *plane, char *rest) {
  * Handle the "INAIR" command.
  */
 static void cmd_inair(airplane *plane, char *rest) {
-    if (plane->state != PLANE_CLEAR) {
-        send_err(plane, "Plane not cleared for takeoff -- cannot process INAIR command");
+    // Entering PLANE_INAIR takes the plane out of the taxi queue (see
+    // taxiqueue_init)
+    if (!plane_transition(plane, PLANE_CLEAR, PLANE_INAIR)) {
+        send_err(plane, ERR_NOTCLEAR);
         return;
     }
+    metrics_takeoff(metrics_now() - plane->cleared_at);
 
-    plane->state = PLANE_INAIR;
-    taxiqueue_inair(plane->id);  // Remove the plane from the taxi queue
-
-    fprintf(plane->fp_send, "OK\n");
-    fprintf(plane->fp_send, "NOTICE Disconnecting from ground control - please connect to air control\n");
+    send_ok(plane);
+    send_notice(plane, "Disconnecting from ground control - please connect to air control");
 
     printf("Client %ld disconnected.\n", plane->thread);
-    printf("Flight %s is in the air - - waiting 4 seconds\n", plane->id);
-    plane->state = PLANE_DONE;
+    printf("Flight %s is in the air\n", flightid_name(plane->fid));
+    plane_done(plane);
 
 }
 
@@ -192,7 +419,149 @@ static void cmd_inair(airplane *plane, char *rest) {
  * Handle the "BYE" command.
  */
 static void cmd_bye(airplane *plane, char *rest) {
-    plane->state = PLANE_DONE;
+    plane_done(plane);
+}
+
+/************************************************************************
+ * Handle the "BINARY" command, which switches the plane over to the
+ * binary protocol (see airs_binary.h). The OK still goes out as text.
+ */
+static void cmd_binary(airplane *plane, char *rest) {
+    send_ok(plane);
+    fflush(plane->fp_send);
+    plane->proto = PROTO_BINARY;
+}
+
+/************************************************************************
+ * The command table. Commands are looked up through a small hash index
+ * (built once, from this table) keyed on the command's length and first
+ * and last bytes, so finding a command costs the same however many
+ * commands there are. New commands only need a CMD_* number in
+ * airs_protocol.h and a line here.
+ */
+typedef void (*cmd_handler)(airplane *plane, char *rest);
+
+typedef struct {
+    const char *name;
+    int len;
+    cmd_handler handler;
+} command_def;
+
+#define CMD(name, handler) { name, sizeof(name) - 1, handler }
+
+static const command_def commands[] = {
+    [CMD_REG] = CMD("REG", cmd_reg),
+    [CMD_REQTAXI] = CMD("REQTAXI", cmd_reqtaxi),
+    [CMD_REQPOS] = CMD("REQPOS", cmd_reqpos),
+    [CMD_REQAHEAD] = CMD("REQAHEAD", cmd_reqahead),
+    [CMD_SUBSCRIBE] = CMD("SUBSCRIBE", cmd_subscribe),
+    [CMD_UNSUBSCRIBE] = CMD("UNSUBSCRIBE", cmd_unsubscribe),
+    [CMD_INAIR] = CMD("INAIR", cmd_inair),
+    [CMD_BYE] = CMD("BYE", cmd_bye),
+    [CMD_BINARY] = CMD("BINARY", cmd_binary),
+};
+
+#define NCOMMANDS ((int)(sizeof(commands) / sizeof(commands[0])))
+
+_Static_assert(NCOMMANDS == CMD_COUNT, "CMD_COUNT must match the command table");
+
+// Open-addressed index into commands[]; 0 is an empty slot, otherwise
+// the command number plus one. Must stay a power of two and comfortably
+// bigger than NCOMMANDS.
+
+#define CMD_INDEX_SIZE 64
+
+static unsigned char command_index[CMD_INDEX_SIZE];
+static pthread_once_t command_once = PTHREAD_ONCE_INIT;
+
+static unsigned int command_hash(const char *name, int len) {
+    return (len * 31 + (unsigned char)name[0] * 7 +
+            (unsigned char)name[len-1]) & (CMD_INDEX_SIZE - 1);
+}
+
+static void command_index_init(void) {
+    for (int i=0; i<NCOMMANDS; i++) {
+        if (commands[i].name == NULL)
+            continue;  // Unused command number
+        unsigned int h = command_hash(commands[i].name, commands[i].len);
+        while (command_index[h] != 0)
+            h = (h + 1) & (CMD_INDEX_SIZE - 1);
+        command_index[h] = i + 1;
+    }
+}
+
+/************************************************************************
+ * Returns the name of command number "cmd" (a CMD_* number).
+ */
+const char *command_name(int cmd) {
+    return commands[cmd].name;
+}
+
+/************************************************************************
+ * Splits a command line, in place and in a single pass, into the command
+ * and its arguments (everything after the command, with surrounding
+ * whitespace removed, or NULL if there is nothing there), and looks the
+ * command up. Returns the command number (its index in the command
+ * table), PARSE_EMPTY for a blank line, or PARSE_UNKNOWN.
+ */
+int parse_command(char *line, char **args) {
+    pthread_once(&command_once, command_index_init);
+
+    unsigned char *p = (unsigned char *)line;
+    while (charclass[*p] & CC_SPACE)
+        p++;
+    if (*p == '\0')
+        return PARSE_EMPTY;
+
+    char *cmd = (char *)p;
+    while (!(charclass[*p] & (CC_SPACE | CC_EOL)))
+        p++;
+    int len = (char *)p - cmd;
+
+    // Arguments run from the first non-blank after the command up to the
+    // end of the line, less any trailing blanks
+    *args = NULL;
+    if (*p != '\0') {
+        *p++ = '\0';
+        while ((charclass[*p] & CC_SPACE) && (*p != '\0'))
+            p++;
+        unsigned char *last = NULL;
+        unsigned char *start = p;
+        for (; !(charclass[*p] & CC_EOL); p++) {
+            if (!(charclass[*p] & CC_SPACE))
+                last = p;
+        }
+        if (last != NULL) {
+            last[1] = '\0';
+            *args = (char *)start;
+        }
+    }
+
+    unsigned int h = command_hash(cmd, len);
+    int slot;
+    while ((slot = command_index[h]) != 0) {
+        const command_def *def = &commands[slot - 1];
+        if ((def->len == len) && (memcmp(def->name, cmd, len) == 0))
+            return slot - 1;
+        h = (h + 1) & (CMD_INDEX_SIZE - 1);
+    }
+    return PARSE_UNKNOWN;
+}
+
+/************************************************************************
+ * Runs command number "cmd" with arguments "args" (which may be NULL).
+ * This is where the text and binary protocols meet, so it is also where
+ * each command is timed for the metrics.
+ */
+void runcommand(airplane *plane, int cmd, char *args) {
+    if ((cmd < 0) || (cmd >= NCOMMANDS) || (commands[cmd].handler == NULL)) {
+        send_err(plane, ERR_UNKNOWN);
+        return;
+    }
+
+    long start = metrics_now();
+    commands[cmd].handler(plane, args);
+    metrics_command(cmd, metrics_now() - start);
 }
 
 /************************************************************************
@@ -200,31 +569,38 @@ static void cmd_bye(airplane *plane, char *rest) {
  * optionally arguments) passed in as "command".
  */
 void docommand(airplane *plane, char *command) {
-    char *saveptr;
-    char *cmd = strtok_r(command, " \t\r\n", &saveptr);
-    if (cmd == NULL) {  // Empty line (no command) -- just ignore line
+    char *args;
+    int cmd = parse_command(command, &args);
+    if (cmd == PARSE_EMPTY) {  // Empty line (no command) -- just ignore line
         return;
     }
 
-    // Get arguments (everything after command, trimmed)
-    char *args = strtok_r(NULL, "\r\n", &saveptr);
-    if (args != NULL) {
-        args = trim(args);
-    }
+    runcommand(plane, cmd, args);
+}
 
-    if (strcmp(cmd, "REG") == 0) {
-        cmd_reg(plane, args);
-    } else if (strcmp(cmd, "REQTAXI") == 0) {
-        cmd_reqtaxi(plane, args);
-    } else if (strcmp(cmd, "REQPOS") == 0) {
-        cmd_reqpos(plane, args);
-    } else if (strcmp(cmd, "REQAHEAD") == 0) {
-        cmd_reqahead(plane, args);
-    } else if (strcmp(cmd, "INAIR") == 0) {
-        cmd_inair(plane, args);
-    } else if (strcmp(cmd, "BYE") == 0) {
-        cmd_bye(plane, args);
-    } else {
-        send_err(plane, "Unknown command");
+/************************************************************************
+ * Runs every complete command waiting in the plane's receive buffer, as
+ * text lines or binary frames depending on the protocol the plane is
+ * speaking (which can change partway through). Stops early if the plane
+ * is done.
+ */
+void doinput(airplane *plane) {
+    while (plane_state(plane) != PLANE_DONE) {
+        int got;
+        if (plane->proto == PROTO_BINARY) {
+            char *frame;
+            int len;
+            if ((got = rxbuf_frame(&plane->rx, &frame, &len)) > 0)
+                docommand_binary(plane, (unsigned char *)frame, len);
+        } else {
+            char *line;
+            if ((got = rxbuf_next(&plane->rx, &line)) > 0)
+                docommand(plane, line);
+        }
+
+        if (got == 0)
+            return;
+        if (got < 0)
+            send_err(plane, ERR_TOOLONG);
     }
-}
\ No newline at end of file
+}
@@ -3,11 +3,60 @@
 #ifndef _AIRS_COMMANDS_H
 #define _AIRS_COMMANDS_H
 
+// Command numbers. These are also the opcodes of the binary protocol
+// (see airs_binary.h), so existing numbers must never change.
+
+#define CMD_REG 0
+#define CMD_REQTAXI 1
+#define CMD_REQPOS 2
+#define CMD_REQAHEAD 3
+#define CMD_SUBSCRIBE 4
+#define CMD_UNSUBSCRIBE 5
+#define CMD_INAIR 6
+#define CMD_BYE 7
+#define CMD_BINARY 8
+#define CMD_COUNT 9     // One more than the highest command number
+
+// Special results from parse_command
+
+#define PARSE_EMPTY -1
+#define PARSE_UNKNOWN -2
+
+// Error codes. The text protocol sends the matching description, and the
+// binary protocol sends the code itself, so these must never change.
+
+#define ERR_UNKNOWN 1        // Unknown command
+#define ERR_TOOLONG 2        // Command too long
+#define ERR_REGISTERED 3     // Already registered
+#define ERR_NOID 4           // REG missing flightid
+#define ERR_BADID 5          // Invalid flight id characters
+#define ERR_IDLEN 6          // Invalid flight id length
+#define ERR_DUPID 7          // Duplicate flight id
+#define ERR_UNREG 8          // Unregistered plane
+#define ERR_NOTATTERMINAL 9  // Not at the terminal
+#define ERR_NOTTAXIING 10    // Not taxiing
+#define ERR_NOTQUEUED 11     // Not in taxi queue
+#define ERR_BADARGS 12       // Invalid arguments
+#define ERR_NOTCLEAR 13      // Not cleared for takeoff
+#define ERR_NOAIRPORT 14     // REG missing airport (hosting many airports)
+#define ERR_BADAIRPORT 15    // Invalid airport code
+#define ERR_COUNT 16         // One more than the highest error code
+
+// The wire protocol a plane is speaking (airplane.proto)
+
+#define PROTO_TEXT 0
+#define PROTO_BINARY 1
 
 void send_ok(airplane *plane);
-void send_err(airplane *plane, char *desc);
-void send_err_sarg(airplane *plane, char *fmtstring, char *sarg);
+void send_err(airplane *plane, int code);
+void send_err_sarg(airplane *plane, int code, const char *sarg);
+void send_pos(airplane *plane, int pos);
+void send_takeoff(airplane *plane);
 
+const char *command_name(int cmd);
+int parse_command(char *line, char **args);
+void runcommand(airplane *plane, int cmd, char *args);
 void docommand(airplane *plane, char *command);
+void doinput(airplane *plane);
 
-#endif  // _AIRS_COMMANDS_H
\ No newline at end of file
+#endif  // _AIRS_COMMANDS_H
@@ -1,6 +1,8 @@
 // CSC 362 - C implementation of an arraylist - for Fall 2023 project
 
-// This version is thread-safe and items are generic
+// This version is thread-safe and items are generic. The locking can be
+// turned off (see alist_init_unlocked) when the caller already holds a
+// lock that covers the list, so it isn't paid for twice.
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,6 +10,24 @@
 
 #include "alist.h"
 
+/***************************************************************************
+ * Lock helpers: these do nothing for an externally-synchronized alist.
+ */
+static void alist_rdlock(alist *a) {
+    if (a->locked)
+        pthread_rwlock_rdlock(&(a->lock));
+}
+
+static void alist_wrlock(alist *a) {
+    if (a->locked)
+        pthread_rwlock_wrlock(&(a->lock));
+}
+
+static void alist_unlock(alist *a) {
+    if (a->locked)
+        pthread_rwlock_unlock(&(a->lock));
+}
+
 /***************************************************************************
  * alist_init initializes an array list to empty and with the default
  * capacity.
@@ -22,19 +42,30 @@ void alist_init(alist *a, void (*data_free)(void *data) ) {
     a->capacity = DEF_CAPACITY;
     a->in_use = 0;
     a->dfree = data_free;
+    a->locked = 1;
+}
+
+/***************************************************************************
+ * alist_init_unlocked initializes an array list just like alist_init, but
+ * the list will never lock itself. The caller must make sure that nobody
+ * changes the list while anyone else is using it.
+ */
+void alist_init_unlocked(alist *a, void (*data_free)(void *data) ) {
+    alist_init(a, data_free);
+    a->locked = 0;
 }
 
 /***************************************************************************
  * alist_clear resets the size of the array list to 0 (empties the alist).
  */
 void alist_clear(alist *a) {
-    pthread_rwlock_wrlock(&(a->lock));
+    alist_wrlock(a);
     for (int i=0; i<a->in_use; i++) {
         a->dfree(a->data[i]);
     }
 
     a->in_use = 0;
-    pthread_rwlock_unlock(&(a->lock));
+    alist_unlock(a);
 }
 
 /***************************************************************************
@@ -42,14 +73,17 @@ void alist_clear(alist *a) {
  */
 
 int alist_is_empty(alist *a) {
-    return (a->in_use == 0);
+    return (alist_size(a) == 0);
 }
 
 /***************************************************************************
  * alist_size returns the size of the array list
  */
 int alist_size(alist *a) {
-    return a->in_use;
+    alist_rdlock(a);
+    int size = a->in_use;
+    alist_unlock(a);
+    return size;
 }
 
 /***************************************************************************
@@ -57,14 +91,14 @@ int alist_size(alist *a) {
  * an invalid index.
  */
 void *alist_get(alist *a, int index) {
-    pthread_rwlock_rdlock(&(a->lock));
+    alist_rdlock(a);
     if ((index < 0) || (index >= a->in_use)) {
-        pthread_rwlock_unlock(&(a->lock));
+        alist_unlock(a);
         return NULL;
     }
 
     void *retval = a->data[index];
-    pthread_rwlock_unlock(&(a->lock));
+    alist_unlock(a);
     return retval;
 }
 
@@ -72,7 +106,7 @@ void *alist_get(alist *a, int index) {
  * alist_add appends a new value to the end of the array list.
  */
 void alist_add(alist *a, void *val) {
-    pthread_rwlock_wrlock(&(a->lock));
+    alist_wrlock(a);
     if (a->in_use == a->capacity) {
         void *newdata = realloc(a->data, 2*a->capacity*sizeof(void *));
         if (newdata == NULL) {
@@ -84,7 +118,7 @@ void alist_add(alist *a, void *val) {
     }
 
     a->data[a->in_use++] = val;
-    pthread_rwlock_unlock(&(a->lock));
+    alist_unlock(a);
 }
 
 /***************************************************************************
@@ -93,15 +127,15 @@ void alist_add(alist *a, void *val) {
  * request is ignored).
  */
 void alist_set(alist *a, int index, void *val) {
-    pthread_rwlock_wrlock(&(a->lock));
+    alist_wrlock(a);
     if ((index < 0) || (index >= a->in_use)) {
-        pthread_rwlock_unlock(&(a->lock));
+        alist_unlock(a);
         return;
     }
 
     a->dfree(a->data[index]);
     a->data[index] = val;
-    pthread_rwlock_unlock(&(a->lock));
+    alist_unlock(a);
 }
 
 /***************************************************************************
@@ -110,9 +144,9 @@ void alist_set(alist *a, int index, void *val) {
  * the list, then nothing happens.
  */
 void alist_remove(alist *a, int index) {
-    pthread_rwlock_wrlock(&(a->lock));
+    alist_wrlock(a);
     if ((index < 0) || (index >= a->in_use)) {
-        pthread_rwlock_unlock(&(a->lock));
+        alist_unlock(a);
         return;
     }
 
@@ -120,7 +154,27 @@ void alist_remove(alist *a, int index) {
     for (int i=index; i<a->in_use-1; i++)
         a->data[i] = a->data[i+1];
     a->in_use--;
-    pthread_rwlock_unlock(&(a->lock));
+    alist_unlock(a);
+}
+
+/***************************************************************************
+ * alist_foreach calls "visit" on each item in order, holding the list's
+ * lock (if it has one) once for the whole walk rather than once per item.
+ * The walk stops early if visit returns nonzero, and the index of that
+ * item is returned; otherwise returns -1. Since the list is locked, visit
+ * must not call other alist functions on the same list.
+ */
+int alist_foreach(alist *a, alist_visit visit, void *arg) {
+    alist_rdlock(a);
+    for (int i=0; i<a->in_use; i++) {
+        if (visit(a->data[i], arg)) {
+            alist_unlock(a);
+            return i;
+        }
+    }
+
+    alist_unlock(a);
+    return -1;
 }
 
 /***************************************************************************
@@ -128,7 +182,7 @@ void alist_remove(alist *a, int index) {
  * and resources.
  */
 void alist_destroy(alist *a) {
-    pthread_rwlock_wrlock(&(a->lock));
+    alist_wrlock(a);
     for (int i=0; i<a->in_use; i++) {
         a->dfree(a->data[i]);
     }
@@ -137,5 +191,5 @@ void alist_destroy(alist *a) {
     free(a->data);
     a->data = NULL;
     a->capacity = 0;
-    pthread_rwlock_unlock(&(a->lock));
+    alist_unlock(a);
 }
\ No newline at end of file
@@ -12,12 +12,20 @@ typedef struct {
     int capacity;  // How big is the data array
     int in_use;    // How many items are in use (items 0..in_use-1)
     void (*dfree)(void *data); // Data destructor/freer
+    int locked;    // Whether the alist takes its own lock (see below)
     pthread_rwlock_t lock;
 } alist;
 
-// Function prototypes
+// Callback for alist_foreach: return nonzero to stop the iteration
+
+typedef int (*alist_visit)(void *item, void *arg);
+
+// Function prototypes. An alist set up with alist_init does its own
+// locking on every call. One set up with alist_init_unlocked never locks,
+// and is for callers that already protect it with a lock of their own.
 
 void alist_init(alist *a, void (*data_free)(void *data));
+void alist_init_unlocked(alist *a, void (*data_free)(void *data));
 void alist_clear(alist *a);
 int alist_is_empty(alist *a);
 int alist_size(alist *a);
@@ -25,6 +33,7 @@ void *alist_get(alist *a, int index);
 void alist_add(alist *a, void *val);
 void alist_set(alist *a, int index, void *newval);
 void alist_remove(alist *a, int index);
+int alist_foreach(alist *a, alist_visit visit, void *arg);
 void alist_destroy(alist *a);
 
 #endif  // _ALIST_H
\ No newline at end of file
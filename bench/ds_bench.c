@@ -0,0 +1,500 @@
+// Microbenchmarks for the server's core data structures: alist, planelist
+// and taxiqueue.
+//
+// Each operation is timed single-threaded at several sizes, and then
+// again under contention: one writer thread changing the structure as
+// fast as it can while the other threads run the operation being
+// measured. Results are one row per measurement, as CSV (the default) or
+// JSON, so runs from different versions can be compared directly; "-l"
+// tags every row with a label such as a git revision.
+//
+// Build with "make bench", which links in every module of the server
+// but its main loops (LIB_OBJS in the Makefile).
+//
+// Usage: ds_bench [-f csv|json] [-t threads] [-d ms] [-l label] [-q]
+//   -f       output format (default csv)
+//   -t       threads for the contended runs, one of them the writer
+//            (default 4)
+//   -d       length of each contended run in ms (default 300)
+//   -l       label for every row (default "dev")
+//   -q       quick run: smaller sizes only, for smoke testing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "airplane.h"
+#include "airport.h"
+#include "alist.h"
+#include "planelist.h"
+#include "planepool.h"
+#include "taxiqueue.h"
+#include "timers.h"
+
+static FILE *results;      // The real stdout; the modules' chatter is dropped
+static int json = 0;
+static int first_row = 1;
+static const char *label = "dev";
+static int nthreads = 4;
+static long contend_ns = 300 * 1000000L;
+static int quick = 0;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// xorshift64, so each thread has a cheap generator of its own
+static inline unsigned long next_rand(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/************************************************************************
+ * Writes one result row. "role" is "single" for single-threaded runs, or
+ * "reader"/"writer" for the two sides of a contended run.
+ */
+static void report(const char *bench, long size, int threads,
+                   const char *role, long ops, long elapsed_ns) {
+    double secs = elapsed_ns / 1e9;
+    double ns_per_op = (ops > 0) ? (double)elapsed_ns / ops : 0;
+    double ops_per_sec = (secs > 0) ? ops / secs : 0;
+
+    if (json) {
+        fprintf(results, "%s\n  {\"label\": \"%s\", \"bench\": \"%s\", "
+                "\"size\": %ld, \"threads\": %d, \"role\": \"%s\", "
+                "\"ops\": %ld, \"seconds\": %.6f, \"ns_per_op\": %.1f, "
+                "\"ops_per_sec\": %.0f}", first_row ? "[" : ",", label,
+                bench, size, threads, role, ops, secs, ns_per_op, ops_per_sec);
+    } else {
+        if (first_row)
+            fprintf(results, "label,bench,size,threads,role,ops,seconds,"
+                    "ns_per_op,ops_per_sec\n");
+        fprintf(results, "%s,%s,%ld,%d,%s,%ld,%.6f,%.1f,%.0f\n", label, bench,
+                size, threads, role, ops, secs, ns_per_op, ops_per_sec);
+    }
+    first_row = 0;
+    fflush(results);
+}
+
+/************************************************************************
+ * Contended runs. One writer thread runs "write_op" and nthreads-1
+ * reader threads run "read_op" until the time is up; each op function
+ * does one operation and is handed its thread's random state.
+ */
+typedef void (*bench_op)(void *ctx, unsigned long *rand_state);
+
+typedef struct {
+    bench_op op;
+    void *ctx;
+    long ops;
+    unsigned long seed;
+    pthread_t thread;
+} contender;
+
+static volatile int contend_stop;
+
+static void *contender_main(void *arg) {
+    contender *c = (contender *)arg;
+    unsigned long state = c->seed;
+    long ops = 0;
+    while (!contend_stop) {
+        for (int i=0; i<64; i++)
+            c->op(c->ctx, &state);
+        ops += 64;
+    }
+    c->ops = ops;
+    return NULL;
+}
+
+static void contend(const char *bench, long size, bench_op read_op,
+                    bench_op write_op, void *ctx) {
+    if (nthreads < 2)
+        return;
+
+    contender *cs = calloc(nthreads, sizeof(contender));
+    if (cs == NULL) {
+        perror("ds_bench");
+        exit(1);
+    }
+    contend_stop = 0;
+    long start = now_ns();
+    for (int i=0; i<nthreads; i++) {
+        cs[i].op = (i == 0) ? write_op : read_op;
+        cs[i].ctx = ctx;
+        cs[i].seed = 0x9E3779B97F4A7C15UL * (i + 1);
+        pthread_create(&cs[i].thread, NULL, contender_main, &cs[i]);
+    }
+    usleep(contend_ns / 1000);
+    contend_stop = 1;
+
+    long readers = 0;
+    for (int i=0; i<nthreads; i++) {
+        pthread_join(cs[i].thread, NULL);
+        if (i > 0)
+            readers += cs[i].ops;
+    }
+    long elapsed = now_ns() - start;
+
+    report(bench, size, nthreads, "writer", cs[0].ops, elapsed);
+    report(bench, size, nthreads, "reader", readers, elapsed);
+    free(cs);
+}
+
+/************************************************************************
+ * alist: add, get and remove at each size, on a list that locks itself
+ * (as a shared list would).
+ */
+static void no_free(void *item) {
+}
+
+typedef struct {
+    alist list;
+    long size;   // Readers only touch indexes below this
+} alist_ctx;
+
+static void alist_read(void *ctx, unsigned long *rs) {
+    alist_ctx *a = (alist_ctx *)ctx;
+    alist_get(&a->list, next_rand(rs) % a->size);
+}
+
+static void alist_write(void *ctx, unsigned long *rs) {
+    alist_ctx *a = (alist_ctx *)ctx;
+    alist_add(&a->list, a);
+    alist_remove(&a->list, alist_size(&a->list) - 1);
+}
+
+static void bench_alist(long size) {
+    alist_ctx a;
+    alist_init(&a.list, no_free);
+    a.size = size;
+
+    long start = now_ns();
+    for (long i=0; i<size; i++)
+        alist_add(&a.list, (void *)(i + 1));
+    report("alist_add", size, 1, "single", size, now_ns() - start);
+
+    unsigned long rs = 88172645463325252UL;
+    long gets = 1000000;
+    long sum = 0;
+    start = now_ns();
+    for (long i=0; i<gets; i++)
+        sum += (long)alist_get(&a.list, next_rand(&rs) % size);
+    report("alist_get", size, 1, "single", gets, now_ns() - start);
+    if (sum == 0)
+        fprintf(stderr, "ds_bench: impossible alist_get sum\n");
+
+    contend("alist_get", size, alist_read, alist_write, &a);
+
+    // Removing from the middle shifts everything after it, so only a
+    // bounded number are timed, each put back at the end to keep the size
+    long removes = (size < 10000) ? size : 10000;
+    long elapsed = 0;
+    for (long i=0; i<removes; i++) {
+        int index = next_rand(&rs) % size;
+        start = now_ns();
+        alist_remove(&a.list, index);
+        elapsed += now_ns() - start;
+        alist_add(&a.list, (void *)(i + 1));
+    }
+    report("alist_remove", size, 1, "single", removes, elapsed);
+
+    alist_destroy(&a.list);
+}
+
+/************************************************************************
+ * planelist: registering planes (add plus changeid), find (hits and
+ * misses), and remove, as the list grows. Every plane comes from the
+ * plane pool and gets its own /dev/null writer only when it is about to
+ * be removed, since removing a plane closes its writer.
+ */
+typedef struct {
+    airplane **planes;
+    long count;
+    FILE *sink;
+    long churn;    // Writer's next plane number
+} planelist_ctx;
+
+static airplane *bench_plane(FILE *sink, const char *fmt, long n) {
+    airplane *p = planepool_get();
+    airplane_init(p, -1, sink);
+    char id[32];   // Numbers stay well short of PLANE_MAXID
+    snprintf(id, sizeof(id), fmt, n);
+    planelist_add(p);
+    planelist_changeid(p, flightid_intern(0, id));
+    return p;
+}
+
+static void plane_retire(airplane *p) {
+    p->fp_send = fopen("/dev/null", "w");
+    planelist_remove(p);   // Closes fp_send and puts p back in the pool
+}
+
+static void planelist_read(void *ctx, unsigned long *rs) {
+    planelist_ctx *pl = (planelist_ctx *)ctx;
+    planelist_find(pl->planes[next_rand(rs) % pl->count]->fid);
+}
+
+static void planelist_write(void *ctx, unsigned long *rs) {
+    planelist_ctx *pl = (planelist_ctx *)ctx;
+    plane_retire(bench_plane(pl->sink, "W%ld", pl->churn++));
+}
+
+static void bench_planelist(void) {
+    long sizes[] = { 10000, 30000, 100000 };
+    int nsizes = quick ? 1 : 3;
+
+    planelist_ctx pl;
+    pl.sink = fopen("/dev/null", "w");
+    pl.planes = malloc(sizes[nsizes-1] * sizeof(airplane *));
+    if ((pl.sink == NULL) || (pl.planes == NULL)) {
+        perror("ds_bench - planelist");
+        exit(1);
+    }
+    pl.count = 0;
+    pl.churn = 0;
+
+    unsigned long rs = 2463534242UL;
+    for (int s=0; s<nsizes; s++) {
+        long size = sizes[s];
+        long added = size - pl.count;
+        long start = now_ns();
+        for (; pl.count<size; pl.count++)
+            pl.planes[pl.count] = bench_plane(pl.sink, "P%ld", pl.count);
+        report("planelist_register", size, 1, "single", added,
+               now_ns() - start);
+
+        long finds = 1000000;
+        start = now_ns();
+        for (long i=0; i<finds; i++)
+            planelist_find(pl.planes[next_rand(&rs) % pl.count]->fid);
+        report("planelist_find", size, 1, "single", finds, now_ns() - start);
+
+        char missing[32];
+        start = now_ns();
+        for (long i=0; i<finds; i++) {
+            snprintf(missing, sizeof(missing), "X%d", (int)(i & 0xFFFF));
+            planelist_find(flightid_lookup(0, missing));
+        }
+        report("planelist_find_miss", size, 1, "single", finds,
+               now_ns() - start);
+
+        contend("planelist_find", size, planelist_read, planelist_write, &pl);
+
+        // Remove random planes, replacing each with a new one of the
+        // same name so the list keeps its size
+        long removes = 1000;
+        long elapsed = 0;
+        for (long i=0; i<removes; i++) {
+            long victim = next_rand(&rs) % pl.count;
+            airplane *p = pl.planes[victim];
+            p->fp_send = fopen("/dev/null", "w");
+            start = now_ns();
+            planelist_remove(p);
+            elapsed += now_ns() - start;
+            pl.planes[victim] = bench_plane(pl.sink, "P%ld", victim);
+        }
+        report("planelist_remove", size, 1, "single", removes, elapsed);
+    }
+}
+
+/************************************************************************
+ * taxiqueue: getpos, getahead, inair (from the head, in order) and
+ * remove (from anywhere) on deep queues. The planes aren't in the
+ * planelist, so none is ever cleared for takeoff and nothing is sent.
+ */
+typedef struct {
+    airplane *planes;
+    long depth;
+} taxi_ctx;
+
+static long ahead_bytes;
+
+static void ahead_sink(airplane *plane, const char *list, int len, int count) {
+    ahead_bytes += len;
+}
+
+static void taxi_enqueue(airplane *p) {
+    plane_restore(p, PLANE_TAXIING);
+    taxiqueue_add(p);
+}
+
+static void taxi_read_pos(void *ctx, unsigned long *rs) {
+    taxi_ctx *t = (taxi_ctx *)ctx;
+    taxiqueue_getpos(&t->planes[next_rand(rs) % t->depth]);
+}
+
+static void taxi_read_ahead(void *ctx, unsigned long *rs) {
+    taxi_ctx *t = (taxi_ctx *)ctx;
+    taxiqueue_getahead(&t->planes[next_rand(rs) % t->depth], 10, 0, ahead_sink);
+}
+
+// The writer cycles a plane from the queue back onto its tail, so the
+// queue's depth (and every reader's plane) stays put
+static void taxi_write(void *ctx, unsigned long *rs) {
+    taxi_ctx *t = (taxi_ctx *)ctx;
+    airplane *p = &t->planes[next_rand(rs) % t->depth];
+    if (p->taxi_ticket == 0)
+        return;
+    taxiqueue_remove(p);
+    taxiqueue_add(p);
+}
+
+static int by_ticket(const void *a, const void *b) {
+    long x = (*(airplane * const *)a)->taxi_ticket;
+    long y = (*(airplane * const *)b)->taxi_ticket;
+    return (x > y) - (x < y);
+}
+
+static void bench_taxiqueue(void) {
+    long depths[] = { 1000, 10000, 100000 };
+    int ndepths = quick ? 2 : 3;
+
+    taxi_ctx t;
+    t.planes = calloc(depths[ndepths-1], sizeof(airplane));
+    if (t.planes == NULL) {
+        perror("ds_bench - taxiqueue");
+        exit(1);
+    }
+    for (long i=0; i<depths[ndepths-1]; i++) {
+        char id[32];
+        airplane_init(&t.planes[i], -1, NULL);
+        snprintf(id, sizeof(id), "Q%ld", i);
+        t.planes[i].fid = flightid_intern(0, id);
+    }
+
+    unsigned long rs = 1181783497276652981UL;
+    for (int d=0; d<ndepths; d++) {
+        long depth = t.depth = depths[d];
+
+        long start = now_ns();
+        for (long i=0; i<depth; i++)
+            taxi_enqueue(&t.planes[i]);
+        report("taxiqueue_add", depth, 1, "single", depth, now_ns() - start);
+
+        long reads = 1000000;
+        start = now_ns();
+        for (long i=0; i<reads; i++)
+            taxiqueue_getpos(&t.planes[next_rand(&rs) % depth]);
+        report("taxiqueue_getpos", depth, 1, "single", reads, now_ns() - start);
+
+        start = now_ns();
+        for (long i=0; i<reads; i++)
+            taxiqueue_getahead(&t.planes[next_rand(&rs) % depth], 10, 0,
+                               ahead_sink);
+        report("taxiqueue_getahead", depth, 1, "single", reads,
+               now_ns() - start);
+
+        contend("taxiqueue_getpos", depth, taxi_read_pos, taxi_write, &t);
+        contend("taxiqueue_getahead", depth, taxi_read_ahead, taxi_write, &t);
+
+        // The contended runs shuffled the queue, so go by ticket order:
+        // take the head off repeatedly, as departures would
+        airplane **order = malloc(depth * sizeof(airplane *));
+        if (order == NULL) {
+            perror("ds_bench - taxiqueue");
+            exit(1);
+        }
+        for (long i=0; i<depth; i++)
+            order[i] = &t.planes[i];
+        qsort(order, depth, sizeof(airplane *), by_ticket);
+
+        long inairs = (depth / 2 < 10000) ? depth / 2 : 10000;
+        start = now_ns();
+        for (long i=0; i<inairs; i++) {
+            // Leaving the queue is the PLANE_INAIR hook; these planes
+            // were never really cleared, so they are put there first
+            plane_restore(order[i], PLANE_CLEAR);
+            plane_transition(order[i], PLANE_CLEAR, PLANE_INAIR);
+        }
+        report("taxiqueue_inair", depth, 1, "single", inairs, now_ns() - start);
+        free(order);
+
+        // Then take the rest out in random order, which leaves holes
+        // all through the queue
+        long removes = 0;
+        for (long i=depth-1; i>0; i--) {
+            long j = next_rand(&rs) % (i + 1);
+            airplane tmp = t.planes[i];
+            t.planes[i] = t.planes[j];
+            t.planes[j] = tmp;
+        }
+        start = now_ns();
+        for (long i=0; i<depth; i++) {
+            if (t.planes[i].taxi_ticket != 0) {
+                taxiqueue_remove(&t.planes[i]);
+                removes++;
+            }
+        }
+        report("taxiqueue_remove", depth, 1, "single", removes,
+               now_ns() - start);
+    }
+    free(t.planes);
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "Usage: %s [-f csv|json] [-t threads] [-d ms] [-l label]"
+            " [-q]\n", progname);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "f:t:d:l:q")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (strcmp(optarg, "json") == 0)
+                json = 1;
+            else if (strcmp(optarg, "csv") != 0)
+                usage(argv[0]);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            contend_ns = atol(optarg) * 1000000L;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'q':
+            quick = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // Results go to the real stdout; the modules' own printf logging
+    // (takeoffs and such) is thrown away
+    results = fdopen(dup(1), "w");
+    if ((results == NULL) || (freopen("/dev/null", "w", stdout) == NULL)) {
+        perror("ds_bench - stdout");
+        exit(1);
+    }
+
+    timers_init();
+    planepool_init(0);
+    planelist_init();
+    taxiqueue_init(1, 3600 * 1000);  // No second clearance during a run
+    airport_init(NULL);
+
+    long alist_sizes[] = { 100, 1000, 10000, 100000 };
+    for (int i=0; i<(quick ? 2 : 4); i++)
+        bench_alist(alist_sizes[i]);
+    bench_planelist();
+    bench_taxiqueue();
+
+    if (json)
+        fprintf(results, "%s\n", first_row ? "[]" : "\n]");
+    fclose(results);
+    return 0;
+}
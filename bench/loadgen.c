@@ -0,0 +1,536 @@
+// Load generator and end-to-end benchmark for the ground control server.
+//
+// Opens a number of simulated planes to a running server and drives each
+// one through a script: REG, then (optionally) REQTAXI, then polling with
+// REQPOS/REQAHEAD at a fixed interval (or back to back) until it is
+// cleared, then INAIR. Planes that take off can be replaced with new
+// ones so the population, and the depth of the taxi queue, stays steady.
+//
+// Each plane has at most one request outstanding, and replies come back
+// in order, so every OK/ERR is matched to the request that caused it and
+// timed. TAKEOFF is timed from when the plane sent REQTAXI. At the end the
+// throughput and latency percentiles are printed per request type.
+//
+// Planes are split over a few threads, each running its own epoll loop,
+// so one loadgen process can hold tens of thousands of connections.
+//
+// Build with "make bench", or from the top of the tree with:
+//   gcc -O2 -Wall -pthread -o bench/loadgen bench/loadgen.c
+//
+// Usage: loadgen [-S scenario] [options]  (loadgen -? lists them)
+// "make bench-ci" runs every canned scenario against a fresh server.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// What a simulated plane does. Canned scenarios are in the table below;
+// any field can be overridden on the command line.
+
+typedef struct {
+    const char *name;
+    const char *about;
+    int planes;       // Planes connected at once
+    int taxi;         // Request taxi after registering
+    int poll_ms;      // Time between polls; 0 = back to back, -1 = never
+    int ahead_pct;    // Percent of polls that are REQAHEAD (the rest REQPOS)
+    int inair;        // Send INAIR when cleared for takeoff
+    int recycle;      // Replace planes that took off with new ones
+    int duration;     // Seconds to run
+} scenario;
+
+static const scenario scenarios[] = {
+    { "idle1k", "1k planes register and then sit idle at the terminal",
+      1000, 0, -1, 0, 0, 0, 10 },
+    { "queue10k", "10k planes in the taxi queue, each polling once a second",
+      10000, 1, 1000, 10, 1, 1, 20 },
+    { "pollstorm", "200 queued planes polling back to back",
+      200, 1, 0, 50, 1, 1, 10 },
+};
+
+#define NSCENARIOS ((int)(sizeof(scenarios) / sizeof(scenarios[0])))
+
+// Request types, for the latency stats; STAT_CLEAR is REQTAXI to TAKEOFF
+
+#define STAT_REG 0
+#define STAT_REQTAXI 1
+#define STAT_REQPOS 2
+#define STAT_REQAHEAD 3
+#define STAT_INAIR 4
+#define STAT_CLEAR 5
+#define NSTATS 6
+
+static const char *stat_names[NSTATS] = {
+    "REG", "REQTAXI", "REQPOS", "REQAHEAD", "INAIR", "clearance",
+};
+
+#define NONE -1
+
+// Samples are kept whole (ns each) and sorted at the end, so percentiles
+// are exact
+
+typedef struct {
+    long *samples;
+    long count;
+    long cap;
+    long errors;   // ERR replies
+} stat;
+
+#define RBUF_SIZE 4096
+
+typedef struct {
+    int fd;
+    char id[24];
+    int pending;      // STAT_* of the request in flight, or NONE
+    long sent_at;     // When it was sent
+    long taxi_at;     // When REQTAXI was sent
+    long next_poll;   // When to send the next poll
+    int cleared;      // Got TAKEOFF
+    int rlen;
+    char rbuf[RBUF_SIZE];
+} sim_plane;
+
+typedef struct {
+    int index;
+    pthread_t thread;
+    int nplanes;
+    sim_plane *planes;
+    int epfd;
+    long next_serial;     // For naming replacement planes
+    unsigned int seed;    // For rand_r
+    stat stats[NSTATS];
+    long replies;
+    long takeoffs;
+    long failures;        // Connections that failed or dropped
+} worker;
+
+static scenario config;
+static struct addrinfo *server_addr;
+static long end_time;
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void stat_add(stat *s, long ns) {
+    if (s->count == s->cap) {
+        s->cap = (s->cap == 0) ? 4096 : s->cap * 2;
+        if ((s->samples = realloc(s->samples, s->cap * sizeof(long))) == NULL) {
+            perror("loadgen - stats");
+            exit(1);
+        }
+    }
+    s->samples[s->count++] = ns;
+}
+
+/************************************************************************
+ * Plane I/O. send_request sends one request and starts its clock.
+ */
+static void send_request(worker *w, sim_plane *p, int kind) {
+    char line[64];
+    int len;
+    switch (kind) {
+    case STAT_REG:
+        len = snprintf(line, sizeof(line), "REG %s\n", p->id);
+        break;
+    case STAT_REQTAXI:
+        len = snprintf(line, sizeof(line), "REQTAXI\n");
+        break;
+    case STAT_REQPOS:
+        len = snprintf(line, sizeof(line), "REQPOS\n");
+        break;
+    case STAT_REQAHEAD:
+        len = snprintf(line, sizeof(line), "REQAHEAD 10\n");
+        break;
+    default:
+        len = snprintf(line, sizeof(line), "INAIR\n");
+        break;
+    }
+
+    p->pending = kind;
+    p->sent_at = now_ns();
+    if (kind == STAT_REQTAXI)
+        p->taxi_at = p->sent_at;
+
+    // One short request at a time never fills the socket buffer
+    if (send(p->fd, line, len, MSG_NOSIGNAL) != len)
+        w->failures++;
+}
+
+/************************************************************************
+ * plane_open connects plane "p" under a fresh name and registers it.
+ * Returns 0, or -1 if the connection failed.
+ */
+static int plane_open(worker *w, sim_plane *p) {
+    memset(p, 0, sizeof(*p));
+    snprintf(p->id, sizeof(p->id), "LG%dN%ld", w->index, w->next_serial++);
+    p->pending = NONE;
+
+    p->fd = socket(server_addr->ai_family, SOCK_STREAM, 0);
+    if ((p->fd < 0) ||
+        (connect(p->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0)) {
+        perror("loadgen - connect");
+        if (p->fd >= 0)
+            close(p->fd);
+        p->fd = -1;
+        w->failures++;
+        return -1;
+    }
+    int one = 1;
+    setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = p };
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, p->fd, &ev);
+
+    send_request(w, p, STAT_REG);
+    return 0;
+}
+
+static void plane_close(sim_plane *p) {
+    if (p->fd >= 0)
+        close(p->fd);   // Also takes it out of the epoll set
+    p->fd = -1;
+}
+
+/************************************************************************
+ * What a plane does once a request is answered (or once its poll timer
+ * is up): the next step of the scenario's script.
+ */
+static void plane_next(worker *w, sim_plane *p, long now) {
+    if (p->cleared) {
+        if (config.inair)
+            send_request(w, p, STAT_INAIR);
+        return;
+    }
+    if (config.poll_ms < 0)
+        return;
+    if (now < p->next_poll)
+        return;
+
+    int ahead = (rand_r(&w->seed) % 100) < config.ahead_pct;
+    send_request(w, p, ahead ? STAT_REQAHEAD : STAT_REQPOS);
+}
+
+/************************************************************************
+ * Handles one line from the server. Returns 1 if that finished the plane
+ * (which may have been replaced by a new one), so the rest of its input
+ * is to be ignored.
+ */
+static int plane_line(worker *w, sim_plane *p, char *line) {
+    long now = now_ns();
+
+    if (strncmp(line, "TAKEOFF", 7) == 0) {
+        stat_add(&w->stats[STAT_CLEAR], now - p->taxi_at);
+        p->cleared = 1;
+        w->takeoffs++;
+        if (p->pending == NONE)
+            plane_next(w, p, now);
+        return 0;
+    }
+    if ((strncmp(line, "OK", 2) != 0) && (strncmp(line, "ERR", 3) != 0))
+        return 0;   // NOTICE or POS
+
+    int kind = p->pending;
+    if (kind == NONE)
+        return 0;
+    p->pending = NONE;
+    w->replies++;
+    stat_add(&w->stats[kind], now - p->sent_at);
+    if (line[0] == 'E')
+        w->stats[kind].errors++;
+
+    switch (kind) {
+    case STAT_REG:
+        if (config.taxi)
+            send_request(w, p, STAT_REQTAXI);
+        break;
+    case STAT_INAIR:
+        plane_close(p);
+        if (config.recycle)
+            plane_open(w, p);
+        return 1;
+    default:
+        // Spread the first polls out over the interval so the planes
+        // don't all poll in lockstep
+        if (kind == STAT_REQTAXI && config.poll_ms > 0)
+            p->next_poll = now + (rand_r(&w->seed) % config.poll_ms) * 1000000L;
+        else
+            p->next_poll = now + config.poll_ms * 1000000L;
+        plane_next(w, p, now);
+    }
+    return 0;
+}
+
+/************************************************************************
+ * Reads whatever the server sent a plane and handles each full line.
+ */
+static void plane_input(worker *w, sim_plane *p) {
+    if (p->fd < 0)
+        return;   // Closed earlier in the same batch of events
+
+    ssize_t got = recv(p->fd, p->rbuf + p->rlen, RBUF_SIZE - p->rlen, 0);
+    if (got <= 0) {
+        if ((got < 0) && (errno == EAGAIN))
+            return;
+        w->failures++;   // The server hung up without being asked to
+        plane_close(p);
+        return;
+    }
+    p->rlen += got;
+
+    char *start = p->rbuf;
+    char *nl;
+    while ((nl = memchr(start, '\n', p->rbuf + p->rlen - start)) != NULL) {
+        *nl = '\0';
+        if (plane_line(w, p, start))
+            return;
+        start = nl + 1;
+    }
+
+    p->rlen -= start - p->rbuf;
+    memmove(p->rbuf, start, p->rlen);
+    if (p->rlen == RBUF_SIZE)
+        p->rlen = 0;   // A line longer than any reply -- drop it
+}
+
+// Planes a worker connects between checks for replies while it ramps up,
+// so the early planes' replies aren't left waiting behind the connects
+
+#define RAMP_BATCH 32
+
+/************************************************************************
+ * Each worker thread connects its share of the planes and then runs
+ * them until the end of the test.
+ */
+static void *worker_main(void *arg) {
+    worker *w = (worker *)arg;
+
+    struct epoll_event events[256];
+    long next_scan = 0;
+    int opened = 0;
+    while (now_ns() < end_time) {
+        for (int i=0; (i<RAMP_BATCH) && (opened<w->nplanes); i++)
+            plane_open(w, &w->planes[opened++]);
+
+        int n = epoll_wait(w->epfd, events, 256, (opened < w->nplanes) ? 0 : 1);
+        for (int i=0; i<n; i++)
+            plane_input(w, (sim_plane *)events[i].data.ptr);
+
+        // Timed polls are checked about once a millisecond
+        long now = now_ns();
+        if ((config.poll_ms > 0) && (now >= next_scan)) {
+            for (int i=0; i<opened; i++) {
+                sim_plane *p = &w->planes[i];
+                if ((p->fd >= 0) && (p->pending == NONE) && (p->next_poll != 0))
+                    plane_next(w, p, now);
+            }
+            next_scan = now + 1000000L;
+        }
+    }
+
+    for (int i=0; i<opened; i++)
+        plane_close(&w->planes[i]);
+    return NULL;
+}
+
+static int cmp_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(stat *s, double q) {
+    if (s->count == 0)
+        return 0;
+    long i = (long)(q * s->count);
+    if (i >= s->count)
+        i = s->count - 1;
+    return s->samples[i] / 1e6;
+}
+
+static void usage(char *progname) {
+    fprintf(stderr, "Usage: %s [-S scenario] [-h host] [-p port] [-t threads]"
+            " [-n planes] [-d secs]\n"
+            "       [-P poll_ms] [-a ahead_pct] [-x] [-I] [-R]\n", progname);
+    fprintf(stderr, "  -S name     start from a canned scenario (default %s)\n",
+            scenarios[0].name);
+    fprintf(stderr, "  -h host     server host (default 127.0.0.1)\n");
+    fprintf(stderr, "  -p port     server port (default 8080)\n");
+    fprintf(stderr, "  -t threads  load generator threads (default 2)\n");
+    fprintf(stderr, "  -n planes   planes connected at once\n");
+    fprintf(stderr, "  -d secs     test length\n");
+    fprintf(stderr, "  -P ms       time between polls (0 = back to back, -1 = never)\n");
+    fprintf(stderr, "  -a pct      percent of polls that are REQAHEAD\n");
+    fprintf(stderr, "  -x          don't request taxi (planes stay at the terminal)\n");
+    fprintf(stderr, "  -I          don't send INAIR when cleared\n");
+    fprintf(stderr, "  -R          don't replace planes that took off\n");
+    fprintf(stderr, "Scenarios:\n");
+    for (int i=0; i<NSCENARIOS; i++)
+        fprintf(stderr, "  %-10s %s\n", scenarios[i].name, scenarios[i].about);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    char *host = "127.0.0.1";
+    char *port = "8080";
+    int nthreads = 2;
+
+    // The scenario has to be picked before anything overrides it
+    config = scenarios[0];
+    for (int i=1; i<argc-1; i++) {
+        if (strcmp(argv[i], "-S") != 0)
+            continue;
+        int s;
+        for (s=0; s<NSCENARIOS; s++) {
+            if (strcmp(argv[i+1], scenarios[s].name) == 0)
+                break;
+        }
+        if (s == NSCENARIOS)
+            usage(argv[0]);
+        config = scenarios[s];
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "S:h:p:t:n:d:P:a:xIR")) != -1) {
+        switch (opt) {
+        case 'S':
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            config.planes = atoi(optarg);
+            break;
+        case 'd':
+            config.duration = atoi(optarg);
+            break;
+        case 'P':
+            config.poll_ms = atoi(optarg);
+            break;
+        case 'a':
+            config.ahead_pct = atoi(optarg);
+            break;
+        case 'x':
+            config.taxi = 0;
+            break;
+        case 'I':
+            config.inair = 0;
+            break;
+        case 'R':
+            config.recycle = 0;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((nthreads < 1) || (config.planes < nthreads) || (config.duration < 1))
+        usage(argv[0]);
+
+    // Every plane is a socket, so lift the fd limit as far as allowed
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < (rlim_t)config.planes + 16) {
+            fprintf(stderr, "loadgen: fd limit %ld is too low for %d planes\n",
+                    (long)rl.rlim_cur, config.planes);
+            exit(1);
+        }
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int rval;
+    if ((rval = getaddrinfo(host, port, &hints, &server_addr)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
+        exit(1);
+    }
+
+    worker *workers = calloc(nthreads, sizeof(worker));
+    sim_plane *planes = calloc(config.planes, sizeof(sim_plane));
+    if ((workers == NULL) || (planes == NULL)) {
+        perror("loadgen");
+        exit(1);
+    }
+
+    printf("scenario %s: %d planes, %d threads, %d s, poll %d ms, "
+           "%d%% REQAHEAD%s%s%s\n", config.name, config.planes, nthreads,
+           config.duration, config.poll_ms, config.ahead_pct,
+           config.taxi ? ", taxi" : "", config.inair ? ", inair" : "",
+           config.recycle ? ", recycle" : "");
+
+    long start = now_ns();
+    end_time = start + config.duration * 1000000000L;
+    int first = 0;
+    for (int i=0; i<nthreads; i++) {
+        worker *w = &workers[i];
+        w->index = i;
+        w->seed = i + 1;
+        w->nplanes = config.planes / nthreads + (i < config.planes % nthreads);
+        w->planes = &planes[first];
+        first += w->nplanes;
+        if ((w->epfd = epoll_create1(0)) < 0) {
+            perror("loadgen - epoll_create1");
+            exit(1);
+        }
+        pthread_create(&w->thread, NULL, worker_main, w);
+    }
+
+    // Add up every worker's stats
+    stat totals[NSTATS];
+    memset(totals, 0, sizeof(totals));
+    long replies = 0, takeoffs = 0, failures = 0;
+    for (int i=0; i<nthreads; i++) {
+        worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        replies += w->replies;
+        takeoffs += w->takeoffs;
+        failures += w->failures;
+        for (int k=0; k<NSTATS; k++) {
+            for (long j=0; j<w->stats[k].count; j++)
+                stat_add(&totals[k], w->stats[k].samples[j]);
+            totals[k].errors += w->stats[k].errors;
+            free(w->stats[k].samples);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%.0f replies/sec (%ld replies in %.1f s), %ld takeoffs, "
+           "%ld connection failures\n", replies / elapsed, replies, elapsed,
+           takeoffs, failures);
+    printf("%-10s %10s %8s %10s %10s %10s %10s\n", "latency", "count",
+           "errors", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (int k=0; k<NSTATS; k++) {
+        stat *s = &totals[k];
+        if (s->count == 0)
+            continue;
+        qsort(s->samples, s->count, sizeof(long), cmp_long);
+        printf("%-10s %10ld %8ld %10.3f %10.3f %10.3f %10.3f\n", stat_names[k],
+               s->count, s->errors, percentile(s, 0.50), percentile(s, 0.99),
+               percentile(s, 0.999), s->samples[s->count - 1] / 1e6);
+    }
+
+    // For CI: a run that lost connections or got nothing done failed
+    return ((failures == 0) && (replies > 0)) ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+// Checks of the taxi queue's position bookkeeping, run in-process against
+// the server's own taxiqueue module (no sockets).
+//
+// Each check builds a queue of planes, subscribes one of them to position
+// updates, takes other planes out of the queue in a given order, and then
+// checks that the last POS pushed to the subscriber matches what REQPOS
+// (taxiqueue_getpos) says. Prints one line per check and exits non-zero
+// if any of them fails.
+//
+// Build and run with "make check".
+//
+// Usage: queue_check
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "airplane.h"
+#include "airport.h"
+#include "planelist.h"
+#include "planepool.h"
+#include "taxiqueue.h"
+#include "timers.h"
+
+#define CHECK_PLANES 6
+
+typedef struct {
+    airplane *plane;
+    char *sent;        // Everything written to the plane (open_memstream)
+    size_t sent_len;
+} check_plane;
+
+static FILE *results;  // The real stdout; the modules' chatter is dropped
+static long nflights;  // Flights created so far, for unique ids
+
+static void check_plane_new(check_plane *cp) {
+    FILE *fp = open_memstream(&cp->sent, &cp->sent_len);
+    if (fp == NULL) {
+        perror("queue_check");
+        exit(1);
+    }
+    cp->plane = planepool_get();
+    airplane_init(cp->plane, -1, fp);
+
+    char id[32];
+    snprintf(id, sizeof(id), "Q%ld", nflights++);
+    planelist_add(cp->plane);
+    planelist_changeid(cp->plane, flightid_intern(0, id));
+    plane_transition(cp->plane, PLANE_UNREG, PLANE_ATTERMINAL);
+    plane_transition(cp->plane, PLANE_ATTERMINAL, PLANE_TAXIING);
+    taxiqueue_add(cp->plane);
+}
+
+// Returns the last "POS n" pushed to a plane, or 0 if there was none
+static int last_pos(check_plane *cp) {
+    fflush(cp->plane->fp_send);
+    int pos = 0;
+    for (char *line = cp->sent; (line != NULL) && (*line != '\0'); ) {
+        int n;
+        if (sscanf(line, "POS %d", &n) == 1)
+            pos = n;
+        line = strchr(line, '\n');
+        if (line != NULL)
+            line++;
+    }
+    return pos;
+}
+
+/************************************************************************
+ * check_leave queues CHECK_PLANES planes, subscribes plane "sub", takes
+ * out the planes in "gone" (-1 terminated) in that order, and checks the
+ * subscriber's pushed position against its real one. Returns 1 if it
+ * matched.
+ */
+static int check_leave(const char *name, int sub, const int *gone) {
+    check_plane cps[CHECK_PLANES];
+    for (int i=0; i<CHECK_PLANES; i++)
+        check_plane_new(&cps[i]);
+
+    taxiqueue_subscribe(cps[sub].plane, 1, 1);
+    for (int i=0; gone[i] >= 0; i++)
+        taxiqueue_remove(cps[gone[i]].plane);
+
+    int pushed = last_pos(&cps[sub]);
+    int real = taxiqueue_getpos(cps[sub].plane);
+    int ok = (pushed == real);
+    fprintf(results, "%s %s: POS %d, REQPOS %d\n", ok ? "ok  " : "FAIL",
+            name, pushed, real);
+
+    for (int i=0; i<CHECK_PLANES; i++) {
+        taxiqueue_remove(cps[i].plane);
+        planelist_remove(cps[i].plane);  // Closes the memstream
+        free(cps[i].sent);
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    results = fdopen(dup(1), "w");
+    if ((results == NULL) || (freopen("/dev/null", "w", stdout) == NULL)) {
+        perror("queue_check - stdout");
+        exit(1);
+    }
+
+    timers_init();
+    planepool_init(0);
+    planelist_init();
+    taxiqueue_init(1, 3600 * 1000);  // Only the head is ever cleared
+    airport_init(NULL);
+
+    int failed = 0;
+    failed += !check_leave("one ahead leaves", 4, (int []){ 2, -1 });
+    failed += !check_leave("two neighbours ahead leave, back first", 4,
+                           (int []){ 2, 1, -1 });
+    failed += !check_leave("two neighbours ahead leave, front first", 4,
+                           (int []){ 1, 2, -1 });
+    failed += !check_leave("the head leaves after a hole", 4,
+                           (int []){ 1, 0, -1 });
+    failed += !check_leave("three ahead leave from the back", 5,
+                           (int []){ 3, 2, 1, -1 });
+
+    fclose(results);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Runs each canned loadgen scenario against a fresh event-mode server and
+# fails if any of them does. Run from the top of the tree (make bench-ci).
+#
+# Usage: bench/run_scenarios.sh [scenario ...]   (default: all of them)
+#
+# The server's separation is cut to SEPARATION_MS (default 50) so planes
+# actually take off within a short run.
+
+SCENARIOS=${*:-"idle1k queue10k pollstorm"}
+SEPARATION_MS=${SEPARATION_MS:-50}
+
+# 10k planes means 10k sockets on each side
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+status=0
+for s in $SCENARIOS; do
+    ./gndcontrol -e -s "$SEPARATION_MS" > /dev/null 2>&1 &
+    server=$!
+    sleep 0.5
+
+    echo "== $s"
+    bench/loadgen -S "$s" || status=1
+
+    kill $server
+    wait $server 2>/dev/null
+done
+exit $status
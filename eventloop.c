@@ -0,0 +1,289 @@
+// The eventloop module is an alternative to the thread-per-connection
+// model in gndcontrol.c. Instead of one thread blocked in getline() for
+// every plane, a small fixed set of I/O threads each own an epoll
+// instance and multiplex all of their connections through it. Complete
+// lines are handed to the same docommand() function, so the protocol
+// on the wire is unchanged.
+//
+// The I/O threads only read and frame. Once a plane has a complete
+// command waiting, it is handed to the worker pool (workpool.c), which
+// runs its commands and sends the replies; so a plane that is slow to
+// take its replies holds up one worker rather than every other plane on
+// its I/O thread. With no worker pool the I/O threads run the commands
+// themselves.
+//
+// Each connection belongs to exactly one I/O thread for its whole life,
+// and its socket is registered EPOLLONESHOT: after an event the I/O
+// thread hears nothing more from it until it is re-armed, which only
+// happens once every command read so far has been run. So a plane is
+// never read and run at the same time, and at most one worker has it
+// at once, which keeps its commands in order.
+//
+// For a handoff to a new process (handoff.c) the loop can be frozen:
+// each I/O thread holds its run lock while it handles a batch of events,
+// so once every run lock is taken no I/O thread is touching a plane.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "airplane.h"
+#include "airs_protocol.h"
+#include "planelist.h"
+#include "taxiqueue.h"
+#include "eventloop.h"
+#include "handoff.h"
+#include "workpool.h"
+
+// Maximum number of events to pull out of the kernel per epoll_wait call
+
+#define MAX_EVENTS 64
+
+// Per I/O thread state: the thread itself, its epoll instance, and the
+// lock it holds while handling events
+
+typedef struct {
+    pthread_t thread;
+    int epoll_fd;
+    pthread_mutex_t run_lock;
+} io_thread;
+
+static io_thread *threads;
+static int nthreads;
+static int next_thread;   // Where the next new plane goes (accept thread only)
+
+// Events a plane's socket is (re-)armed for
+
+#define PLANE_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+/************************************************************************
+ * close_plane takes a plane out of its epoll set, the taxi queue and the
+ * system. planelist_remove destroys the plane (closing its sockets), so
+ * the plane must not be touched after this returns.
+ */
+static void close_plane(airplane *plane) {
+    epoll_ctl(plane->epoll_fd, EPOLL_CTL_DEL, plane->fd, NULL);
+    taxiqueue_remove(plane);
+    planelist_remove(plane);
+}
+
+/************************************************************************
+ * run_plane runs every command waiting in a plane's receive buffer, and
+ * then either closes the plane or re-arms its socket for the next read.
+ * Runs on a worker (or on the I/O thread, without a worker pool).
+ */
+static void run_plane(work *job) {
+    airplane *plane = (airplane *)((char *)job - offsetof(airplane, job));
+
+    doinput(plane);
+    if ((plane_state(plane) == PLANE_DONE) || plane->hangup) {
+        close_plane(plane);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = PLANE_EVENTS;
+    ev.data.ptr = plane;
+    if (epoll_ctl(plane->epoll_fd, EPOLL_CTL_MOD, plane->fd, &ev) < 0) {
+        perror("epoll_ctl - rearm");
+        close_plane(plane);
+    }
+}
+
+/************************************************************************
+ * handle_input reads what is currently available on a plane's socket
+ * into its receive buffer, and hands the plane over to have its commands
+ * run if there is a complete one (or the peer has gone). Otherwise the
+ * socket is just re-armed. The socket itself is left in blocking mode
+ * (the send side still writes through a FILE*), so reads use
+ * MSG_DONTWAIT instead.
+ */
+static void handle_input(airplane *plane) {
+    ssize_t n = rxbuf_fill(&plane->rx, plane->fd, MSG_DONTWAIT);
+    if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        plane->hangup = 1;   // Client disconnected
+
+    if (!plane->hangup &&
+        !rxbuf_ready(&plane->rx, plane->proto == PROTO_BINARY)) {
+        struct epoll_event ev;
+        ev.events = PLANE_EVENTS;
+        ev.data.ptr = plane;
+        epoll_ctl(plane->epoll_fd, EPOLL_CTL_MOD, plane->fd, &ev);
+        return;
+    }
+
+    if (workpool_size() > 0)
+        workpool_submit(&plane->job, plane->fd);
+    else
+        run_plane(&plane->job);
+}
+
+/************************************************************************
+ * io_thread_main is the event loop run by each I/O thread.
+ */
+static void *io_thread_main(void *arg) {
+    io_thread *io = (io_thread *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int nready = epoll_wait(io->epoll_fd, events, MAX_EVENTS, -1);
+        if (nready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        pthread_mutex_lock(&io->run_lock);
+        for (int i=0; i<nready; i++) {
+            airplane *plane = events[i].data.ptr;
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) &&
+                !(events[i].events & EPOLLIN)) {
+                close_plane(plane);
+            } else {
+                handle_input(plane);
+            }
+        }
+        pthread_mutex_unlock(&io->run_lock);
+    }
+
+    return NULL;
+}
+
+/************************************************************************
+ * eventloop_start starts "count" I/O threads.
+ */
+void eventloop_start(int count) {
+    nthreads = count;
+    threads = malloc(nthreads * sizeof(io_thread));
+    if (threads == NULL) {
+        perror("eventloop_start");
+        exit(1);
+    }
+
+    for (int i=0; i<nthreads; i++) {
+        if ((threads[i].epoll_fd = epoll_create1(0)) < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        pthread_mutex_init(&threads[i].run_lock, NULL);
+        pthread_create(&threads[i].thread, NULL, io_thread_main, &threads[i]);
+    }
+}
+
+/************************************************************************
+ * eventloop_add hands a plane (already in the plane list) to the next
+ * I/O thread in round-robin order. Only called from the accept thread.
+ */
+void eventloop_add(airplane *plane) {
+    io_thread *io = &threads[next_thread];
+    next_thread = (next_thread + 1) % nthreads;
+    plane->thread = io->thread;
+    plane->epoll_fd = io->epoll_fd;
+    plane->job.run = run_plane;
+
+    // Once the plane is in the epoll set it belongs to the I/O thread,
+    // which may run (and even free) it before epoll_ctl returns here.
+    struct epoll_event ev;
+    ev.events = PLANE_EVENTS;
+    ev.data.ptr = plane;
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, plane->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        taxiqueue_remove(plane);
+        planelist_remove(plane);
+    }
+}
+
+/************************************************************************
+ * eventloop_freeze stops every I/O thread from handling events (waiting
+ * for the batch each is on), and eventloop_thaw lets them carry on.
+ */
+void eventloop_freeze(void) {
+    for (int i=0; i<nthreads; i++)
+        pthread_mutex_lock(&threads[i].run_lock);
+}
+
+void eventloop_thaw(void) {
+    for (int i=0; i<nthreads; i++)
+        pthread_mutex_unlock(&threads[i].run_lock);
+}
+
+/************************************************************************
+ * eventloop_accept accepts connections on "listen_fd" forever, handing
+ * each new plane to the I/O threads. If "upgrade_fd" isn't -1 it is a
+ * listening handoff socket, and a new process connecting to it is handed
+ * the whole server (which doesn't return if that works). Only returns if
+ * accept() fails.
+ */
+void eventloop_accept(int listen_fd, int upgrade_fd) {
+    struct pollfd fds[2] = {
+        { .fd = listen_fd, .events = POLLIN },
+        { .fd = upgrade_fd, .events = POLLIN },
+    };
+    int nfds = (upgrade_fd >= 0) ? 2 : 1;
+
+    // A connection can go away between poll and accept, and accept
+    // mustn't then block the handoff socket out
+    if (nfds > 1)
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+    while (1) {
+        if (nfds > 1) {
+            if (poll(fds, nfds, -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("poll");
+                return;
+            }
+            if (fds[1].revents & POLLIN)
+                handoff_give(upgrade_fd, listen_fd);
+            if (!(fds[0].revents & POLLIN))
+                continue;
+        }
+
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int comm_fd = accept(listen_fd, (struct sockaddr *)&client_addr,
+                             &client_addr_len);
+        if (comm_fd < 0) {
+            if ((nfds > 1) && ((errno == EAGAIN) || (errno == EINTR) ||
+                               (errno == ECONNABORTED)))
+                continue;
+            break;
+        }
+
+        airplane *new_client = new_airplane(comm_fd);
+        if (new_client == NULL)
+            continue;
+
+        new_client->thread = threads[next_thread].thread;
+        planelist_add(new_client);
+        printf("Got connection from %s (client %ld)\n",
+               inet_ntoa(((struct sockaddr_in *)&client_addr)->sin_addr),
+               new_client->thread);
+        eventloop_add(new_client);
+    }
+
+    perror("accept");
+}
+
+/************************************************************************
+ * eventloop_run starts "nthreads" I/O threads and then accepts
+ * connections on "listen_fd" forever, handing each new plane to the
+ * I/O threads in round-robin order. Only returns if accept() fails.
+ */
+void eventloop_run(int listen_fd, int count) {
+    eventloop_start(count);
+    eventloop_accept(listen_fd, -1);
+}
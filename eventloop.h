@@ -0,0 +1,19 @@
+// Function prototypes for the event-driven (epoll) server mode
+
+#ifndef _EVENTLOOP_H
+#define _EVENTLOOP_H
+
+// Default number of I/O threads when none is given on the command line
+
+#define EVENTLOOP_DEF_THREADS 4
+
+#include "airplane.h"
+
+void eventloop_start(int nthreads);
+void eventloop_add(airplane *plane);
+void eventloop_accept(int listen_fd, int upgrade_fd);
+void eventloop_freeze(void);
+void eventloop_thaw(void);
+void eventloop_run(int listen_fd, int nthreads);
+
+#endif  // _EVENTLOOP_H
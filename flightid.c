@@ -0,0 +1,238 @@
+// The flightid module interns flight ids. Every distinct id in use (at
+// each airport) gets an entry holding its fixed-width key, its airport
+// and a reference count, and the entry's index is the id's handle.
+// Planes, taxi queue entries and restored placeholders each hold a
+// reference to the id they carry, and a handle is only reused once the
+// last reference to it is gone, so a handle never changes meaning under
+// anybody still holding it.
+//
+// Entries live in fixed-size chunks that never move once allocated, so
+// turning a handle back into its name takes no lock. Interning, lookups
+// by name and reference counting share one lock; they happen on REG and
+// on the way out, not per command.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "airplane.h"
+#include "flightid.h"
+
+#if FLIGHTID_KEYWORDS * 8 < PLANE_MAXID + 1
+#error "FLIGHTID_KEYWORDS is too small for PLANE_MAXID"
+#endif
+
+// Entries are allocated CHUNK_SIZE at a time, up to MAX_CHUNKS chunks
+// (so at most 16M distinct ids in use at once)
+
+#define CHUNK_BITS 12
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define MAX_CHUNKS 4096
+
+#define DEF_BUCKETS 1024
+
+typedef struct {
+    unsigned long key[FLIGHTID_KEYWORDS];  // The id, NUL-padded
+    int airport;             // Airport number (see airport.h)
+    int refs;                // 0 once free
+    flightid next;           // Next in the hash bucket, or the free list
+} entry;
+
+static entry *chunks[MAX_CHUNKS];
+static flightid nentries;    // Handles handed out so far (counting 0)
+static flightid free_list;   // Freed handles, to reuse first
+
+static flightid *buckets;    // Hash index of entries in use, by key
+static unsigned int nbuckets;   // Always a power of two
+static unsigned int count;      // Entries in use
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static entry *entry_of(flightid fid) {
+    return &chunks[fid >> CHUNK_BITS][fid & (CHUNK_SIZE - 1)];
+}
+
+/************************************************************************
+ * make_key turns an id into its fixed-width key. Ids longer than
+ * PLANE_MAXID (which REG never lets through) are cut short.
+ */
+static void make_key(const char *id, unsigned long *key) {
+    memset(key, 0, FLIGHTID_KEYWORDS * sizeof(unsigned long));
+    strncpy((char *)key, id, PLANE_MAXID);
+}
+
+static unsigned int hash_key(int airport, const unsigned long *key) {
+    unsigned long h = (unsigned long)airport;
+    for (int i=0; i<FLIGHTID_KEYWORDS; i++)
+        h = (h ^ key[i]) * 0x9E3779B97F4A7C15UL;
+    return (unsigned int)(h >> 32);
+}
+
+static int key_equal(const unsigned long *a, const unsigned long *b) {
+    for (int i=0; i<FLIGHTID_KEYWORDS; i++)
+        if (a[i] != b[i])
+            return 0;
+    return 1;
+}
+
+/************************************************************************
+ * find returns the handle of the entry with "key" at "airport", or
+ * FLIGHTID_NONE. Must hold table_lock.
+ */
+static flightid find(int airport, const unsigned long *key) {
+    if (buckets == NULL)
+        return FLIGHTID_NONE;
+
+    flightid fid = buckets[hash_key(airport, key) & (nbuckets - 1)];
+    while ((fid != FLIGHTID_NONE) &&
+           ((entry_of(fid)->airport != airport) ||
+            !key_equal(entry_of(fid)->key, key)))
+        fid = entry_of(fid)->next;
+    return fid;
+}
+
+/************************************************************************
+ * grow_buckets doubles the hash index (or makes the first one) and
+ * rehashes every entry in use into it. Must hold table_lock.
+ */
+static void grow_buckets(void) {
+    unsigned int newcount = (nbuckets > 0) ? 2 * nbuckets : DEF_BUCKETS;
+    flightid *newbuckets = calloc(newcount, sizeof(flightid));
+    if (newbuckets == NULL) {
+        perror("flightid grow_buckets");
+        exit(1);
+    }
+
+    for (flightid fid=1; fid<nentries; fid++) {
+        entry *e = entry_of(fid);
+        if (e->refs == 0)
+            continue;
+        unsigned int b = hash_key(e->airport, e->key) & (newcount - 1);
+        e->next = newbuckets[b];
+        newbuckets[b] = fid;
+    }
+
+    free(buckets);
+    buckets = newbuckets;
+    nbuckets = newcount;
+}
+
+/************************************************************************
+ * new_entry hands out an unused entry (a freed one if there is any).
+ * Must hold table_lock.
+ */
+static flightid new_entry(void) {
+    if (free_list != FLIGHTID_NONE) {
+        flightid fid = free_list;
+        free_list = entry_of(fid)->next;
+        return fid;
+    }
+
+    if ((nentries & (CHUNK_SIZE - 1)) == 0) {
+        int c = nentries >> CHUNK_BITS;
+        if (c == MAX_CHUNKS) {
+            fprintf(stderr, "Too many flight ids in use\n");
+            exit(1);
+        }
+        if ((chunks[c] = calloc(CHUNK_SIZE, sizeof(entry))) == NULL) {
+            perror("flightid new_entry");
+            exit(1);
+        }
+        // Handle 0 is FLIGHTID_NONE, which is never freed
+        if (c == 0)
+            chunks[0][nentries++].refs = 1;
+    }
+    return nentries++;
+}
+
+/************************************************************************
+ * flightid_intern returns the handle for flight "id" at airport
+ * "airport", making one if it isn't in use yet, and takes a reference to
+ * it for the caller (to be dropped with flightid_release).
+ */
+flightid flightid_intern(int airport, const char *id) {
+    unsigned long key[FLIGHTID_KEYWORDS];
+    make_key(id, key);
+
+    pthread_mutex_lock(&table_lock);
+    flightid fid = find(airport, key);
+    if (fid == FLIGHTID_NONE) {
+        if (count >= nbuckets)
+            grow_buckets();
+        fid = new_entry();
+        entry *e = entry_of(fid);
+        memcpy(e->key, key, sizeof(key));
+        e->airport = airport;
+        unsigned int b = hash_key(airport, key) & (nbuckets - 1);
+        e->next = buckets[b];
+        buckets[b] = fid;
+        count++;
+    }
+    entry_of(fid)->refs++;
+    pthread_mutex_unlock(&table_lock);
+    return fid;
+}
+
+/************************************************************************
+ * flightid_lookup returns the handle of flight "id" at airport "airport"
+ * if it is in use, or FLIGHTID_NONE. Takes no reference, so the handle
+ * is only good for as long as somebody else is known to hold one.
+ */
+flightid flightid_lookup(int airport, const char *id) {
+    unsigned long key[FLIGHTID_KEYWORDS];
+    make_key(id, key);
+
+    pthread_mutex_lock(&table_lock);
+    flightid fid = find(airport, key);
+    pthread_mutex_unlock(&table_lock);
+    return fid;
+}
+
+/************************************************************************
+ * flightid_hold takes another reference to a handle already held.
+ */
+void flightid_hold(flightid fid) {
+    if (fid == FLIGHTID_NONE)
+        return;
+    pthread_mutex_lock(&table_lock);
+    entry_of(fid)->refs++;
+    pthread_mutex_unlock(&table_lock);
+}
+
+/************************************************************************
+ * flightid_release drops a reference to a handle. The last one frees the
+ * handle for reuse.
+ */
+void flightid_release(flightid fid) {
+    if (fid == FLIGHTID_NONE)
+        return;
+
+    pthread_mutex_lock(&table_lock);
+    entry *e = entry_of(fid);
+    if (--e->refs == 0) {
+        unsigned int b = hash_key(e->airport, e->key) & (nbuckets - 1);
+        flightid *fp = &buckets[b];
+        while (*fp != fid)
+            fp = &entry_of(*fp)->next;
+        *fp = e->next;
+        count--;
+
+        memset(e->key, 0, sizeof(e->key));
+        e->next = free_list;
+        free_list = fid;
+    }
+    pthread_mutex_unlock(&table_lock);
+}
+
+/************************************************************************
+ * flightid_name returns the flight id a handle stands for. The string is
+ * good for as long as the caller holds (or knows somebody holds) a
+ * reference to the handle.
+ */
+const char *flightid_name(flightid fid) {
+    static const unsigned long none[FLIGHTID_KEYWORDS];
+    if (fid == FLIGHTID_NONE)
+        return (const char *)none;
+    return (const char *)entry_of(fid)->key;
+}
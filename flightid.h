@@ -0,0 +1,31 @@
+// Types and function prototypes for interned flight ids
+
+#ifndef _FLIGHTID_H
+#define _FLIGHTID_H
+
+// A flight id is interned once, when a plane registers it, into a small
+// integer handle; from then on the server stores and compares handles,
+// and only turns them back into strings to talk to the outside world
+// (replies, logs, the journal). Handle 0 is no flight at all, with the
+// name "".
+//
+// Flight ids are per airport (see airport.h): the same id at two airports
+// is two different flights, with two different handles.
+
+typedef unsigned int flightid;
+
+#define FLIGHTID_NONE 0
+
+// Ids are kept as fixed-width keys, NUL-padded to this many 8-byte words
+// (room for PLANE_MAXID characters and the NUL), so comparing two of them
+// is a few word compares
+
+#define FLIGHTID_KEYWORDS 3
+
+flightid flightid_intern(int airport, const char *id);
+flightid flightid_lookup(int airport, const char *id);
+void flightid_hold(flightid fid);
+void flightid_release(flightid fid);
+const char *flightid_name(flightid fid);
+
+#endif  // _FLIGHTID_H
@@ -12,6 +12,7 @@
 #include <ctype.h>
 #include <assert.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -19,13 +20,27 @@
 #include <netdb.h>
 
 #include "airplane.h"
+#include "airport.h"
 #include "airs_protocol.h"
 #include "planelist.h"
+#include "planepool.h"
 #include "taxiqueue.h"
+#include "eventloop.h"
+#include "timers.h"
+#include "outq.h"
+#include "metrics.h"
+#include "workpool.h"
+#include "uring.h"
+#include "shard.h"
+#include "handoff.h"
+#include "journal.h"
+#include "replica.h"
 
 /***********************************************************************
  * The client thread handles the basic network read loop -- get a line
- * from the network connection and process it.
+ * (or binary frame) from the network connection and process it. Commands
+ * are run straight out of the plane's receive buffer, without being
+ * copied.
  */
 static void *client_thread(void *arg) {
     airplane *myplane = (airplane *)arg;
@@ -35,24 +50,19 @@ static void *client_thread(void *arg) {
 
     pthread_detach(myplane->thread);
 
-    char *lineptr = NULL;
-    size_t linesize = 0;
-
-    while (myplane->state != PLANE_DONE) {
-        if (getline(&lineptr, &linesize, myplane->fp_recv) < 0) {
-            // Failed getline means the client disconnected
+    while (plane_state(myplane) != PLANE_DONE) {
+        doinput(myplane);
+        if ((plane_state(myplane) == PLANE_DONE) ||
+            (rxbuf_fill(&myplane->rx, myplane->fd, 0) <= 0)) {
+            // Failed receive means the client disconnected
             break;
         }
-        docommand(myplane, lineptr);
     }
 
     // Finished with session, so unregister it and free resources.
 
-    if (lineptr != NULL) {
-        free(lineptr);
-    }
-
     //printf("Client %ld disconnected.\n", myplane->thread);
+    taxiqueue_remove(myplane);
     planelist_remove(myplane);
 
     return NULL;
@@ -60,14 +70,14 @@ static void *client_thread(void *arg) {
 
 /********************************************************************
  * Make a TCP listener for port "service" (given as a sting, but
- * either a port number or service name). This function will only
- * create a public listener (listening on all interfaces).
+ * either a port number or service name), on address "host", or on all
+ * interfaces (a public listener) if "host" is NULL.
  *
  * Either returns a file handle to use with accept(), or -1 on error.
  * In general, error reporting could be improved, but this just indicates
  * success or failure.
  */
-static int create_listener(char *service) {
+static int create_listener(char *host, char *service) {
     int sock_fd;
     if ((sock_fd=socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket");
@@ -84,14 +94,14 @@ static int create_listener(char *service) {
 
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
-    hints.ai_flags = AI_PASSIVE;
+    hints.ai_flags = (host == NULL) ? AI_PASSIVE : 0;
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = 0;
 
     struct addrinfo *result;
     int rval;
-    if ((rval=getaddrinfo(NULL, service, &hints, &result)) != 0) {
+    if ((rval=getaddrinfo(host, service, &hints, &result)) != 0) {
         fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rval));
         close(sock_fd);
         return -1;
@@ -122,20 +132,230 @@ static int create_listener(char *service) {
 }
 
 /************************************************************************
- * Part 2 main: networked server. Spawns a new thread for each connection.
- * Probably should put an upper limit on this, but we're not going to
- * go crazy with a million clients in this class assignment...
+ * Print a usage message and exit.
+ */
+static void usage(char *progname) {
+    fprintf(stderr, "Usage: %s [-e | -u | -c] [-t nthreads] [-w nworkers] [-r nrunways]"
+            " [-A airports] [-s separation_ms]\n       [-p nplanes] [-m port] [-j journal] [-H socket]"
+            " [-R port] [-S host:port]\n", progname);
+    fprintf(stderr, "  -e           event-driven (epoll) server mode\n");
+    fprintf(stderr, "  -u           event-driven server mode on io_uring (falls back to -e\n"
+            "               where io_uring isn't available)\n");
+    fprintf(stderr, "  -c           sharded server mode: a listener and event loop pinned\n"
+            "               to each CPU\n");
+    fprintf(stderr, "  -t nthreads  number of I/O threads in event modes (default %d)\n",
+            EVENTLOOP_DEF_THREADS);
+    fprintf(stderr, "  -w nworkers  threads running commands in event mode (default: one\n"
+            "               per CPU; 0 runs them on the I/O threads)\n");
+    fprintf(stderr, "  -r nrunways  number of departure runways (default %d)\n",
+            TAXIQUEUE_DEF_RUNWAYS);
+    fprintf(stderr, "  -A airports  host many airports (a comma separated list of codes),\n"
+            "               each with its own flights and runways: planes name\n"
+            "               theirs at REG (REG airport flightid)\n");
+    fprintf(stderr, "  -s ms        time between a takeoff and the next clearance (default %d)\n",
+            TAXIQUEUE_DEF_SEPARATION);
+    fprintf(stderr, "  -p nplanes   preallocate airplane structs for this many planes\n");
+    fprintf(stderr, "  -m port      serve Prometheus metrics on this localhost port\n");
+    fprintf(stderr, "  -j journal   journal queue changes to this file, and restore the\n"
+            "               queues from it on startup\n");
+    fprintf(stderr, "  -H socket    take over from the server listening for a handoff on this\n"
+            "               Unix socket, if there is one, and then listen there for the\n"
+            "               next one (with -e only)\n");
+    fprintf(stderr, "  -R port      stream queue changes to a hot standby connecting on this\n"
+            "               port\n");
+    fprintf(stderr, "  -S host:port be the hot standby for the primary at host:port, and take\n"
+            "               over its queues if it goes away\n");
+    exit(1);
+}
+
+/************************************************************************
+ * Part 2 main: networked server. By default spawns a new thread for each
+ * connection. With "-e" all connections are instead multiplexed over a
+ * small fixed set of epoll-driven I/O threads (see eventloop.c), with
+ * their commands run by a fixed pool of workers (see workpool.c). "-u"
+ * does the same I/O through io_uring instead (see uring.c), and "-c"
+ * runs a separate listener and event loop on every core (see shard.c).
  */
 int main(int argc, char *argv[]) {
+    int event_mode = 0;
+    int use_uring = 0;
+    int shard_mode = 0;
+    int nthreads = EVENTLOOP_DEF_THREADS;
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int nrunways = TAXIQUEUE_DEF_RUNWAYS;
+    int separation = TAXIQUEUE_DEF_SEPARATION;
+    int prealloc = 0;
+    char *metrics_port = NULL;
+    char *journal_path = NULL;
+    char *handoff_path = NULL;
+    char *replica_port = NULL;
+    char *primary = NULL;
+    char *airports = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "euct:w:r:A:s:p:m:j:H:R:S:")) != -1) {
+        switch (opt) {
+        case 'e':
+            event_mode = 1;
+            break;
+        case 'u':
+            event_mode = 1;
+            use_uring = 1;
+            break;
+        case 'c':
+            shard_mode = 1;
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            if (nthreads < 1)
+                usage(argv[0]);
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            if (nworkers < 0)
+                usage(argv[0]);
+            break;
+        case 'r':
+            nrunways = atoi(optarg);
+            if (nrunways < 1)
+                usage(argv[0]);
+            break;
+        case 'A':
+            airports = optarg;
+            break;
+        case 's':
+            separation = atoi(optarg);
+            if (separation < 0)
+                usage(argv[0]);
+            break;
+        case 'p':
+            prealloc = atoi(optarg);
+            if (prealloc < 0)
+                usage(argv[0]);
+            break;
+        case 'm':
+            metrics_port = optarg;
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'R':
+            replica_port = optarg;
+            break;
+        case 'S':
+            primary = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // Only the epoll mode can be frozen and handed over
+    if ((handoff_path != NULL) && (!event_mode || use_uring || shard_mode))
+        usage(argv[0]);
+
+    // A standby takes over the queues from its primary, not from an old
+    // process on the same machine
+    if ((handoff_path != NULL) && (primary != NULL))
+        usage(argv[0]);
+
+    // Queue updates are pushed to planes that may have just hung up;
+    // a write to a closed connection must fail, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    timers_init();
+    outq_init();
+    planepool_init(prealloc);
     planelist_init();
-    taxiqueue_init();
+    taxiqueue_init(nrunways, separation);
+    airport_init(airports);
+
+    // A standby follows its primary until that goes away, and then
+    // carries on with its queues as a server in its own right
+    if (primary != NULL)
+        replica_follow(primary);
 
-    int sock_fd = create_listener("8080");
+    // A new server taking over gets the listening socket (and every
+    // plane) from the old one, which then exits
+    int sock_fd = -1;
+    int upgrade_fd = -1;
+    int took_over = 0;
+    int queues = JOURNAL_RESTORE;
+    if (handoff_path != NULL) {
+        took_over = (handoff_take(handoff_path, &sock_fd) >= 0);
+        upgrade_fd = handoff_listen(handoff_path);
+    }
+
+    if (sock_fd < 0)
+        sock_fd = create_listener(NULL, "8080");
     if (sock_fd < 0) {
         fprintf(stderr, "Server setup failed.\n");
         exit(1);
     }
 
+    if (metrics_port != NULL) {
+        // Metrics are for the operators, so only served locally
+        int metrics_fd = create_listener("127.0.0.1", metrics_port);
+        if (metrics_fd < 0) {
+            fprintf(stderr, "Metrics listener setup failed.\n");
+            exit(1);
+        }
+        metrics_serve(metrics_fd);
+    }
+
+    // After a takeover the queues are already live, and aren't restored.
+    // The journal records are also what a standby is sent.
+    if (took_over)
+        queues = JOURNAL_LIVE;
+    else if (primary != NULL)
+        queues = JOURNAL_FOLLOWED;
+    if ((journal_path != NULL) || (replica_port != NULL) || (primary != NULL))
+        journal_open(journal_path, queues);
+
+    if (replica_port != NULL) {
+        int replica_fd = create_listener(NULL, replica_port);
+        if (replica_fd < 0) {
+            fprintf(stderr, "Standby listener setup failed.\n");
+            exit(1);
+        }
+        replica_serve(replica_fd);
+    }
+
+    if (shard_mode) {
+        // Every shard gets a listener of its own on the same port (which
+        // SO_REUSEPORT allows), and the kernel balances between them
+        int nshards = shard_count();
+        int *listen_fds = malloc(nshards * sizeof(int));
+        if (listen_fds == NULL) {
+            perror("main");
+            exit(1);
+        }
+        listen_fds[0] = sock_fd;
+        for (int i=1; i<nshards; i++) {
+            if ((listen_fds[i] = create_listener(NULL, "8080")) < 0) {
+                fprintf(stderr, "Server setup failed.\n");
+                exit(1);
+            }
+        }
+        shard_run(listen_fds, nshards);
+        return 0;
+    }
+
+    if (event_mode) {
+        // Only returns if io_uring can't be used here
+        if (use_uring)
+            uring_run(sock_fd, nthreads);
+        if (nworkers > 0)
+            workpool_init(nworkers);
+        eventloop_start(nthreads);
+        handoff_resume();
+        eventloop_accept(sock_fd, upgrade_fd);
+        return 0;
+    }
+
     struct sockaddr_storage client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
     int comm_fd;
@@ -155,4 +375,4 @@ int main(int argc, char *argv[]) {
     // printf("Shutting down...\n");
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,511 @@
+// The handoff module replaces a running server (in the epoll mode) with
+// a new process without dropping anything: the new process is started
+// with the same handoff socket path (-H), connects to the old one there,
+// and is sent the listening socket, every plane's socket, and the state
+// that goes with them, after which the old process exits. Connections
+// never see the switch, except as a pause of a few milliseconds.
+//
+// The handoff socket is a Unix SOCK_SEQPACKET socket, so every message
+// arrives whole, and sockets travel with their message as SCM_RIGHTS.
+// The old process sends, in order:
+//
+//   LISTENER  the listening socket
+//   RUNWAY    for each runway (of each airport), how long until it may
+//   QUEUED      clear the next plane, followed by every flight in its
+//               queue, head first
+//   PLANE     for each plane, its socket, state and unread input
+//   END
+//
+// and the new process answers END with one byte once it has it all.
+// The queues are rebuilt with taxiqueue_restore (as after a restart from
+// the journal) and each plane then claims its own place, so flights that
+// were waiting to come back after a restart keep waiting.
+//
+// A hot standby (see replica.c) is told to follow the new process
+// instead, rather than taking over from the old one when it exits.
+//
+// While it sends, the old process is frozen: no I/O thread, worker or
+// timer is running, and the journal is synced, so nothing changes under
+// it. If the new process goes away or doesn't answer in time the old one
+// thaws and carries on serving as if nothing had happened.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "airplane.h"
+#include "airport.h"
+#include "airs_protocol.h"
+#include "eventloop.h"
+#include "handoff.h"
+#include "journal.h"
+#include "metrics.h"
+#include "outq.h"
+#include "planelist.h"
+#include "replica.h"
+#include "taxiqueue.h"
+#include "timers.h"
+#include "workpool.h"
+
+// Message types
+
+#define MSG_LISTENER 0
+#define MSG_RUNWAY 1
+#define MSG_QUEUED 2
+#define MSG_PLANE 3
+#define MSG_END 4
+
+typedef struct {
+    int type;
+    int runway;             // RUNWAY, QUEUED
+    long value;             // RUNWAY: ms to next clearance; PLANE: cleared_at
+    int state;              // PLANE ...
+    int proto;
+    int hangup;
+    int subscribed;         // Gets taxi queue position updates
+    char id[PLANE_MAXID+1]; // QUEUED, PLANE
+    char airport[AIRPORT_MAXCODE+1];  // RUNWAY, QUEUED, PLANE (registered)
+    rxbuf rx;               // PLANE: received but not yet run
+} handoff_msg;
+
+// Planes taken over, until they are handed to the I/O threads
+
+static airplane **taken;
+static int ntaken;
+static int taken_cap;
+
+/************************************************************************
+ * send_msg sends one message, and socket "fd" with it unless it is -1.
+ * Returns 0, or -1 on error.
+ */
+static int send_msg(int sock, handoff_msg *msg, int fd) {
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+
+    while (sendmsg(sock, &mh, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) {
+            perror("handoff sendmsg");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/************************************************************************
+ * recv_msg receives one message, and sets "*fd" to the socket that came
+ * with it (or -1). Returns 0, or -1 on error or if the peer has gone.
+ */
+static int recv_msg(int sock, handoff_msg *msg, int *fd) {
+    struct iovec iov = { .iov_base = msg, .iov_len = sizeof(*msg) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0) {
+        if (errno != EINTR) {
+            perror("handoff recvmsg");
+            return -1;
+        }
+    }
+    if (n != sizeof(*msg)) {
+        if (n != 0)
+            fprintf(stderr, "Handoff: short message (%zd bytes)\n", n);
+        return -1;
+    }
+
+    *fd = -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+    if ((c != NULL) && (c->cmsg_level == SOL_SOCKET) &&
+        (c->cmsg_type == SCM_RIGHTS))
+        memcpy(fd, CMSG_DATA(c), sizeof(int));
+    return 0;
+}
+
+/************************************************************************
+ * handoff_listen opens the handoff socket at "path" for a later process
+ * to take over from this one. Returns the listening socket.
+ */
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Handoff socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("handoff socket");
+        exit(1);
+    }
+    unlink(path);
+    if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+        (listen(fd, 1) < 0)) {
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+/************************************************************************
+ * take_keep keeps a plane taken over until handoff_resume.
+ */
+static void take_keep(airplane *plane) {
+    if (ntaken == taken_cap) {
+        taken_cap = (taken_cap > 0) ? 2 * taken_cap : 64;
+        airplane **grown = realloc(taken, taken_cap * sizeof(airplane *));
+        if (grown == NULL) {
+            perror("handoff_take");
+            exit(1);
+        }
+        taken = grown;
+    }
+    taken[ntaken++] = plane;
+}
+
+/************************************************************************
+ * take_plane rebuilds a plane from a PLANE message and its socket, and
+ * puts it back in its place in the taxi queue.
+ */
+static void take_plane(handoff_msg *msg, int fd) {
+    airplane *plane = new_airplane(fd);
+    if (plane == NULL)
+        return;
+
+    plane_restore(plane, msg->state);
+    plane->proto = msg->proto;
+    plane->cleared_at = msg->value;
+    plane->hangup = msg->hangup;
+    plane->rx = msg->rx;
+    planelist_add(plane);
+    if (msg->id[0] != '\0') {
+        // A plane at an airport this server can't host has nowhere to
+        // go, so it is let go
+        int airport = airport_find(msg->airport, 1);
+        if (airport < 0) {
+            fprintf(stderr, "Handoff: flight %s at unknown airport %s\n",
+                    msg->id, msg->airport);
+            plane->hangup = 1;
+            take_keep(plane);
+            return;
+        }
+        plane->airport = airport;
+        flightid fid = flightid_intern(airport, msg->id);
+        if (planelist_changeid(plane, fid) < 0) {
+            fprintf(stderr, "Handoff: duplicate flight %s\n", msg->id);
+            flightid_release(fid);
+            plane->hangup = 1;
+            take_keep(plane);
+            return;
+        }
+    }
+
+    if ((msg->state == PLANE_TAXIING) || (msg->state == PLANE_CLEAR)) {
+        if (taxiqueue_adopt(plane) < 0) {
+            fprintf(stderr, "Handoff: flight %s was not queued\n", msg->id);
+            plane_restore(plane, PLANE_ATTERMINAL);
+        } else if (msg->subscribed) {
+            taxiqueue_subscribe(plane, 1, 0);
+        }
+    }
+    take_keep(plane);
+}
+
+/************************************************************************
+ * handoff_take takes over from a running server listening for a handoff
+ * at "path", setting "*listen_fd" to the listening socket it hands over.
+ * The taxi queues must be initialized, and empty. Returns the number of
+ * planes taken over (to be started with handoff_resume once the I/O
+ * threads are running), or -1 if there is no server to take over from.
+ * A handoff that breaks off half way is fatal, since the new process
+ * would otherwise be left with half the planes.
+ */
+int handoff_take(const char *path, int *listen_fd) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("handoff socket");
+        exit(1);
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    long started = metrics_now();
+    int nrunways = taxiqueue_runways();
+    handoff_msg *msg = malloc(sizeof(handoff_msg));
+    if (msg == NULL) {
+        perror("handoff_take");
+        exit(1);
+    }
+
+    int fd;
+    while (1) {
+        if (recv_msg(sock, msg, &fd) < 0) {
+            fprintf(stderr, "Handoff from %s broke off\n", path);
+            exit(1);
+        }
+        if (msg->type == MSG_END)
+            break;
+
+        int number = ((msg->runway - 1) % nrunways) + 1;
+        int airport = -1;
+        if ((msg->type == MSG_RUNWAY) || (msg->type == MSG_QUEUED))
+            airport = airport_find(msg->airport, 1);
+        switch (msg->type) {
+        case MSG_LISTENER:
+            *listen_fd = fd;
+            break;
+        case MSG_RUNWAY:
+            if (airport >= 0)
+                taxiqueue_set_clear_in(airport, number, msg->value);
+            break;
+        case MSG_QUEUED:
+            if (airport >= 0)
+                taxiqueue_restore(airport, number, msg->id);
+            break;
+        case MSG_PLANE:
+            take_plane(msg, fd);
+            break;
+        }
+    }
+    free(msg);
+
+    char ack = 1;
+    if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+        perror("handoff ack");
+        exit(1);
+    }
+    close(sock);
+    printf("Took over %d planes from the previous server in %.3f ms.\n",
+           ntaken, (metrics_now() - started) / 1e6);
+    return ntaken;
+}
+
+/************************************************************************
+ * handoff_resume runs any input the planes taken over already had, and
+ * hands them to the I/O threads. Call once eventloop_start has run.
+ */
+void handoff_resume(void) {
+    for (int i=0; i<ntaken; i++) {
+        airplane *plane = taken[i];
+        if (rxbuf_ready(&plane->rx, plane->proto == PROTO_BINARY))
+            doinput(plane);
+        if ((plane_state(plane) == PLANE_DONE) || plane->hangup) {
+            taxiqueue_remove(plane);
+            planelist_remove(plane);
+        } else {
+            eventloop_add(plane);
+        }
+    }
+    free(taken);
+    taken = NULL;
+    ntaken = taken_cap = 0;
+}
+
+// What the old process collects while it sends the queues
+
+typedef struct {
+    int sock;
+    int airport;
+    int runway;
+    int failed;
+    airplane **subs;        // Planes subscribed to position updates
+    int nsubs;
+    int subs_cap;
+    handoff_msg *msg;
+} give_state;
+
+/************************************************************************
+ * give_queued is the taxiqueue_export visitor that sends one queued
+ * flight.
+ */
+static void give_queued(const char *id, long ticket, airplane *sub,
+                        void *arg) {
+    give_state *gs = (give_state *)arg;
+    if (gs->failed)
+        return;
+
+    memset(gs->msg, 0, sizeof(handoff_msg));
+    gs->msg->type = MSG_QUEUED;
+    gs->msg->runway = gs->runway;
+    strcpy(gs->msg->id, id);
+    strcpy(gs->msg->airport, airport_code(gs->airport));
+    gs->failed = (send_msg(gs->sock, gs->msg, -1) < 0);
+
+    if (sub != NULL) {
+        if (gs->nsubs == gs->subs_cap) {
+            gs->subs_cap = (gs->subs_cap > 0) ? 2 * gs->subs_cap : 64;
+            airplane **grown = realloc(gs->subs, gs->subs_cap * sizeof(airplane *));
+            if (grown == NULL) {
+                perror("handoff_give");
+                exit(1);
+            }
+            gs->subs = grown;
+        }
+        gs->subs[gs->nsubs++] = sub;
+    }
+}
+
+static int plane_ptr_cmp(const void *a, const void *b) {
+    airplane *pa = *(airplane * const *)a;
+    airplane *pb = *(airplane * const *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+/************************************************************************
+ * flush_plane is the planelist_foreach visitor that pushes a plane's
+ * buffered output into its outbound queue.
+ */
+static int flush_plane(void *item, void *arg) {
+    fflush(((airplane *)item)->fp_send);
+    return 0;
+}
+
+/************************************************************************
+ * give_plane is the planelist_foreach visitor that sends one plane.
+ * Returns nonzero (stopping the walk) if sending fails.
+ */
+static int give_plane(void *item, void *arg) {
+    airplane *plane = (airplane *)item;
+    give_state *gs = (give_state *)arg;
+    if (plane_state(plane) == PLANE_DONE)
+        return 0;
+
+    handoff_msg *msg = gs->msg;
+    memset(msg, 0, sizeof(handoff_msg));
+    msg->type = MSG_PLANE;
+    msg->value = plane->cleared_at;
+    msg->state = plane_state(plane);
+    msg->proto = plane->proto;
+    // Output still queued can't go with the socket, so a plane that
+    // couldn't take it all in time is dropped as a slow consumer
+    msg->hangup = plane->hangup || (outq_pending(plane->out) != 0);
+    msg->subscribed = (bsearch(&plane, gs->subs, gs->nsubs, sizeof(airplane *),
+                               plane_ptr_cmp) != NULL);
+    strcpy(msg->id, flightid_name(plane->fid));
+    if (plane->fid != FLIGHTID_NONE)
+        strcpy(msg->airport, airport_code(plane->airport));
+    msg->rx = plane->rx;
+    gs->failed = (send_msg(gs->sock, msg, plane->fd) < 0);
+    return gs->failed;
+}
+
+/************************************************************************
+ * handoff_give hands the whole server over to the new process waiting
+ * on the handoff socket "upgrade_fd", with "listen_fd" as the listening
+ * socket, and exits. Returns (with the server still running) if the
+ * handoff fails. Runs on the accept thread of the epoll mode.
+ */
+void handoff_give(int upgrade_fd, int listen_fd) {
+    int sock = accept(upgrade_fd, NULL, NULL);
+    if (sock < 0) {
+        perror("handoff accept");
+        return;
+    }
+    struct timeval timeout = { .tv_sec = HANDOFF_ACK_TIMEOUT };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    printf("Handing over to a new server...\n");
+    eventloop_freeze();
+    workpool_freeze();
+    timers_freeze();
+    journal_flush();
+
+    give_state gs;
+    memset(&gs, 0, sizeof(gs));
+    gs.sock = sock;
+    gs.msg = malloc(sizeof(handoff_msg));
+    if (gs.msg == NULL) {
+        perror("handoff_give");
+        exit(1);
+    }
+
+    memset(gs.msg, 0, sizeof(handoff_msg));
+    gs.msg->type = MSG_LISTENER;
+    gs.failed = (send_msg(sock, gs.msg, listen_fd) < 0);
+
+    int nairports = airport_count();
+    for (int a=0; !gs.failed && a<nairports; a++) {
+        for (int r=1; !gs.failed && r<=taxiqueue_runways(); r++) {
+            memset(gs.msg, 0, sizeof(handoff_msg));
+            gs.msg->type = MSG_RUNWAY;
+            gs.msg->runway = r;
+            strcpy(gs.msg->airport, airport_code(a));
+            gs.msg->value = taxiqueue_clear_in(a, r);
+            gs.failed = (send_msg(sock, gs.msg, -1) < 0);
+            gs.airport = a;
+            gs.runway = r;
+            taxiqueue_export(a, r, give_queued, &gs);
+        }
+    }
+
+    qsort(gs.subs, gs.nsubs, sizeof(airplane *), plane_ptr_cmp);
+    if (!gs.failed) {
+        planelist_foreach(flush_plane, NULL);
+        outq_wait_idle(HANDOFF_ACK_TIMEOUT * 1000);
+        planelist_foreach(give_plane, &gs);
+    }
+
+    if (!gs.failed) {
+        memset(gs.msg, 0, sizeof(handoff_msg));
+        gs.msg->type = MSG_END;
+        gs.failed = (send_msg(sock, gs.msg, -1) < 0);
+    }
+
+    char ack;
+    if (!gs.failed && (recv(sock, &ack, 1, 0) == 1)) {
+        replica_moved();
+        printf("Handed over; exiting.\n");
+        fflush(stdout);
+        _exit(0);
+    }
+
+    fprintf(stderr, "Handoff failed; carrying on\n");
+    close(sock);
+    free(gs.subs);
+    free(gs.msg);
+    timers_thaw();
+    workpool_thaw();
+    eventloop_thaw();
+}
@@ -0,0 +1,16 @@
+// Function prototypes for handing a running server over to a new process
+
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+// How long the old process waits for the new one to confirm it has
+// taken everything over, before it gives up and carries on (seconds)
+
+#define HANDOFF_ACK_TIMEOUT 5
+
+int handoff_listen(const char *path);
+int handoff_take(const char *path, int *listen_fd);
+void handoff_resume(void);
+void handoff_give(int upgrade_fd, int listen_fd);
+
+#endif  // _HANDOFF_H
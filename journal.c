@@ -0,0 +1,632 @@
+// The journal module keeps the taxi queues across a restart. Every state
+// transition of a plane (see JOURNAL_* in journal.h) is appended to a
+// journal file as one line of text:
+//
+//   <seq> <op> <runway> <ticket> <flight id> [<airport>]
+//
+// with "seq" counting up from one record to the next, and the airport
+// code only there when the server hosts many airports (see airport.h).
+// On startup the last snapshot and then the journal records after it are
+// replayed, and the flights that were still queued go back into the taxi
+// queues, in their old order, as placeholders for the planes to claim
+// when they come back (see taxiqueue_restore).
+//
+// Recording a transition only formats the line into a memory buffer, so
+// it never waits on the disk (it is called with runway locks held, from
+// cmd_reqtaxi among others). A writer thread takes everything recorded
+// since its last write, writes it and fdatasync()s it in one go, so a
+// burst of transitions shares a single sync (group commit). A crash can
+// lose at most the records of the sync in progress.
+//
+// The writer also keeps its own copy of the queues, built from the
+// records it has written. Every JOURNAL_SNAPSHOT_RECORDS records it
+// writes that copy out as a snapshot (the same record lines, behind a
+// header with the seq it covers), renames it into place, and empties the
+// journal, so startup never has far to replay. Records at or below the
+// snapshot's seq are skipped on replay, so a crash between the rename
+// and the truncate is harmless.
+//
+// When a new process takes over from a running one (see handoff.c) the
+// queues come over live, with the planes, so nothing is restored: the
+// new process only picks up the seq and snapshots the queues it got.
+//
+// The same records are what a hot standby follows (see replica.c): each
+// batch goes to the standby once it is written, and a standby that
+// connects is first sent the writer's copy of the queues. A standby
+// builds its own copy from what it is sent (journal_follow), and
+// restores that when it takes over. A server with a standby but no
+// journal file keeps everything but the file itself.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+
+#include "airplane.h"
+#include "airport.h"
+#include "taxiqueue.h"
+#include "journal.h"
+#include "replica.h"
+
+// Longest record line (seq, op, runway, ticket, id and airport, with
+// spaces)
+
+#define RECORD_MAX (24 + 8 + 12 + 24 + PLANE_MAXID + AIRPORT_MAXCODE + 3)
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+static const char *op_names[] = {
+    [JOURNAL_REG] = "REG",
+    [JOURNAL_TAXI] = "TAXI",
+    [JOURNAL_CLEAR] = "CLEAR",
+    [JOURNAL_INAIR] = "INAIR",
+    [JOURNAL_GONE] = "GONE",
+    [JOURNAL_DISC] = "DISC",
+};
+
+#define NOPS ((int)(sizeof(op_names) / sizeof(op_names[0])))
+
+// The writer's copy of the taxi queues: the flights queued on each
+// runway of each airport, in ticket order
+
+typedef struct {
+    long ticket;
+    char id[PLANE_MAXID+1];
+} mirror_entry;
+
+typedef struct {
+    mirror_entry *entries;
+    int count;
+    int cap;
+} mirror_runway;
+
+typedef struct {
+    mirror_runway *runways;
+    int nrunways;
+} mirror_airport;
+
+static mirror_airport *mirror;
+static int mirror_nairports;
+
+static int journal_on;        // Set once transitions are being recorded
+static int journal_fd = -1;   // The journal file, if there is one
+static char *journal_path;
+static char *snap_path;
+static char *snap_tmp_path;
+
+// Records not yet written, and the seq for the next one
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static char *pending;
+static int pending_len;
+static int pending_cap;
+static long next_seq;
+static long synced_seq;       // Last seq written, synced and snapshotted
+static int snapshot_wanted;   // A new standby wants the queues
+
+// The mirror formatted as a snapshot; only used by the writer (and by
+// journal_open before it starts)
+
+static char *snap_buf;
+static int snap_cap;
+
+// Last seq taken in from the primary, on a standby
+
+static long followed_seq;
+
+static pthread_t writer_thread;
+
+/************************************************************************
+ * reserve grows the buffer "*buf" (of "*cap" bytes, "len" of them used)
+ * so it has room for at least one more record.
+ */
+static void reserve(char **buf, int *cap, int len) {
+    if (len + RECORD_MAX <= *cap)
+        return;
+    int newcap = (*cap > 0) ? 2 * *cap : 4096;
+    char *grown = realloc(*buf, newcap);
+    if (grown == NULL) {
+        perror("journal reserve");
+        exit(1);
+    }
+    *buf = grown;
+    *cap = newcap;
+}
+
+/************************************************************************
+ * mirror_apply applies one record, for the airport with code "code", to
+ * the writer's copy of the queues. Records for airports this server
+ * can't host are left out.
+ */
+static void mirror_apply(int op, const char *code, int runway, long ticket,
+                         const char *id) {
+    if ((runway < 1) || ((op != JOURNAL_TAXI) && (op != JOURNAL_INAIR) &&
+                         (op != JOURNAL_GONE)))
+        return;
+    int airport = airport_find(code, 1);
+    if (airport < 0)
+        return;
+
+    if (airport >= mirror_nairports) {
+        mirror_airport *grown = realloc(mirror,
+                                        (airport + 1) * sizeof(mirror_airport));
+        if (grown == NULL) {
+            perror("journal mirror_apply");
+            exit(1);
+        }
+        memset(grown + mirror_nairports, 0,
+               (airport + 1 - mirror_nairports) * sizeof(mirror_airport));
+        mirror = grown;
+        mirror_nairports = airport + 1;
+    }
+    mirror_airport *ma = &mirror[airport];
+    if (runway > ma->nrunways) {
+        mirror_runway *grown = realloc(ma->runways,
+                                       runway * sizeof(mirror_runway));
+        if (grown == NULL) {
+            perror("journal mirror_apply");
+            exit(1);
+        }
+        memset(grown + ma->nrunways, 0,
+               (runway - ma->nrunways) * sizeof(mirror_runway));
+        ma->runways = grown;
+        ma->nrunways = runway;
+    }
+    mirror_runway *m = &ma->runways[runway - 1];
+
+    // Binary search for the ticket (tickets only ever increase, so new
+    // ones almost always go at the end)
+    int lo = 0, hi = m->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m->entries[mid].ticket < ticket)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int found = (lo < m->count) && (m->entries[lo].ticket == ticket);
+
+    if (op == JOURNAL_TAXI) {
+        if (found)
+            return;
+        if (m->count == m->cap) {
+            int newcap = (m->cap > 0) ? 2 * m->cap : 64;
+            mirror_entry *grown = realloc(m->entries, newcap * sizeof(mirror_entry));
+            if (grown == NULL) {
+                perror("journal mirror_apply");
+                exit(1);
+            }
+            m->entries = grown;
+            m->cap = newcap;
+        }
+        memmove(m->entries + lo + 1, m->entries + lo,
+                (m->count - lo) * sizeof(mirror_entry));
+        m->entries[lo].ticket = ticket;
+        strcpy(m->entries[lo].id, id);
+        m->count++;
+    } else if (found) {
+        memmove(m->entries + lo, m->entries + lo + 1,
+                (m->count - lo - 1) * sizeof(mirror_entry));
+        m->count--;
+    }
+}
+
+// Where mirror_copy is copying a live queue from
+
+typedef struct {
+    int airport;
+    int runway;
+} mirror_source;
+
+/************************************************************************
+ * mirror_copy is the taxiqueue_export visitor that copies a live queue
+ * (mirror_source *arg) into the mirror.
+ */
+static void mirror_copy(const char *id, long ticket, airplane *sub,
+                        void *arg) {
+    mirror_source *src = (mirror_source *)arg;
+    mirror_apply(JOURNAL_TAXI, airport_code(src->airport), src->runway,
+                 ticket, id);
+}
+
+/************************************************************************
+ * format_record writes one record line into "buf" (RECORD_MAX bytes).
+ * Returns its length.
+ */
+static int format_record(char *buf, long seq, int op, int airport,
+                         int runway, long ticket, const char *id) {
+    const char *code = airport_code(airport);
+    return snprintf(buf, RECORD_MAX, "%ld %s %d %ld %s%s%s\n", seq,
+                    op_names[op], runway, ticket, id,
+                    (code[0] != '\0') ? " " : "", code);
+}
+
+/************************************************************************
+ * parse_record splits up one record line, setting "code" to its airport
+ * code ("" if it has none). Returns the op, or -1 if the line isn't a
+ * record.
+ */
+static int parse_record(const char *line, long *seq, int *runway,
+                        long *ticket, char *id, char *code) {
+    char opname[16];
+    code[0] = '\0';
+    if (sscanf(line, "%ld %15s %d %ld %" XSTR(PLANE_MAXID) "s %"
+               XSTR(AIRPORT_MAXCODE) "s",
+               seq, opname, runway, ticket, id, code) < 5)
+        return -1;
+    for (int op=0; op<NOPS; op++) {
+        if (strcmp(opname, op_names[op]) == 0)
+            return op;
+    }
+    return -1;
+}
+
+/************************************************************************
+ * replay applies the records in file "fp" with a seq above "after" to
+ * the mirror, stopping at a torn (unterminated) last line. Returns the
+ * last seq applied, or "after" if there were none.
+ */
+static long replay(FILE *fp, long after) {
+    long last = after;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len-1] != '\n')
+            break;  // Crashed partway through writing this one
+
+        long seq, ticket;
+        int runway;
+        char id[PLANE_MAXID+1];
+        char code[AIRPORT_MAXCODE+1];
+        int op = parse_record(line, &seq, &runway, &ticket, id, code);
+        if ((op >= 0) && (seq > after)) {
+            mirror_apply(op, code, runway, ticket, id);
+            last = seq;
+        }
+    }
+    free(line);
+    return last;
+}
+
+/************************************************************************
+ * format_snapshot formats the mirror as the snapshot for everything up
+ * to record "seq" into snap_buf. Returns its length.
+ */
+static int format_snapshot(long seq) {
+    reserve(&snap_buf, &snap_cap, 0);
+    int len = snprintf(snap_buf, snap_cap, "GNDSNAP %ld\n", seq);
+    for (int a=0; a<mirror_nairports; a++) {
+        for (int r=0; r<mirror[a].nrunways; r++) {
+            mirror_runway *m = &mirror[a].runways[r];
+            for (int i=0; i<m->count; i++) {
+                reserve(&snap_buf, &snap_cap, len);
+                len += format_record(snap_buf + len, seq, JOURNAL_TAXI, a,
+                                     r + 1, m->entries[i].ticket,
+                                     m->entries[i].id);
+            }
+        }
+    }
+    return len;
+}
+
+/************************************************************************
+ * write_snapshot writes the mirror out as the snapshot for everything up
+ * to record "seq", replacing the old one only once the new one is safely
+ * on disk. Returns 0, or -1 on failure (leaving the old snapshot).
+ */
+static int write_snapshot(long seq) {
+    FILE *fp = fopen(snap_tmp_path, "w");
+    if (fp == NULL) {
+        perror("journal snapshot");
+        return -1;
+    }
+
+    fwrite(snap_buf, 1, format_snapshot(seq), fp);
+    if ((fflush(fp) != 0) || (fsync(fileno(fp)) < 0)) {
+        perror("journal snapshot");
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    if (rename(snap_tmp_path, snap_path) < 0) {
+        perror("journal snapshot rename");
+        return -1;
+    }
+
+    // The rename is only durable once the directory is synced
+    char *dir = strdup(snap_path);
+    int dir_fd = open(dirname(dir), O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    free(dir);
+    return 0;
+}
+
+/************************************************************************
+ * writer_main is the loop run by the writer thread: write and sync
+ * whatever has been recorded, pass it on to the standby, bring the
+ * mirror up to date, and snapshot when the journal has grown long
+ * enough (or a new standby wants the queues).
+ */
+static void *writer_main(void *arg) {
+    char *batch = NULL;
+    int batch_cap = 0;
+    long since_snapshot = 0;
+    long last_seq = synced_seq;
+
+    while (1) {
+        pthread_mutex_lock(&journal_lock);
+        while ((pending_len == 0) && !snapshot_wanted)
+            pthread_cond_wait(&journal_cond, &journal_lock);
+
+        // Swap buffers, so recording carries on while this batch is
+        // written
+        char *full = pending;
+        int full_cap = pending_cap;
+        int len = pending_len;
+        int want_snapshot = snapshot_wanted;
+        pending = batch;
+        pending_cap = batch_cap;
+        pending_len = 0;
+        snapshot_wanted = 0;
+        batch = full;
+        batch_cap = full_cap;
+        pthread_mutex_unlock(&journal_lock);
+
+        for (int off=0; (journal_fd >= 0) && (off < len); ) {
+            ssize_t n = write(journal_fd, batch + off, len - off);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("journal write");
+                exit(1);
+            }
+            off += n;
+        }
+        // Nothing may be acknowledged, mirrored or passed on that did not
+        // reach the disk
+        if ((journal_fd >= 0) && (len > 0) && (fdatasync(journal_fd) < 0)) {
+            perror("journal fdatasync");
+            exit(1);
+        }
+
+        for (char *line=batch; line<batch+len; ) {
+            char *nl = memchr(line, '\n', batch + len - line);
+            *nl = '\0';
+            long seq, ticket;
+            int runway;
+            char id[PLANE_MAXID+1];
+            char code[AIRPORT_MAXCODE+1];
+            int op = parse_record(line, &seq, &runway, &ticket, id, code);
+            if (op >= 0) {
+                mirror_apply(op, code, runway, ticket, id);
+                last_seq = seq;
+                since_snapshot++;
+            }
+            *nl = '\n';
+            line = nl + 1;
+        }
+
+        // The standby only ever gets what is already on disk here
+        if (len > 0)
+            replica_send(batch, len, last_seq);
+        if (want_snapshot)
+            replica_start(snap_buf, format_snapshot(last_seq), last_seq);
+
+        if ((journal_fd >= 0) &&
+            (since_snapshot >= JOURNAL_SNAPSHOT_RECORDS) &&
+            (write_snapshot(last_seq) == 0)) {
+            if (ftruncate(journal_fd, 0) < 0)
+                perror("journal truncate");
+            since_snapshot = 0;
+        }
+
+        pthread_mutex_lock(&journal_lock);
+        synced_seq = last_seq;
+        pthread_cond_broadcast(&journal_cond);
+        pthread_mutex_unlock(&journal_lock);
+    }
+
+    return NULL;
+}
+
+/************************************************************************
+ * journal_record records one state transition (a JOURNAL_* op) of flight
+ * "id" at airport "airport". Does nothing if there is no journal.
+ */
+void journal_record(int op, int airport, int runway, long ticket,
+                    const char *id) {
+    if (!journal_on)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    reserve(&pending, &pending_cap, pending_len);
+    int was_empty = (pending_len == 0);
+    pending_len += format_record(pending + pending_len, next_seq++, op,
+                                 airport, runway, ticket, id);
+    if (was_empty)
+        pthread_cond_signal(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/************************************************************************
+ * journal_flush waits until every transition recorded so far is on disk
+ * (and sent to the standby), and the writer has gone idle. Does nothing
+ * if there is no journal.
+ */
+void journal_flush(void) {
+    if (!journal_on)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    while (synced_seq < next_seq - 1)
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/************************************************************************
+ * Returns "path" with "suffix" added, in a new string.
+ */
+static char *with_suffix(const char *path, const char *suffix) {
+    char *s = malloc(strlen(path) + strlen(suffix) + 1);
+    if (s == NULL) {
+        perror("journal_open");
+        exit(1);
+    }
+    strcpy(s, path);
+    strcat(s, suffix);
+    return s;
+}
+
+/************************************************************************
+ * journal_want_snapshot has the writer send the standby (see replica.c)
+ * a snapshot of the queues as soon as it can, after which the standby
+ * is sent every batch of records.
+ */
+void journal_want_snapshot(void) {
+    pthread_mutex_lock(&journal_lock);
+    snapshot_wanted = 1;
+    pthread_cond_signal(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/************************************************************************
+ * journal_follow takes in one line sent by the primary, on a standby: a
+ * snapshot header (which starts the copy of the queues over) or a
+ * record. Returns its seq, or -1 if it is neither.
+ */
+long journal_follow(const char *line) {
+    long seq, ticket;
+    int runway;
+    char id[PLANE_MAXID+1];
+    char code[AIRPORT_MAXCODE+1];
+
+    if (sscanf(line, "GNDSNAP %ld", &seq) == 1) {
+        for (int a=0; a<mirror_nairports; a++) {
+            for (int r=0; r<mirror[a].nrunways; r++)
+                free(mirror[a].runways[r].entries);
+            free(mirror[a].runways);
+        }
+        free(mirror);
+        mirror = NULL;
+        mirror_nairports = 0;
+    } else {
+        int op = parse_record(line, &seq, &runway, &ticket, id, code);
+        if (op < 0)
+            return -1;
+        mirror_apply(op, code, runway, ticket, id);
+    }
+    followed_seq = seq;
+    return seq;
+}
+
+/************************************************************************
+ * journal_open starts recording state transitions, to the journal at
+ * "path" if it isn't NULL (and for a standby, if there is one). Where
+ * the queues come from depends on "queues":
+ *
+ *   JOURNAL_RESTORE   the journal (and its snapshot, "path.snap") is
+ *                     replayed, and the flights that were queued put
+ *                     back
+ *   JOURNAL_LIVE      they are already live (handed over), and the
+ *                     journal is only replayed for its seq
+ *   JOURNAL_FOLLOWED  they are what was followed from the primary (see
+ *                     journal_follow), and are put back; the journal is
+ *                     not replayed, and the seq carries on from the
+ *                     primary's
+ *
+ * The taxi queues, airports and timers must already be initialized, and
+ * no planes connected yet (other than those handed over). Airports with
+ * flights to restore are set up as they are replayed.
+ */
+void journal_open(const char *path, int queues) {
+    long seq = 0;
+    if (path != NULL) {
+        journal_path = with_suffix(path, "");
+        snap_path = with_suffix(path, ".snap");
+        snap_tmp_path = with_suffix(path, ".snap.tmp");
+    }
+    if (queues == JOURNAL_FOLLOWED) {
+        seq = followed_seq;
+    } else if (path != NULL) {
+        FILE *fp = fopen(snap_path, "r");
+        if (fp != NULL) {
+            if (fscanf(fp, "GNDSNAP %ld\n", &seq) == 1)
+                replay(fp, seq - 1);
+            fclose(fp);
+        }
+        if ((fp = fopen(journal_path, "r")) != NULL) {
+            seq = replay(fp, seq);
+            fclose(fp);
+        }
+    }
+
+    // Put the queued flights back, in order. Tickets start again from
+    // scratch, so the mirror is rebuilt with the new ones; flights from a
+    // runway that no longer exists go to the end of another one.
+    // Handed-over queues are already in place, and are just copied.
+    int restore = (queues != JOURNAL_LIVE);
+    mirror_airport *old = mirror;
+    int old_nairports = mirror_nairports;
+    mirror = NULL;
+    mirror_nairports = 0;
+    int restored = 0;
+    for (int a=0; a<old_nairports; a++) {
+        const char *code = airport_code(a);
+        for (int r=0; r<old[a].nrunways; r++) {
+            mirror_runway *m = &old[a].runways[r];
+            int number = (r % taxiqueue_runways()) + 1;
+            for (int i=0; restore && i<m->count; i++) {
+                long ticket = taxiqueue_restore(a, number, m->entries[i].id);
+                mirror_apply(JOURNAL_TAXI, code, number, ticket,
+                             m->entries[i].id);
+                restored++;
+            }
+            free(m->entries);
+        }
+        free(old[a].runways);
+    }
+    free(old);
+    if (restored > 0)
+        printf("Restored %d queued flights from the %s.\n", restored,
+               (queues == JOURNAL_FOLLOWED) ? "primary" : "journal");
+    int nairports = airport_count();
+    for (int a=0; !restore && a<nairports; a++) {
+        for (int r=1; r<=taxiqueue_runways(); r++) {
+            mirror_source src = { a, r };
+            taxiqueue_export(a, r, mirror_copy, &src);
+        }
+    }
+
+    // The restored queues become the new snapshot, and then the journal
+    // can start again empty
+    if (path != NULL) {
+        if (write_snapshot(seq) < 0) {
+            fprintf(stderr, "Can't write journal snapshot %s\n", snap_path);
+            exit(1);
+        }
+        int fd = open(journal_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if ((fd < 0) || (ftruncate(fd, 0) < 0)) {
+            perror(journal_path);
+            exit(1);
+        }
+        journal_fd = fd;
+    }
+    next_seq = seq + 1;
+    synced_seq = seq;
+
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        perror("journal_open - pthread_create");
+        exit(1);
+    }
+    journal_on = 1;
+}
@@ -0,0 +1,35 @@
+// Types and function prototypes for the write-ahead journal
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+// Journaled state transitions. Every record also carries an airport (see
+// airport.h), a runway and taxi ticket (0 for REG and DISC) and a flight
+// id.
+
+#define JOURNAL_REG 0      // Plane registered its flight id
+#define JOURNAL_TAXI 1     // Plane joined a runway's taxi queue
+#define JOURNAL_CLEAR 2    // Plane cleared for takeoff
+#define JOURNAL_INAIR 3    // Plane took off (and left the queue)
+#define JOURNAL_GONE 4     // Plane left the queue without taking off
+#define JOURNAL_DISC 5     // Registered plane disconnected
+
+// Records written between snapshots; after this many the journal is
+// compacted into a new snapshot and started again
+
+#define JOURNAL_SNAPSHOT_RECORDS 10000
+
+// Where journal_open gets the taxi queues from
+
+#define JOURNAL_RESTORE 0   // Restored from the journal file
+#define JOURNAL_LIVE 1      // Already live (handed over; see handoff.c)
+#define JOURNAL_FOLLOWED 2  // Restored from the primary (see replica.c)
+
+void journal_open(const char *path, int queues);
+void journal_record(int op, int airport, int runway, long ticket,
+                    const char *id);
+void journal_flush(void);
+void journal_want_snapshot(void);
+long journal_follow(const char *line);
+
+#endif  // _JOURNAL_H
@@ -0,0 +1,412 @@
+// The metrics module keeps the server's counters and latency histograms
+// and exports them in the Prometheus text format.
+//
+// Recording has to be cheap enough to leave on for every command, so
+// each thread records into its own shard and never touches a lock or an
+// atomic read-modify-write. The exporter reads the shards while they are
+// being written; every field is written with a single relaxed store by
+// its one owning thread, so a scrape may be a few events behind but never
+// sees a torn value.
+//
+// Shards are never freed. When a thread exits its shard goes on a free
+// list for the next new thread, still holding its counts, so totals
+// survive the short-lived client threads of the threaded server mode,
+// and there are only ever as many shards as there were threads at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "airplane.h"
+#include "airs_protocol.h"
+#include "metrics.h"
+#include "airport.h"
+#include "replica.h"
+#include "taxiqueue.h"
+
+#define SUB_COUNT (1 << METRICS_SUB_BITS)
+
+typedef struct {
+    unsigned long buckets[METRICS_BUCKETS];
+    unsigned long count;
+    unsigned long sum_ns;
+} histogram;
+
+typedef struct metrics_shard {
+    histogram commands[CMD_COUNT];
+    histogram takeoff;                  // Clearance to INAIR
+    unsigned long errors[ERR_COUNT];
+    unsigned long counters[MET_NCOUNTERS];
+    struct metrics_shard *next;         // Every shard, for the exporter
+    struct metrics_shard *free_next;    // Shards of threads that exited
+} metrics_shard;
+
+static __thread metrics_shard *shard;
+static pthread_key_t shard_key;      // Only used for its destructor
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+
+static metrics_shard *all_shards;
+static metrics_shard *free_shards;
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/************************************************************************
+ * shard_release puts an exiting thread's shard on the free list.
+ */
+static void shard_release(void *arg) {
+    metrics_shard *s = (metrics_shard *)arg;
+    pthread_mutex_lock(&shard_lock);
+    s->free_next = free_shards;
+    free_shards = s;
+    pthread_mutex_unlock(&shard_lock);
+}
+
+static void shard_key_init(void) {
+    pthread_key_create(&shard_key, shard_release);
+}
+
+/************************************************************************
+ * shard_attach gives this thread a shard, the first time it records
+ * anything.
+ */
+static metrics_shard *shard_attach(void) {
+    pthread_once(&shard_once, shard_key_init);
+
+    pthread_mutex_lock(&shard_lock);
+    metrics_shard *s = free_shards;
+    if (s != NULL) {
+        free_shards = s->free_next;
+    } else {
+        if ((s = calloc(1, sizeof(metrics_shard))) == NULL) {
+            perror("metrics - new shard");
+            exit(1);
+        }
+        // Publish only once zeroed, since the exporter walks this list
+        // without the lock
+        __atomic_store_n(&s->next, all_shards, __ATOMIC_RELAXED);
+        __atomic_store_n(&all_shards, s, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&shard_lock);
+
+    pthread_setspecific(shard_key, s);
+    shard = s;
+    return s;
+}
+
+static inline metrics_shard *my_shard(void) {
+    metrics_shard *s = shard;
+    return (s != NULL) ? s : shard_attach();
+}
+
+// Only the owning thread writes a shard, so a plain load and a relaxed
+// store is all an increment needs
+static inline void bump(unsigned long *field, unsigned long by) {
+    __atomic_store_n(field, *field + by, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long peek(unsigned long *field) {
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+/************************************************************************
+ * Returns the current time in ns on a monotonic clock, for timing
+ * things to record with the metrics_* functions.
+ */
+long metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/************************************************************************
+ * Histogram bucket arithmetic. bucket_of finds the bucket for a value;
+ * bucket_limit is the (exclusive) upper bound of the values in a bucket.
+ */
+static int bucket_of(long ns) {
+    if (ns < SUB_COUNT)
+        return (ns < 0) ? 0 : (int)ns;
+
+    int msb = 63 - __builtin_clzl((unsigned long)ns);
+    if (msb > METRICS_MAX_BITS)
+        return METRICS_BUCKETS - 1;
+    int shift = msb - METRICS_SUB_BITS;
+    return ((shift + 1) << METRICS_SUB_BITS) |
+           (int)((ns >> shift) & (SUB_COUNT - 1));
+}
+
+static unsigned long bucket_limit(int bucket) {
+    int group = bucket >> METRICS_SUB_BITS;
+    unsigned long sub = bucket & (SUB_COUNT - 1);
+    if (group == 0)
+        return sub + 1;
+    return (SUB_COUNT + sub + 1) << (group - 1);
+}
+
+static void hist_record(histogram *h, long ns) {
+    bump(&h->buckets[bucket_of(ns)], 1);
+    bump(&h->count, 1);
+    bump(&h->sum_ns, (ns > 0) ? ns : 0);
+}
+
+/************************************************************************
+ * Recording functions, called from the threads doing the work.
+ */
+void metrics_count(int counter) {
+    bump(&my_shard()->counters[counter], 1);
+}
+
+void metrics_command(int cmd, long elapsed_ns) {
+    hist_record(&my_shard()->commands[cmd], elapsed_ns);
+}
+
+void metrics_error(int code) {
+    bump(&my_shard()->errors[code], 1);
+}
+
+void metrics_takeoff(long elapsed_ns) {
+    metrics_shard *s = my_shard();
+    hist_record(&s->takeoff, elapsed_ns);
+    bump(&s->counters[MET_TAKEOFFS], 1);
+}
+
+/************************************************************************
+ * Export. Totals are gathered from every shard into a snapshot, which is
+ * then written out.
+ */
+typedef struct {
+    histogram commands[CMD_COUNT];
+    histogram takeoff;
+    unsigned long errors[ERR_COUNT];
+    unsigned long counters[MET_NCOUNTERS];
+} metrics_totals;
+
+static void hist_add(histogram *to, histogram *from) {
+    for (int i=0; i<METRICS_BUCKETS; i++)
+        to->buckets[i] += peek(&from->buckets[i]);
+    to->count += peek(&from->count);
+    to->sum_ns += peek(&from->sum_ns);
+}
+
+static void metrics_gather(metrics_totals *t) {
+    memset(t, 0, sizeof(*t));
+    metrics_shard *s = __atomic_load_n(&all_shards, __ATOMIC_ACQUIRE);
+    for (; s != NULL; s = __atomic_load_n(&s->next, __ATOMIC_RELAXED)) {
+        for (int c=0; c<CMD_COUNT; c++)
+            hist_add(&t->commands[c], &s->commands[c]);
+        hist_add(&t->takeoff, &s->takeoff);
+        for (int e=0; e<ERR_COUNT; e++)
+            t->errors[e] += peek(&s->errors[e]);
+        for (int i=0; i<MET_NCOUNTERS; i++)
+            t->counters[i] += peek(&s->counters[i]);
+    }
+}
+
+/************************************************************************
+ * Returns the smallest bucket limit (in ns) that at least a fraction "q"
+ * of the histogram's values are under.
+ */
+static unsigned long hist_quantile(histogram *h, double q) {
+    unsigned long total = 0;
+    for (int i=0; i<METRICS_BUCKETS; i++)
+        total += h->buckets[i];
+    if (total == 0)
+        return 0;
+
+    unsigned long want = (unsigned long)(q * total);
+    if (want < 1)
+        want = 1;
+    unsigned long seen = 0;
+    for (int i=0; i<METRICS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want)
+            return bucket_limit(i);
+    }
+    return bucket_limit(METRICS_BUCKETS - 1);
+}
+
+// Quantiles exported for each histogram, from the full HDR buckets
+
+static const struct {
+    double q;
+    const char *label;
+} quantiles[] = {
+    { 0.5, "0.5" }, { 0.9, "0.9" }, { 0.99, "0.99" }, { 0.999, "0.999" },
+};
+
+/************************************************************************
+ * Writes one histogram, with "labels" (a Prometheus label list without
+ * the braces, or "" for none). The Prometheus "le" buckets are the powers
+ * of two from 1us up, coarser than the recorded buckets; the quantiles,
+ * exported as a separate gauge, come from the recorded buckets.
+ */
+static void write_hist(FILE *out, const char *name, const char *labels,
+                       histogram *h) {
+    const char *sep = (labels[0] != '\0') ? "," : "";
+    char block[80] = "";  // The labels with their braces, if there are any
+    if (labels[0] != '\0')
+        snprintf(block, sizeof(block), "{%s}", labels);
+
+    unsigned long cum = 0;
+    int bucket = 0;
+    for (int bits=10; bits<=METRICS_MAX_BITS; bits++) {
+        int last_group = bits - METRICS_SUB_BITS;  // Bucket limits <= 2^bits
+        for (; (bucket >> METRICS_SUB_BITS) <= last_group; bucket++)
+            cum += h->buckets[bucket];
+        fprintf(out, "%s_bucket{%s%sle=\"%.9g\"} %lu\n", name, labels, sep,
+                (double)(1UL << bits) / 1e9, cum);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep,
+            h->count);
+    fprintf(out, "%s_sum%s %.9f\n", name, block, h->sum_ns / 1e9);
+    fprintf(out, "%s_count%s %lu\n", name, block, h->count);
+}
+
+static void write_quantiles(FILE *out, const char *name, const char *labels,
+                            histogram *h) {
+    const char *sep = (labels[0] != '\0') ? "," : "";
+    for (int i=0; i<(int)(sizeof(quantiles)/sizeof(quantiles[0])); i++) {
+        fprintf(out, "%s{%s%squantile=\"%s\"} %.9f\n", name, labels, sep,
+                quantiles[i].label, hist_quantile(h, quantiles[i].q) / 1e9);
+    }
+}
+
+/************************************************************************
+ * Writes every metric to "out" in the Prometheus text exposition format.
+ */
+static void metrics_write(FILE *out) {
+    metrics_totals *t = malloc(sizeof(metrics_totals));
+    if (t == NULL) {
+        perror("metrics - export");
+        return;
+    }
+    metrics_gather(t);
+
+    char labels[64];
+
+    fprintf(out, "# HELP gnd_command_duration_seconds Time to run a command, by command.\n");
+    fprintf(out, "# TYPE gnd_command_duration_seconds histogram\n");
+    for (int c=0; c<CMD_COUNT; c++) {
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_name(c));
+        write_hist(out, "gnd_command_duration_seconds", labels,
+                   &t->commands[c]);
+    }
+    fprintf(out, "# HELP gnd_command_duration_quantile_seconds Command time quantiles.\n");
+    fprintf(out, "# TYPE gnd_command_duration_quantile_seconds gauge\n");
+    for (int c=0; c<CMD_COUNT; c++) {
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_name(c));
+        write_quantiles(out, "gnd_command_duration_quantile_seconds", labels,
+                        &t->commands[c]);
+    }
+
+    fprintf(out, "# HELP gnd_clear_to_inair_seconds Time from takeoff clearance to INAIR.\n");
+    fprintf(out, "# TYPE gnd_clear_to_inair_seconds histogram\n");
+    write_hist(out, "gnd_clear_to_inair_seconds", "", &t->takeoff);
+    fprintf(out, "# HELP gnd_clear_to_inair_quantile_seconds Clearance to INAIR quantiles.\n");
+    fprintf(out, "# TYPE gnd_clear_to_inair_quantile_seconds gauge\n");
+    write_quantiles(out, "gnd_clear_to_inair_quantile_seconds", "", &t->takeoff);
+
+    fprintf(out, "# HELP gnd_errors_total Error replies sent, by ERR code.\n");
+    fprintf(out, "# TYPE gnd_errors_total counter\n");
+    for (int e=1; e<ERR_COUNT; e++)
+        fprintf(out, "gnd_errors_total{code=\"%d\"} %lu\n", e, t->errors[e]);
+
+    fprintf(out, "# HELP gnd_connections_total Connections accepted.\n");
+    fprintf(out, "# TYPE gnd_connections_total counter\n");
+    fprintf(out, "gnd_connections_total %lu\n", t->counters[MET_CONNECTS]);
+    fprintf(out, "# HELP gnd_takeoffs_total Planes that reported INAIR.\n");
+    fprintf(out, "# TYPE gnd_takeoffs_total counter\n");
+    fprintf(out, "gnd_takeoffs_total %lu\n", t->counters[MET_TAKEOFFS]);
+    fprintf(out, "# HELP gnd_slow_consumer_drops_total Planes disconnected for not reading their output.\n");
+    fprintf(out, "# TYPE gnd_slow_consumer_drops_total counter\n");
+    fprintf(out, "gnd_slow_consumer_drops_total %lu\n", t->counters[MET_SLOW_DROPS]);
+
+    // Counted separately, so a scrape between the two can be off by a
+    // plane or two; never let that show as a negative count
+    long connected = (long)(t->counters[MET_CONNECTS] -
+                            t->counters[MET_DISCONNECTS]);
+    fprintf(out, "# HELP gnd_planes_connected Planes currently connected.\n");
+    fprintf(out, "# TYPE gnd_planes_connected gauge\n");
+    fprintf(out, "gnd_planes_connected %ld\n", (connected > 0) ? connected : 0);
+
+    // Hosting many airports, every runway is labelled with its airport
+    fprintf(out, "# HELP gnd_taxi_queue_planes Planes in the taxi queue, by runway.\n");
+    fprintf(out, "# TYPE gnd_taxi_queue_planes gauge\n");
+    int nairports = airport_count();
+    for (int a=0; a<nairports; a++) {
+        for (int r=1; r<=taxiqueue_runways(); r++) {
+            if (airport_multi())
+                fprintf(out, "gnd_taxi_queue_planes{airport=\"%s\",runway=\"%d\"} %d\n",
+                        airport_code(a), r, taxiqueue_length(a, r));
+            else
+                fprintf(out, "gnd_taxi_queue_planes{runway=\"%d\"} %d\n", r,
+                        taxiqueue_length(a, r));
+        }
+    }
+
+    // Only a server that takes a standby has these
+    if (replica_serving()) {
+        long lag = replica_lag();
+        fprintf(out, "# HELP gnd_standby_connected Whether a hot standby is up to date.\n");
+        fprintf(out, "# TYPE gnd_standby_connected gauge\n");
+        fprintf(out, "gnd_standby_connected %d\n", lag >= 0);
+        fprintf(out, "# HELP gnd_standby_lag_records Journal records sent to the standby and not yet acknowledged.\n");
+        fprintf(out, "# TYPE gnd_standby_lag_records gauge\n");
+        fprintf(out, "gnd_standby_lag_records %ld\n", (lag >= 0) ? lag : 0);
+    }
+
+    free(t);
+}
+
+/************************************************************************
+ * The admin thread serves the metrics to anything that connects: an HTTP
+ * GET (as sent by a Prometheus scraper or curl) gets an HTTP response,
+ * and anything else (like nc) just gets the text.
+ */
+static void *admin_thread(void *arg) {
+    int listen_fd = (int)(long)arg;
+
+    int fd;
+    while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+        // Don't let a client that never sends anything hold up the
+        // next scrape for long
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        char request[1024];
+        ssize_t got = recv(fd, request, sizeof(request), 0);
+
+        FILE *out = fdopen(fd, "w");
+        if (out == NULL) {
+            close(fd);
+            continue;
+        }
+        if ((got >= 4) && (memcmp(request, "GET ", 4) == 0)) {
+            fprintf(out, "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Connection: close\r\n\r\n");
+        }
+        metrics_write(out);
+        fclose(out);
+    }
+
+    perror("metrics - accept");
+    return NULL;
+}
+
+/************************************************************************
+ * metrics_serve starts a thread exporting the metrics to connections on
+ * "listen_fd", which should be a listener that only accepts local
+ * connections.
+ */
+void metrics_serve(int listen_fd) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_thread, (void *)(long)listen_fd) != 0) {
+        perror("metrics_serve - pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
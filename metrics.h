@@ -0,0 +1,39 @@
+// Function prototypes and constants for the metrics module
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+// Every thread that records anything gets its own set of counters and
+// histograms, so recording is a few plain stores to memory no other
+// thread writes. The sets are only added up when the metrics are
+// exported.
+
+// Counters (besides the per-command and per-error ones)
+
+#define MET_CONNECTS 0       // Connections accepted
+#define MET_DISCONNECTS 1    // Connections closed
+#define MET_TAKEOFFS 2       // Planes that reported INAIR
+#define MET_SLOW_DROPS 3     // Planes dropped as slow consumers (outq.c)
+#define MET_NCOUNTERS 4
+
+// Latency histograms have HDR-style log-linear buckets: each power of two
+// (of nanoseconds) is split into 2^METRICS_SUB_BITS equal buckets, so any
+// recorded value is known to within 1/2^METRICS_SUB_BITS (12.5%) however
+// large it is. Values past 2^METRICS_MAX_BITS ns (about 9 minutes) all
+// count in the last bucket.
+
+#define METRICS_SUB_BITS 3
+#define METRICS_MAX_BITS 39
+#define METRICS_BUCKETS (((METRICS_MAX_BITS - METRICS_SUB_BITS + 2) \
+                          << METRICS_SUB_BITS))
+
+long metrics_now(void);
+
+void metrics_count(int counter);
+void metrics_command(int cmd, long elapsed_ns);
+void metrics_error(int code);
+void metrics_takeoff(long elapsed_ns);
+
+void metrics_serve(int listen_fd);
+
+#endif  // _METRICS_H
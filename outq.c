@@ -0,0 +1,370 @@
+// The outq module gives every plane a bounded outbound queue, so that
+// nothing in the server ever waits on a plane's socket. Replies and
+// server-initiated messages (TAKEOFF, POS updates) are often written
+// with a runway's queue_mutex held, and a plane that stops reading would
+// otherwise stall every other plane at the airport behind a full TCP
+// window.
+//
+// A plane's stdio sender is a cookie stream over its queue. Writing
+// tries to send straight away, without blocking; whatever the socket
+// won't take yet stays in the queue, and the flusher thread sends it as
+// the socket drains (watching for EPOLLOUT in an epoll set of its own,
+// so it doesn't touch the epoll sets of the event modes). Output only
+// ever goes to the socket from the queue once the queue has anything in
+// it, so the order is kept.
+//
+// A plane that falls too far behind (see OUTQ_MAX_BYTES and
+// OUTQ_MAX_STALL) is a slow consumer: its output is dropped and its
+// socket shut down, and whoever reads the plane then sees it hang up
+// and closes it the usual way.
+//
+// Closing a plane closes its sender, but a queue with output left keeps
+// the socket open until the flusher has sent it (or given up on it), so
+// a final NOTICE still goes out.
+
+#define _GNU_SOURCE      // For fopencookie
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "outq.h"
+#include "metrics.h"
+#include "timers.h"
+
+// Maximum number of events to pull out of the kernel per epoll_wait call
+
+#define MAX_EVENTS 64
+
+struct outq {
+    pthread_mutex_t lock;
+    int fd;
+    char *buf;               // Output not yet sent is buf[off..len-1]
+    int off;
+    int len;
+    int cap;
+    int backlogged;          // Has output waiting, and is the flusher's
+    int dead;                // Dropped as a slow consumer (or send failed)
+    int closing;             // The stream is closed; free once settled
+    long since;              // When it was last backlogged (timers_now())
+    struct outq *prev;       // Backlog list, oldest first
+    struct outq *next;
+};
+
+// The flusher's epoll set, and the backlogged queues in the order they
+// got backlogged (so the first one is the first to run out of time).
+// Only the flusher takes a queue off the backlog, and it never takes a
+// queue's lock while holding backlog_lock.
+
+static int flush_epoll = -1;
+static pthread_mutex_t backlog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t backlog_cond = PTHREAD_COND_INITIALIZER;
+static outq *backlog_head;
+static outq *backlog_tail;
+static int nbacklog;
+
+/************************************************************************
+ * send_some sends as much of a queue's output as the socket takes
+ * without blocking, and marks the queue dead if the socket fails. Must
+ * hold the queue's lock.
+ */
+static void send_some(outq *q) {
+    while (!q->dead && (q->off < q->len)) {
+        ssize_t n = send(q->fd, q->buf + q->off, q->len - q->off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            q->off += n;
+        } else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+            break;
+        } else {
+            q->dead = 1;
+        }
+    }
+    if (q->dead || (q->off == q->len))
+        q->off = q->len = 0;
+}
+
+/************************************************************************
+ * drop gives up on a slow consumer: its output is thrown away and its
+ * socket shut down, so the plane's reader sees it hang up. Must hold the
+ * queue's lock.
+ */
+static void drop(outq *q) {
+    if (q->dead)
+        return;
+    q->dead = 1;
+    q->off = q->len = 0;
+    shutdown(q->fd, SHUT_RDWR);
+    metrics_count(MET_SLOW_DROPS);
+}
+
+/************************************************************************
+ * backlog hands a queue with output the socket wouldn't take to the
+ * flusher. Must hold the queue's lock.
+ */
+static void backlog(outq *q) {
+    q->backlogged = 1;
+    pthread_mutex_lock(&backlog_lock);
+    q->since = timers_now();
+    q->prev = backlog_tail;
+    q->next = NULL;
+    if (backlog_tail != NULL)
+        backlog_tail->next = q;
+    else
+        backlog_head = q;
+    backlog_tail = q;
+    nbacklog++;
+    pthread_mutex_unlock(&backlog_lock);
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLONESHOT;
+    ev.data.ptr = q;
+    if (epoll_ctl(flush_epoll, EPOLL_CTL_ADD, q->fd, &ev) < 0) {
+        perror("outq epoll_ctl");
+        drop(q);
+    }
+}
+
+/************************************************************************
+ * settle takes a queue that is empty (or dead) off the backlog, and
+ * frees it if its stream has been closed meanwhile. Runs on the flusher,
+ * with the queue's lock held, which it releases.
+ */
+static void settle(outq *q) {
+    epoll_ctl(flush_epoll, EPOLL_CTL_DEL, q->fd, NULL);
+    q->backlogged = 0;
+    pthread_mutex_lock(&backlog_lock);
+    if (q->prev != NULL)
+        q->prev->next = q->next;
+    else
+        backlog_head = q->next;
+    if (q->next != NULL)
+        q->next->prev = q->prev;
+    else
+        backlog_tail = q->prev;
+    if (--nbacklog == 0)
+        pthread_cond_broadcast(&backlog_cond);
+    pthread_mutex_unlock(&backlog_lock);
+
+    int closing = q->closing;
+    pthread_mutex_unlock(&q->lock);
+    if (closing) {
+        close(q->fd);
+        free(q->buf);
+        free(q);
+    }
+}
+
+/************************************************************************
+ * flusher_main is the loop run by the flusher thread: send backlogged
+ * output as sockets drain, and drop the slow consumers whose output has
+ * waited too long.
+ */
+static void *flusher_main(void *arg) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        long wait = -1;
+        pthread_mutex_lock(&backlog_lock);
+        if (backlog_head != NULL) {
+            wait = backlog_head->since + OUTQ_MAX_STALL - timers_now();
+            if (wait < 0)
+                wait = 0;
+        }
+        pthread_mutex_unlock(&backlog_lock);
+
+        int nready = epoll_wait(flush_epoll, events, MAX_EVENTS, (int)wait);
+        if ((nready < 0) && (errno != EINTR)) {
+            perror("outq epoll_wait");
+            exit(1);
+        }
+
+        for (int i=0; i<nready; i++) {
+            outq *q = events[i].data.ptr;
+            pthread_mutex_lock(&q->lock);
+            send_some(q);
+            if (q->dead || (q->len == 0)) {
+                settle(q);
+                continue;
+            }
+            struct epoll_event ev;
+            ev.events = EPOLLOUT | EPOLLONESHOT;
+            ev.data.ptr = q;
+            epoll_ctl(flush_epoll, EPOLL_CTL_MOD, q->fd, &ev);
+            pthread_mutex_unlock(&q->lock);
+        }
+
+        // Only the flusher takes queues off the backlog, so the head
+        // stays valid once backlog_lock is released
+        while (1) {
+            pthread_mutex_lock(&backlog_lock);
+            outq *q = backlog_head;
+            int expired = (q != NULL) &&
+                (q->since + OUTQ_MAX_STALL <= timers_now());
+            pthread_mutex_unlock(&backlog_lock);
+            if (!expired)
+                break;
+
+            pthread_mutex_lock(&q->lock);
+            drop(q);
+            settle(q);
+        }
+    }
+
+    return NULL;
+}
+
+/************************************************************************
+ * outq_write is the write function of a plane's cookie stream, and can
+ * be called from any thread. It never blocks; output the socket won't
+ * take is queued, or dropped along with the plane if there's too much.
+ */
+static ssize_t outq_write(void *cookie, const char *buf, size_t size) {
+    outq *q = (outq *)cookie;
+    pthread_mutex_lock(&q->lock);
+    if (q->dead) {
+        pthread_mutex_unlock(&q->lock);
+        return size;
+    }
+
+    if (q->len - q->off + (int)size > OUTQ_MAX_BYTES) {
+        drop(q);
+        pthread_mutex_unlock(&q->lock);
+        return size;
+    }
+
+    if (q->len + (int)size > q->cap) {
+        // Make room at the front first, before growing
+        if (q->off > 0) {
+            memmove(q->buf, q->buf + q->off, q->len - q->off);
+            q->len -= q->off;
+            q->off = 0;
+        }
+        int newcap = (q->cap > 0) ? q->cap : 256;
+        while (newcap < q->len + (int)size)
+            newcap *= 2;
+        if (newcap > q->cap) {
+            char *grown = realloc(q->buf, newcap);
+            if (grown == NULL) {
+                perror("outq_write");
+                exit(1);
+            }
+            q->buf = grown;
+            q->cap = newcap;
+        }
+    }
+    memcpy(q->buf + q->len, buf, size);
+    q->len += size;
+
+    // With a backlog the flusher sends it all, in order
+    if (!q->backlogged) {
+        send_some(q);
+        if (q->len > 0)
+            backlog(q);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return size;
+}
+
+/************************************************************************
+ * outq_close is the close function of a plane's cookie stream, called
+ * when the plane is destroyed (after the stream's last bytes have gone
+ * to outq_write). A backlogged queue is left for the flusher to finish.
+ */
+static int outq_close(void *cookie) {
+    outq *q = (outq *)cookie;
+    pthread_mutex_lock(&q->lock);
+    q->closing = 1;
+    int backlogged = q->backlogged;
+    pthread_mutex_unlock(&q->lock);
+    if (!backlogged) {
+        close(q->fd);
+        free(q->buf);
+        free(q);
+    }
+    return 0;
+}
+
+/************************************************************************
+ * outq_init starts the flusher thread. The timers module must already be
+ * initialized.
+ */
+void outq_init(void) {
+    if ((flush_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("outq_init epoll_create1");
+        exit(1);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, flusher_main, NULL) != 0) {
+        perror("outq_init pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/************************************************************************
+ * outq_open makes a new outbound queue for socket "fd", setting "*qp" to
+ * it, and returns the stdio stream that writes to it. Closing the stream
+ * closes "fd". Returns NULL if the stream can't be made.
+ */
+FILE *outq_open(int fd, outq **qp) {
+    outq *q = calloc(1, sizeof(outq));
+    if (q == NULL) {
+        perror("outq_open");
+        exit(1);
+    }
+    q->fd = fd;
+    pthread_mutex_init(&q->lock, NULL);
+
+    cookie_io_functions_t io = { NULL, outq_write, NULL, outq_close };
+    FILE *sender = fopencookie(q, "w", io);
+    if (sender == NULL) {
+        free(q);
+        return NULL;
+    }
+    *qp = q;
+    return sender;
+}
+
+/************************************************************************
+ * outq_pending returns the number of bytes waiting in a queue, or -1 if
+ * it was dropped (and the plane is on its way out).
+ */
+int outq_pending(outq *q) {
+    pthread_mutex_lock(&q->lock);
+    int pending = q->dead ? -1 : q->len - q->off;
+    pthread_mutex_unlock(&q->lock);
+    return pending;
+}
+
+/************************************************************************
+ * outq_wait_idle waits up to "ms" for every backlogged queue to drain.
+ * Returns 0 once they have, or -1 if some are still backlogged.
+ */
+int outq_wait_idle(int ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&backlog_lock);
+    while ((nbacklog > 0) &&
+           (pthread_cond_timedwait(&backlog_cond, &backlog_lock, &until) == 0))
+        ;
+    int idle = (nbacklog == 0);
+    pthread_mutex_unlock(&backlog_lock);
+    return idle ? 0 : -1;
+}
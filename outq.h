@@ -0,0 +1,22 @@
+// Types and function prototypes for the per-plane outbound queues
+
+#ifndef _OUTQ_H
+#define _OUTQ_H
+
+#include <stdio.h>
+
+// Slow consumer policy: a plane is disconnected once it has more than
+// OUTQ_MAX_BYTES of output waiting for it, or has had output waiting for
+// longer than OUTQ_MAX_STALL ms
+
+#define OUTQ_MAX_BYTES (64 * 1024)
+#define OUTQ_MAX_STALL 10000
+
+typedef struct outq outq;
+
+void outq_init(void);
+FILE *outq_open(int fd, outq **qp);
+int outq_pending(outq *q);
+int outq_wait_idle(int ms);
+
+#endif  // _OUTQ_H
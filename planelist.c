@@ -3,29 +3,63 @@
 // by this module, and it is locked any time the list is accessed or
 // changes in some way.
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 
 #include "alist.h"
 #include "planelist.h"
+#include "planepool.h"
+#include "flightid.h"
+#include "journal.h"
 
-// The array list of all planes
+// The array list of all planes. It is only ever touched with listlock
+// held, so it is set up without a lock of its own.
 
 static alist all_planes;
 
+// The registry of registered planes, indexed by flight id handle (see
+// flightid.h). Only planes that have been given an id by
+// planelist_changeid are ever in it. Handles are per airport, so this
+// is every airport's registry at once.
+
+#define REGISTRY_DEF_SIZE 1024
+
+static airplane **registry;
+static unsigned int registry_size;
+
 // A global lock, to ensure that the list doesn't change when being accessed
 
 static pthread_rwlock_t listlock;
 
 /***************************************************************************
- * Callback function for use by the alist routines to destroy and free an
- * airplane struct.
+ * Callback function for use by the alist routines to destroy an airplane
+ * struct and return it to the plane pool.
  */
 void airplane_free(void *p) {
     airplane *ap = (airplane *)p;
     airplane_destroy(ap);
-    free(ap);
+    planepool_put(ap);
+}
+
+/***************************************************************************
+ * registry_grow makes the registry big enough for handle "fid". Must be
+ * called with listlock held for writing.
+ */
+static void registry_grow(flightid fid) {
+    unsigned int newsize = registry_size;
+    while (newsize <= fid)
+        newsize *= 2;
+    airplane **grown = realloc(registry, newsize * sizeof(airplane *));
+    if (grown == NULL) {
+        perror("planelist registry_grow");
+        exit(1);
+    }
+    memset(grown + registry_size, 0,
+           (newsize - registry_size) * sizeof(airplane *));
+    registry = grown;
+    registry_size = newsize;
 }
 
 /***************************************************************************
@@ -33,8 +67,14 @@ void airplane_free(void *p) {
  * of main, when the program starts up.
  */
 void planelist_init(void) {
-    alist_init(&all_planes, airplane_free);
+    alist_init_unlocked(&all_planes, airplane_free);
     pthread_rwlock_init(&listlock, NULL);
+
+    registry_size = REGISTRY_DEF_SIZE;
+    if ((registry=calloc(registry_size, sizeof(airplane *))) == NULL) {
+        perror("planelist_init");
+        exit(1);
+    }
 }
 
 /***************************************************************************
@@ -50,32 +90,75 @@ void planelist_add(airplane *newplane) {
  * planelist_changeid doesn't change the structure of the list at all,
  * but is provided so that the plane's id can be updated atomically. If
  * the id were mid-change when the list was scanned (e.g., by planelist_find)
- * there would be problems.
+ * there would be problems. This is also where a plane enters the
+ * registry, and the duplicate check is done under the same lock so two
+ * planes can't register the same id at once. On success the plane takes
+ * over the caller's reference to "newid" and 0 is returned; otherwise
+ * (another plane already has "newid") the plane is left unchanged and -1
+ * is returned.
  */
-void planelist_changeid(airplane *plane, char *newid) {
+int planelist_changeid(airplane *plane, flightid newid) {
     pthread_rwlock_wrlock(&listlock);
-    strcpy(plane->id, newid);
+    if (newid >= registry_size)
+        registry_grow(newid);
+    if (registry[newid] != NULL) {
+        pthread_rwlock_unlock(&listlock);
+        return -1;
+    }
+
+    flightid oldid = plane->fid;
+    registry[oldid] = NULL;
+    plane->fid = newid;
+    registry[newid] = plane;
+    journal_record(JOURNAL_REG, plane->airport, 0, 0, flightid_name(newid));
     pthread_rwlock_unlock(&listlock);
+    flightid_release(oldid);
+    return 0;
 }
 
 /***************************************************************************
- * planelist_find searches the list of planes for a registered airplane with
- * the given flightid. Returns either that airplane struct or NULL if no
+ * planelist_find looks up the registered airplane with flight id "fid"
+ * in the registry. Returns either that airplane struct or NULL if no
  * such airplane is in the list.
  */
-airplane *planelist_find(char *flightid) {
+airplane *planelist_find(flightid fid) {
     pthread_rwlock_rdlock(&listlock);
-    for (int i=0; i<alist_size(&all_planes); i++) {
-        airplane *thisplane = alist_get(&all_planes, i);
-        if ((thisplane->state != PLANE_UNREG) &&
-            (strcmp(thisplane->id, flightid) == 0) ) {
-            pthread_rwlock_unlock(&listlock);
-            return thisplane;
-        }
+    airplane *found = (fid < registry_size) ? registry[fid] : NULL;
+    pthread_rwlock_unlock(&listlock);
+    return found;
+}
+
+/***************************************************************************
+ * alist_foreach visitor that stops at the plane passed in as "arg".
+ */
+static int is_plane(void *item, void *arg) {
+    return item == arg;
+}
+
+/***************************************************************************
+ * registry_drop takes a plane out of the registry, if it registered.
+ * Must be called with listlock held for writing.
+ */
+static void registry_drop(airplane *plane) {
+    if (plane->fid != FLIGHTID_NONE) {
+        journal_record(JOURNAL_DISC, plane->airport, 0, 0,
+                       flightid_name(plane->fid));
+        registry[plane->fid] = NULL;
     }
+}
 
+/***************************************************************************
+ * planelist_unregister takes a plane out of the registry, but not out of
+ * the list of planes (which it needn't be in). It is for servers that
+ * keep their own lists of planes (see shard.c), and then destroy the
+ * plane themselves with airplane_free.
+ */
+void planelist_unregister(airplane *plane) {
+    if (plane->fid == FLIGHTID_NONE)
+        return;
+    pthread_rwlock_wrlock(&listlock);
+    registry_drop(plane);
     pthread_rwlock_unlock(&listlock);
-    return NULL;
 }
 
 /***************************************************************************
@@ -85,14 +168,27 @@ airplane *planelist_find(char *flightid) {
  */
 void planelist_remove(airplane *ditch) {
     pthread_rwlock_wrlock(&listlock);
-    for (int i=0; i<alist_size(&all_planes); i++) {
-        if (alist_get(&all_planes, i) == ditch) {
-            alist_remove(&all_planes, i);
-            pthread_rwlock_unlock(&listlock);
-            return;
-        }
+    int i = alist_foreach(&all_planes, is_plane, ditch);
+    if (i >= 0) {
+        registry_drop(ditch);
+        alist_remove(&all_planes, i);
+        pthread_rwlock_unlock(&listlock);
+        return;
     }
 
     printf("Couldn't find plane to remove - this shouldn't happen\n");
     pthread_rwlock_unlock(&listlock);
-}
\ No newline at end of file
+}
+
+/***************************************************************************
+ * planelist_foreach calls "visit" for every plane in the system until it
+ * returns nonzero. Returns the index of
+ * the plane it stopped at, or -1. The list is locked (for reading) during
+ * the whole walk, so "visit" must not add or remove planes.
+ */
+int planelist_foreach(alist_visit visit, void *arg) {
+    pthread_rwlock_rdlock(&listlock);
+    int stopped = alist_foreach(&all_planes, visit, arg);
+    pthread_rwlock_unlock(&listlock);
+    return stopped;
+}
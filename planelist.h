@@ -4,11 +4,15 @@
 #define _PLANELIST_H
 
 #include "airplane.h"
+#include "alist.h"
 
 void planelist_init(void);
 void planelist_add(airplane *newplane);
-void planelist_changeid(airplane *plane, char *newid);
-airplane *planelist_find(char *flightid);
+int planelist_changeid(airplane *plane, flightid newid);
+airplane *planelist_find(flightid fid);
 void planelist_remove(airplane *myplane);
+void planelist_unregister(airplane *plane);
+void airplane_free(void *p);
+int planelist_foreach(alist_visit visit, void *arg);
 
 #endif  // _PLANELIST_H
\ No newline at end of file
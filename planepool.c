@@ -0,0 +1,161 @@
+// The planepool module hands out airplane structs from a pool instead of
+// malloc'ing and freeing one per connection. Planes are allocated by the
+// accepting thread but freed by whichever thread ran the connection, and
+// doing that through malloc fragments the allocator's arenas on a server
+// that runs for months.
+//
+// Each thread keeps a small cache of free planes, so most gets and puts
+// touch no shared state at all. When a cache runs dry it takes a batch
+// from the global freelist, and when it gets too full it gives a batch
+// back. Only when the global freelist is empty are new planes allocated,
+// a chunk at a time, and they are never handed back to malloc; so once
+// the pool has grown to the peak number of planes (or was preallocated
+// that big with planepool_init) the server makes no allocator calls for
+// planes at all.
+//
+// Free planes are chained through their "pnext" field, which is unused
+// while a plane isn't in the planelist.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "planepool.h"
+
+// Planes moved between a thread cache and the global freelist at a time
+
+#define POOL_BATCH 32
+
+// Planes allocated at once when the pool has to grow
+
+#define POOL_CHUNK 256
+
+typedef struct {
+    airplane *head;
+    int count;
+} plane_cache;
+
+static __thread plane_cache cache;
+static pthread_key_t cache_key;   // Only used for its destructor
+
+static airplane *free_head;
+static int free_count;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/************************************************************************
+ * pool_grow allocates "count" new planes onto the global freelist. Must
+ * be called with pool_lock held.
+ */
+static void pool_grow(int count) {
+    airplane *chunk = malloc(count * sizeof(airplane));
+    if (chunk == NULL) {
+        perror("planepool - growing pool");
+        exit(1);
+    }
+
+    for (int i=0; i<count; i++) {
+        chunk[i].pnext = free_head;
+        free_head = &chunk[i];
+    }
+    free_count += count;
+}
+
+/************************************************************************
+ * cache_release gives every plane in a thread's cache back to the global
+ * freelist. Runs automatically when a thread that used the pool exits,
+ * so planes cached by short-lived client threads aren't lost.
+ */
+static void cache_release(void *arg) {
+    plane_cache *c = (plane_cache *)arg;
+    if (c->head == NULL)
+        return;
+
+    airplane *tail = c->head;
+    while (tail->pnext != NULL)
+        tail = tail->pnext;
+
+    pthread_mutex_lock(&pool_lock);
+    tail->pnext = free_head;
+    free_head = c->head;
+    free_count += c->count;
+    pthread_mutex_unlock(&pool_lock);
+
+    c->head = NULL;
+    c->count = 0;
+}
+
+/************************************************************************
+ * cache_attach makes sure this thread's cache will be released when the
+ * thread exits.
+ */
+static void cache_attach(void) {
+    if (pthread_getspecific(cache_key) == NULL)
+        pthread_setspecific(cache_key, &cache);
+}
+
+/************************************************************************
+ * planepool_init sets up the pool with room for "prealloc" planes (0
+ * to let it grow on demand). Should be called once at startup.
+ */
+void planepool_init(int prealloc) {
+    pthread_key_create(&cache_key, cache_release);
+    if (prealloc > 0) {
+        pthread_mutex_lock(&pool_lock);
+        pool_grow(prealloc);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+/************************************************************************
+ * planepool_get returns an (uninitialized) airplane struct.
+ */
+airplane *planepool_get(void) {
+    if (cache.head == NULL) {
+        cache_attach();
+        pthread_mutex_lock(&pool_lock);
+        if (free_head == NULL)
+            pool_grow(POOL_CHUNK);
+        while ((free_head != NULL) && (cache.count < POOL_BATCH)) {
+            airplane *p = free_head;
+            free_head = p->pnext;
+            free_count--;
+            p->pnext = cache.head;
+            cache.head = p;
+            cache.count++;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    airplane *plane = cache.head;
+    cache.head = plane->pnext;
+    cache.count--;
+    return plane;
+}
+
+/************************************************************************
+ * planepool_put returns an airplane struct to the pool. The plane must
+ * already have been destroyed (see airplane_destroy).
+ */
+void planepool_put(airplane *plane) {
+    cache_attach();
+    plane->pnext = cache.head;
+    cache.head = plane;
+    cache.count++;
+
+    if (cache.count < 2*POOL_BATCH)
+        return;
+
+    // Too many cached here, so hand a batch back for other threads
+    airplane *batch = cache.head;
+    airplane *last = batch;
+    for (int i=1; i<POOL_BATCH; i++)
+        last = last->pnext;
+    cache.head = last->pnext;
+    cache.count -= POOL_BATCH;
+
+    pthread_mutex_lock(&pool_lock);
+    last->pnext = free_head;
+    free_head = batch;
+    free_count += POOL_BATCH;
+    pthread_mutex_unlock(&pool_lock);
+}
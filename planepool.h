@@ -0,0 +1,12 @@
+// Function prototypes for the airplane struct pool
+
+#ifndef _PLANEPOOL_H
+#define _PLANEPOOL_H
+
+#include "airplane.h"
+
+void planepool_init(int prealloc);
+airplane *planepool_get(void);
+void planepool_put(airplane *plane);
+
+#endif  // _PLANEPOOL_H
@@ -0,0 +1,549 @@
+// The replica module keeps a hot standby: a second server (started with
+// -S) that follows a primary (started with -R) over TCP, keeps its own
+// copy of the taxi queues, and takes over when the primary goes away.
+//
+// What goes over the link is the journal (see journal.c). A standby that
+// connects is sent the journal writer's copy of the queues as a snapshot,
+// and then every batch of records as soon as the writer has written it,
+// so it is never ahead of the primary's own journal. The link is
+// pipelined: the primary never waits for the standby, which answers with
+// "ACK <seq>" once for each read's worth of lines it takes in, so the
+// primary knows how far behind it is. The primary sends, a line each:
+//
+//   GNDSNAP <seq>   a snapshot of the queues up to record "seq", as
+//   <seq> TAXI ...    journal records, one per queued flight
+//   SYNCED <seq>    the end of the snapshot
+//   <seq> <op> ...  every journal record from then on
+//   PING <seq>      when it has sent nothing else for a while
+//   MOVED           it has handed over to a new process (see handoff.c),
+//                   which the standby should reconnect to
+//
+// There is one standby at a time: any other that connects is sent BUSY
+// and hung up on, and a standby that stops acknowledging for
+// REPLICA_TIMEOUT_MS is dropped (as is one that falls too far behind).
+//
+// When the link drops, or goes quiet for REPLICA_TIMEOUT_MS, a standby
+// with a whole copy of the queues connects again at once, to make sure
+// the primary is really gone (it may only have dropped the standby). If
+// that fails, or the primary doesn't answer quickly either, the standby
+// takes over: its queued flights go back into its taxi queues as
+// placeholders (just as after a restart from the journal), it opens the
+// plane listener, and the planes reconnect to it and claim their places.
+// It can't tell a dead primary from a broken link, so an old primary
+// must only ever come back as the new one's standby.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "journal.h"
+#include "replica.h"
+#include "timers.h"
+
+// Longest control line either side sends
+
+#define LINE_MAX_LEN 64
+
+// A standby's receive buffer, and how often it tries to reach a primary
+// it isn't connected to (ms)
+
+#define FOLLOW_BUF_SIZE 65536
+#define RETRY_MS 100
+
+// How a standby's link to its primary ended
+
+#define LINK_LOST 0
+#define LINK_MOVED 1
+#define LINK_BUSY 2
+
+// The primary's side. The standby's socket and what is queued for it are
+// shared between the journal writer, which queues records, and the
+// replica thread, which sends them and reads the acks, under
+// replica_lock. Only the replica thread opens or closes the socket.
+
+static int listen_sock = -1;
+static int standby = -1;         // The standby's socket, or -1
+static int standby_ready;        // Has been queued its snapshot
+static int standby_lost;         // To be dropped by the replica thread
+static char *out;                // Queued for the standby, from out_sent on
+static int out_len;
+static int out_sent;
+static int out_cap;
+static long sent_seq;            // Last record queued for the standby
+static long acked_seq;           // Last record it has acknowledged
+static long last_queued;         // When anything was last queued (ms)
+static long last_heard;          // When it last acknowledged anything (ms)
+static int wake_fd;              // Wakes the replica thread to send
+
+static pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/************************************************************************
+ * queue_out queues "len" bytes of "data" for the standby, or marks it
+ * lost if it has fallen too far behind. Must hold replica_lock.
+ */
+static void queue_out(const char *data, int len) {
+    if (standby_lost)
+        return;
+    if (out_len - out_sent + len > REPLICA_MAX_BACKLOG) {
+        fprintf(stderr, "Standby has fallen too far behind\n");
+        standby_lost = 1;
+        return;
+    }
+
+    if (out_len + len > out_cap) {
+        memmove(out, out + out_sent, out_len - out_sent);
+        out_len -= out_sent;
+        out_sent = 0;
+        int newcap = (out_cap > 0) ? out_cap : 65536;
+        while (out_len + len > newcap)
+            newcap *= 2;
+        if (newcap != out_cap) {
+            char *grown = realloc(out, newcap);
+            if (grown == NULL) {
+                perror("replica queue_out");
+                exit(1);
+            }
+            out = grown;
+            out_cap = newcap;
+        }
+    }
+    memcpy(out + out_len, data, len);
+    out_len += len;
+    last_queued = timers_now();
+}
+
+/************************************************************************
+ * send_out sends the standby as much of what is queued for it as its
+ * socket takes without blocking, and wakes the replica thread to send
+ * the rest (or drop it). Must hold replica_lock.
+ */
+static void send_out(void) {
+    while (!standby_lost && (out_sent < out_len)) {
+        ssize_t n = send(standby, out + out_sent, out_len - out_sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+                standby_lost = 1;
+            break;
+        }
+        out_sent += n;
+    }
+    if (out_sent == out_len)
+        out_sent = out_len = 0;
+    else
+        eventfd_write(wake_fd, 1);
+}
+
+/************************************************************************
+ * drop_standby closes the link to the standby. Must hold replica_lock.
+ */
+static void drop_standby(void) {
+    close(standby);
+    standby = -1;
+    standby_ready = 0;
+    standby_lost = 0;
+    out_len = out_sent = 0;
+    printf("Standby disconnected.\n");
+}
+
+/************************************************************************
+ * accept_standby takes a new standby from the listener, and has the
+ * journal writer send it the queues, unless there is one already.
+ */
+static void accept_standby(void) {
+    int fd = accept(listen_sock, NULL, NULL);
+    if (fd < 0)
+        return;
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    pthread_mutex_lock(&replica_lock);
+    if (standby >= 0) {
+        pthread_mutex_unlock(&replica_lock);
+        send(fd, "BUSY\n", 5, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(fd);
+        return;
+    }
+    standby = fd;
+    sent_seq = acked_seq = 0;
+    last_queued = last_heard = timers_now();
+    pthread_mutex_unlock(&replica_lock);
+
+    printf("Standby connected.\n");
+    journal_want_snapshot();
+}
+
+/************************************************************************
+ * read_acks reads what the standby has sent (into "buf", with "*len"
+ * bytes of a line already there) and notes the last seq it has acked.
+ */
+static void read_acks(char *buf, int *len) {
+    ssize_t got = recv(standby, buf + *len, LINE_MAX_LEN - *len, 0);
+    if ((got < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                      (errno == EINTR)))
+        return;
+
+    pthread_mutex_lock(&replica_lock);
+    if (got <= 0) {
+        standby_lost = 1;
+    } else {
+        last_heard = timers_now();
+        *len += got;
+        char *line = buf;
+        char *nl;
+        while ((nl = memchr(line, '\n', buf + *len - line)) != NULL) {
+            *nl = '\0';
+            long seq;
+            if ((sscanf(line, "ACK %ld", &seq) == 1) && (seq > acked_seq))
+                acked_seq = seq;
+            line = nl + 1;
+        }
+        *len -= line - buf;
+        memmove(buf, line, *len);
+        if (*len == LINE_MAX_LEN)
+            standby_lost = 1;   // Not a standby talking
+    }
+    pthread_mutex_unlock(&replica_lock);
+}
+
+/************************************************************************
+ * replica_main is the loop run by the replica thread: take standbys
+ * from the listener, send them whatever didn't fit in their socket,
+ * read their acks, and send heartbeats.
+ */
+static void *replica_main(void *arg) {
+    char acks[LINE_MAX_LEN];
+    int acks_len = 0;
+
+    while (1) {
+        struct pollfd fds[3] = {
+            { .fd = listen_sock, .events = POLLIN },
+            { .fd = wake_fd, .events = POLLIN },
+            { .fd = -1 },
+        };
+        pthread_mutex_lock(&replica_lock);
+        if (standby >= 0) {
+            fds[2].fd = standby;
+            fds[2].events = POLLIN | ((out_sent < out_len) ? POLLOUT : 0);
+        }
+        pthread_mutex_unlock(&replica_lock);
+
+        if (poll(fds, 3, REPLICA_HEARTBEAT_MS) < 0) {
+            if (errno != EINTR)
+                perror("replica poll");
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            eventfd_t wakes;
+            eventfd_read(wake_fd, &wakes);
+        }
+        if (fds[2].revents & (POLLIN | POLLERR | POLLHUP))
+            read_acks(acks, &acks_len);
+
+        pthread_mutex_lock(&replica_lock);
+        if (standby >= 0) {
+            long now = timers_now();
+            if (now - last_heard >= REPLICA_TIMEOUT_MS) {
+                fprintf(stderr, "Standby has gone quiet\n");
+                standby_lost = 1;
+            }
+            if (now - last_queued >= REPLICA_HEARTBEAT_MS) {
+                char ping[LINE_MAX_LEN];
+                queue_out(ping, snprintf(ping, sizeof(ping), "PING %ld\n",
+                                         sent_seq));
+            }
+            send_out();
+            if (standby_lost)
+                drop_standby();
+        }
+        pthread_mutex_unlock(&replica_lock);
+
+        if (fds[0].revents & POLLIN) {
+            accept_standby();
+            acks_len = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/************************************************************************
+ * replica_serve starts a thread taking a standby from "listen_fd" and
+ * keeping it up to date. The journal must already be open.
+ */
+void replica_serve(int listen_fd) {
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("replica_serve - eventfd");
+        exit(1);
+    }
+    listen_sock = listen_fd;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, replica_main, NULL) != 0) {
+        perror("replica_serve - pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
+
+/************************************************************************
+ * Returns 1 if this server takes a standby, or 0.
+ */
+int replica_serving(void) {
+    return listen_sock >= 0;
+}
+
+/************************************************************************
+ * replica_lag returns how many records the standby has been sent but
+ * not yet acknowledged, or -1 if there is no standby up to date.
+ */
+long replica_lag(void) {
+    pthread_mutex_lock(&replica_lock);
+    long lag = standby_ready ? sent_seq - acked_seq : -1;
+    pthread_mutex_unlock(&replica_lock);
+    return lag;
+}
+
+/************************************************************************
+ * replica_send sends the standby (if there is one, and it has been sent
+ * the queues) "len" bytes of journal records, the last of them "seq".
+ * Called by the journal writer once it has written them.
+ */
+void replica_send(const char *records, int len, long seq) {
+    if (listen_sock < 0)
+        return;
+
+    pthread_mutex_lock(&replica_lock);
+    if (standby_ready) {
+        queue_out(records, len);
+        sent_seq = seq;
+        send_out();
+    }
+    pthread_mutex_unlock(&replica_lock);
+}
+
+/************************************************************************
+ * replica_start sends a standby that has just connected "len" bytes of
+ * "snapshot" (a journal snapshot, of the queues up to record "seq"),
+ * after which it is sent every batch of records. Called by the journal
+ * writer (see journal_want_snapshot).
+ */
+void replica_start(const char *snapshot, int len, long seq) {
+    pthread_mutex_lock(&replica_lock);
+    if ((standby >= 0) && !standby_ready) {
+        char synced[LINE_MAX_LEN];
+        queue_out(snapshot, len);
+        queue_out(synced, snprintf(synced, sizeof(synced), "SYNCED %ld\n",
+                                   seq));
+        standby_ready = 1;
+        sent_seq = seq;
+        send_out();
+    }
+    pthread_mutex_unlock(&replica_lock);
+}
+
+/************************************************************************
+ * replica_moved tells the standby that this server has handed over to a
+ * new process, so it reconnects there rather than taking over. Called
+ * (with everything else frozen) just before the old process exits, and
+ * keeps the replica thread off the link until it has.
+ */
+void replica_moved(void) {
+    if (listen_sock < 0)
+        return;
+
+    // The new process is listening on the same port, and the standby
+    // has to reach that one
+    close(listen_sock);
+
+    pthread_mutex_lock(&replica_lock);
+    if ((standby < 0) || standby_lost)
+        return;
+    queue_out("MOVED\n", 6);
+    int flags = fcntl(standby, F_GETFL);
+    fcntl(standby, F_SETFL, flags & ~O_NONBLOCK);
+    struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(standby, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    while (out_sent < out_len) {
+        ssize_t n = send(standby, out + out_sent, out_len - out_sent,
+                         MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        out_sent += n;
+    }
+}
+
+/************************************************************************
+ * connect_to connects to the primary at "host", "port", giving up after
+ * REPLICA_TIMEOUT_MS. Returns the socket, or -1 if it can't be reached.
+ */
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *result;
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ((fd >= 0) && (connect(fd, result->ai_addr, result->ai_addrlen) < 0)) {
+        // A primary whose machine has gone takes the full SYN timeout to
+        // refuse, so only wait as long as for a quiet link
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if ((errno != EINPROGRESS) ||
+            (poll(&pfd, 1, REPLICA_TIMEOUT_MS) != 1) ||
+            (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) ||
+            (err != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(result);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/************************************************************************
+ * follow takes in what the primary sends on "fd", acknowledging as it
+ * goes, until the link drops or goes quiet. "*synced" is set while the
+ * standby has a whole copy of the queues (and cleared while a new one is
+ * on its way), and "*resynced" once this link has brought a new one. If
+ * "checking" is set, the primary is only given two heartbeats to say
+ * anything at all. Returns LINK_LOST, LINK_MOVED if the primary handed
+ * over to a new process, or LINK_BUSY if it has another standby.
+ */
+static int follow(int fd, int *synced, int *resynced, int checking) {
+    static char buf[FOLLOW_BUF_SIZE];
+    int len = 0;
+    long seq = 0;       // Last seq taken in
+    int timeout = checking ? 2 * REPLICA_HEARTBEAT_MS : REPLICA_TIMEOUT_MS;
+
+    while (1) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout);
+        if ((ready < 0) && (errno == EINTR))
+            continue;
+        if (ready == 0)
+            fprintf(stderr, "Primary has gone quiet\n");
+        if (ready <= 0)
+            return LINK_LOST;
+
+        ssize_t got = recv(fd, buf + len, sizeof(buf) - len, 0);
+        if ((got < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+            continue;
+        if (got <= 0)
+            return LINK_LOST;
+        timeout = REPLICA_TIMEOUT_MS;
+
+        len += got;
+        char *line = buf;
+        char *nl;
+        while ((nl = memchr(line, '\n', buf + len - line)) != NULL) {
+            *nl = '\0';
+            long s;
+            if (strcmp(line, "MOVED") == 0)
+                return LINK_MOVED;
+            if (strcmp(line, "BUSY") == 0)
+                return LINK_BUSY;
+            if (sscanf(line, "SYNCED %ld", &s) == 1) {
+                *synced = 1;
+                *resynced = 1;
+            } else if (strncmp(line, "PING ", 5) != 0) {
+                if (strncmp(line, "GNDSNAP ", 8) == 0)
+                    *synced = 0;
+                if ((s = journal_follow(line)) >= 0)
+                    seq = s;
+            }
+            line = nl + 1;
+        }
+        len -= line - buf;
+        memmove(buf, line, len);
+        if (len == sizeof(buf))
+            return LINK_LOST;   // Not a primary talking
+
+        // One ack covers everything this read took in. If it can't be
+        // sent the link is down, which the next read finds out.
+        char ack[LINE_MAX_LEN];
+        send(fd, ack, snprintf(ack, sizeof(ack), "ACK %ld\n", seq),
+             MSG_NOSIGNAL);
+    }
+}
+
+/************************************************************************
+ * replica_follow stands by for the primary at "primary" (host:port),
+ * keeping a copy of its queues (see journal_follow), and returns when
+ * it is gone and this server is to take over. Waits as long as it takes
+ * for a primary to follow in the first place. The taxi queues, airports
+ * and timers must already be initialized.
+ */
+void replica_follow(const char *primary) {
+    char host[256];
+    const char *colon = strrchr(primary, ':');
+    if ((colon == NULL) || (colon == primary) ||
+        (colon - primary >= (long)sizeof(host))) {
+        fprintf(stderr, "Bad primary address %s (expected host:port)\n",
+                primary);
+        exit(1);
+    }
+    memcpy(host, primary, colon - primary);
+    host[colon - primary] = '\0';
+    const char *port = colon + 1;
+
+    printf("Standing by for the primary at %s\n", primary);
+    fflush(stdout);
+    int synced = 0;
+    int checking = 0;   // Lost the primary, and making sure it is gone
+    long give_up = 0;   // After a handover, when to stop waiting for it
+    while (1) {
+        int fd = connect_to(host, port);
+        if (fd < 0) {
+            if (synced && (timers_now() >= give_up))
+                break;
+            usleep(RETRY_MS * 1000);
+            continue;
+        }
+
+        int resynced = 0;
+        int how = follow(fd, &synced, &resynced, checking);
+        close(fd);
+        if (how == LINK_BUSY) {
+            // Whatever copy there was is out of date now
+            if (synced || checking)
+                printf("Primary has another standby; waiting.\n");
+            synced = checking = 0;
+            usleep(REPLICA_TIMEOUT_MS * 1000);
+        } else if (how == LINK_MOVED) {
+            printf("Primary handed over; reconnecting.\n");
+            checking = 0;
+            give_up = timers_now() + REPLICA_MOVE_TIMEOUT;
+        } else if (checking && !resynced && synced) {
+            break;
+        } else {
+            checking = synced;
+            give_up = 0;
+        }
+    }
+
+    printf("Primary lost; taking over.\n");
+    fflush(stdout);
+}
@@ -0,0 +1,31 @@
+// Function prototypes and constants for hot-standby replication
+
+#ifndef _REPLICA_H
+#define _REPLICA_H
+
+// The primary sends a heartbeat when it has sent nothing else for
+// REPLICA_HEARTBEAT_MS, and a standby that hears nothing for
+// REPLICA_TIMEOUT_MS takes it as gone (ms)
+
+#define REPLICA_HEARTBEAT_MS 150
+#define REPLICA_TIMEOUT_MS 600
+
+// Most output a standby can leave unread before the primary drops it
+// (bytes); it then connects again and starts over from a new snapshot
+
+#define REPLICA_MAX_BACKLOG (64 * 1024 * 1024)
+
+// How long a standby keeps trying to reach a primary that has handed
+// over to a new process (see handoff.c) before it takes over itself (ms)
+
+#define REPLICA_MOVE_TIMEOUT 5000
+
+void replica_serve(int listen_fd);
+int replica_serving(void);
+long replica_lag(void);
+void replica_send(const char *records, int len, long seq);
+void replica_start(const char *snapshot, int len, long seq);
+void replica_moved(void);
+void replica_follow(const char *primary);
+
+#endif  // _REPLICA_H
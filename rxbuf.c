@@ -0,0 +1,189 @@
+// The rxbuf module is the receive side of a plane's connection. Bytes are
+// recv()'d from the socket straight into a fixed buffer, lines are found
+// in place, and each line is handed out as a pointer into the buffer (with
+// the newline overwritten by a NUL) so the command parser can work on it
+// without it ever being copied. Consumed lines are simply skipped over.
+// The buffer wraps around by moving only the bytes of an incomplete line
+// back to the front, and only once the free space at the end runs out,
+// which for a line-at-a-time protocol is rarely more than a few bytes.
+//
+// The same buffer also serves planes using the binary protocol, where
+// rxbuf_frame hands out length-prefixed frames in place instead of lines.
+
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "rxbuf.h"
+
+/************************************************************************
+ * rxbuf_init sets up an empty receive buffer.
+ */
+void rxbuf_init(rxbuf *rb) {
+    rb->start = rb->scan = rb->end = 0;
+    rb->discard = 0;
+    rb->skip = 0;
+}
+
+/************************************************************************
+ * rxbuf_makeroom wraps the unfinished line around to the front of the
+ * buffer if there is no room left at the end (rxbuf_next makes sure
+ * there is always something to free up, by dropping over-long lines).
+ */
+static void rxbuf_makeroom(rxbuf *rb) {
+    if (rb->end == RXBUF_SIZE) {
+        int pending = rb->end - rb->start;
+        memmove(rb->data, rb->data + rb->start, pending);
+        rb->scan -= rb->start;
+        rb->start = 0;
+        rb->end = pending;
+    }
+}
+
+/************************************************************************
+ * rxbuf_fill receives whatever is available (or, for a blocking socket
+ * without MSG_DONTWAIT in "flags", waits for something) from "fd" into
+ * the free space of the buffer. Returns the number of bytes received, 0
+ * if the peer closed the connection, or -1 with errno set on an error
+ * (including EAGAIN for a non-blocking receive with nothing waiting).
+ */
+ssize_t rxbuf_fill(rxbuf *rb, int fd, int flags) {
+    rxbuf_makeroom(rb);
+
+    ssize_t n;
+    do {
+        n = recv(fd, rb->data + rb->end, RXBUF_SIZE - rb->end, flags);
+    } while ((n < 0) && (errno == EINTR));
+
+    if (n > 0)
+        rb->end += n;
+    return n;
+}
+
+/************************************************************************
+ * rxbuf_put is rxbuf_fill for bytes that were received somewhere else
+ * (like an io_uring provided buffer). Copies as much of "bytes" as fits
+ * and returns how many that was; the caller takes commands out with
+ * rxbuf_next (or rxbuf_frame) before putting in the rest.
+ */
+int rxbuf_put(rxbuf *rb, const char *bytes, int len) {
+    rxbuf_makeroom(rb);
+
+    int n = RXBUF_SIZE - rb->end;
+    if (n > len)
+        n = len;
+    memcpy(rb->data + rb->end, bytes, n);
+    rb->end += n;
+    return n;
+}
+
+/************************************************************************
+ * rxbuf_next finds the next complete line in the buffer. Returns 1 and
+ * sets "*line" to the NUL-terminated line (valid until the next call to
+ * rxbuf_fill), 0 if there is no complete line yet, or -1 if a line too
+ * long to ever fit in the buffer has been started. An over-long line is
+ * reported once and then dropped up to and including its newline.
+ */
+int rxbuf_next(rxbuf *rb, char **line) {
+    while (1) {
+        char *nl = memchr(rb->data + rb->scan, '\n', rb->end - rb->scan);
+        if (nl == NULL) {
+            rb->scan = rb->end;
+            if ((rb->end - rb->start) < RXBUF_SIZE)
+                return 0;
+
+            // The whole buffer is one unfinished line
+            rb->start = rb->scan = rb->end = 0;
+            if (rb->discard)
+                continue;
+            rb->discard = 1;
+            return -1;
+        }
+
+        *nl = '\0';
+        char *begin = rb->data + rb->start;
+        rb->start = rb->scan = (nl - rb->data) + 1;
+        if (rb->start == rb->end)
+            rb->start = rb->scan = rb->end = 0;  // Empty, so start over at the front
+
+        if (rb->discard) {
+            rb->discard = 0;  // That was the tail of an over-long line
+            continue;
+        }
+
+        *line = begin;
+        return 1;
+    }
+}
+
+/************************************************************************
+ * rxbuf_frame is the binary protocol's rxbuf_next: it finds the next
+ * complete frame (a 2-byte big-endian length followed by that many
+ * bytes). Returns 1 and sets "*frame" and "*len" to the bytes after the
+ * length (valid until the next call to rxbuf_fill), 0 if there is no
+ * complete frame yet, or -1 for a frame too long to ever fit in the
+ * buffer, which is then dropped as it arrives.
+ */
+int rxbuf_frame(rxbuf *rb, char **frame, int *len) {
+    if (rb->skip > 0) {
+        int drop = rb->end - rb->start;
+        if (drop > rb->skip)
+            drop = rb->skip;
+        rb->start += drop;
+        rb->skip -= drop;
+    }
+
+    int avail = rb->end - rb->start;
+    if ((rb->skip > 0) || (avail < 2)) {
+        if (avail == 0)
+            rb->start = rb->end = 0;
+        rb->scan = rb->start;
+        return 0;
+    }
+
+    unsigned char *hdr = (unsigned char *)rb->data + rb->start;
+    int flen = (hdr[0] << 8) | hdr[1];
+    if (flen > RXBUF_SIZE - 2) {
+        rb->start += 2;
+        rb->scan = rb->start;
+        rb->skip = flen;
+        return -1;
+    }
+    if (avail < 2 + flen)
+        return 0;
+
+    *frame = rb->data + rb->start + 2;
+    *len = flen;
+    rb->start += 2 + flen;
+    if (rb->start == rb->end)
+        rb->start = rb->end = 0;  // Empty, so start over at the front
+    rb->scan = rb->start;
+    return 1;
+}
+
+/************************************************************************
+ * rxbuf_ready says, without consuming anything, whether rxbuf_next (or
+ * rxbuf_frame, if "frames" is set) has anything to hand out: a complete
+ * line or frame, or an over-long one to report. Lets a reader find out
+ * whether there is any work to do before handing the buffer to whoever
+ * runs the commands.
+ */
+int rxbuf_ready(rxbuf *rb, int frames) {
+    int avail = rb->end - rb->start;
+    if (frames) {
+        if (rb->skip > 0)
+            return avail > 0;
+        if (avail < 2)
+            return 0;
+        unsigned char *hdr = (unsigned char *)rb->data + rb->start;
+        int flen = (hdr[0] << 8) | hdr[1];
+        return (flen > RXBUF_SIZE - 2) || (avail >= 2 + flen);
+    }
+
+    if (avail == RXBUF_SIZE)
+        return 1;
+    if (memchr(rb->data + rb->scan, '\n', rb->end - rb->scan) != NULL)
+        return 1;
+    rb->scan = rb->end;  // No need to look at these bytes again
+    return 0;
+}
@@ -0,0 +1,28 @@
+// Types and function prototypes for the per-connection receive buffer
+
+#ifndef _RXBUF_H
+#define _RXBUF_H
+
+#include <sys/types.h>
+
+// The longest command line that can be received from a plane
+
+#define RXBUF_SIZE 1024
+
+typedef struct {
+    int start;     // First byte not yet handed out as part of a line
+    int scan;      // Where to resume looking for the next newline
+    int end;       // One past the last byte received
+    int discard;   // Skipping the rest of an over-long line
+    int skip;      // Bytes of an over-long binary frame still to drop
+    char data[RXBUF_SIZE];
+} rxbuf;
+
+void rxbuf_init(rxbuf *rb);
+ssize_t rxbuf_fill(rxbuf *rb, int fd, int flags);
+int rxbuf_put(rxbuf *rb, const char *bytes, int len);
+int rxbuf_next(rxbuf *rb, char **line);
+int rxbuf_frame(rxbuf *rb, char **frame, int *len);
+int rxbuf_ready(rxbuf *rb, int frames);
+
+#endif  // _RXBUF_H
@@ -0,0 +1,489 @@
+// The shard module is the server run as one reactor per core. Every
+// shard is a thread pinned to its own CPU, with its own listening socket
+// (all bound to the same port with SO_REUSEPORT, so the kernel spreads
+// new connections over them) and its own epoll loop. A plane belongs to
+// the shard that accepted it for its whole life, and that shard reads
+// and frames its commands and runs the ones that only touch the plane.
+//
+// The state shared by all planes has a single owner instead:
+//
+//   - The flight id registry (the duplicate REG check) is owned by shard
+//     REGISTRY_SHARD.
+//   - Runway N's taxi queue at airport A is owned by shard
+//     (A+N-1) % nshards, so with several runways or airports (see
+//     airport.h) the queues are spread over the shards.
+//
+// A command that needs one of these is not run under a shared lock from
+// the plane's own shard. The plane itself is posted, as a message, to the
+// owner's mailbox; the owner runs the command and posts the plane back
+// home, where reading carries on. Meanwhile the plane's socket stays
+// disarmed (EPOLLONESHOT), so its commands still run one at a time and in
+// order. Closing a plane travels the same way, through its runway's
+// owner and then the registry, and ends back on its home shard.
+//
+// Each shard keeps its own list of the planes at home on it, rather than
+// putting them on the plane list (planelist.c), whose lock every accept
+// would otherwise take.
+//
+// Mailboxes are lock-free stacks (reversed into arrival order when they
+// are drained) with an eventfd in the owner's epoll set to wake it.
+// Replies go out through the plane's FILE* from whichever shard ran the
+// command, as they do from the workers in the epoll mode.
+
+#define _GNU_SOURCE      // For CPU affinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "airplane.h"
+#include "airs_protocol.h"
+#include "airs_binary.h"
+#include "alist.h"
+#include "planelist.h"
+#include "taxiqueue.h"
+#include "shard.h"
+
+// Shard that owns the flight id registry
+
+#define REGISTRY_SHARD 0
+
+// Maximum number of events to pull out of the kernel per epoll_wait call
+
+#define MAX_EVENTS 64
+
+// Events a plane's socket is (re-)armed for
+
+#define PLANE_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+typedef struct {
+    pthread_t thread;
+    int cpu;                 // CPU the shard is pinned to
+    int epoll_fd;
+    int listen_fd;
+    int mail_fd;             // eventfd, written when mail arrives
+    work *mail;              // Messages posted to this shard, newest first
+    alist planes;            // Planes at home here (only this shard's)
+} shard;
+
+static shard *shards;
+static int nshards;
+
+// The shard the current thread runs (-1 on other threads)
+
+static __thread int current_shard = -1;
+
+/************************************************************************
+ * shard_post sends message "w" to shard "to", where w->run will be
+ * called on the shard's thread. Can be called from any thread.
+ */
+static void shard_post(int to, work *w) {
+    shard *sh = &shards[to];
+    work *old = __atomic_load_n(&sh->mail, __ATOMIC_RELAXED);
+    do {
+        w->next = old;
+    } while (!__atomic_compare_exchange_n(&sh->mail, &old, w, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the first message into an empty mailbox needs to wake the
+    // shard, which always drains the whole mailbox at once
+    if (old == NULL)
+        eventfd_write(sh->mail_fd, 1);
+}
+
+/************************************************************************
+ * shard_send moves plane "plane" to shard "to" and runs "run" on it
+ * there: straight away if that is the shard we're on, or by posting the
+ * plane to it otherwise.
+ */
+static void shard_send(airplane *plane, int to, void (*run)(work *)) {
+    plane->job.run = run;
+    if (to == current_shard)
+        run(&plane->job);
+    else
+        shard_post(to, &plane->job);
+}
+
+/************************************************************************
+ * Returns the shard that owns runway "number" at airport "airport".
+ */
+static int runway_shard(int airport, int number) {
+    return (airport + number - 1) % nshards;
+}
+
+/************************************************************************
+ * command_shard returns the shard command "cmd" from "plane" has to run
+ * on. Planes are given their runway before REQTAXI (rather than by the
+ * taxi queue while it runs), so that it can go to the runway's owner.
+ */
+static int command_shard(airplane *plane, int cmd) {
+    switch (cmd) {
+    case CMD_REG:
+        return REGISTRY_SHARD;
+    case CMD_REQTAXI:
+        if ((plane_state(plane) == PLANE_ATTERMINAL) && (plane->runway == 0))
+            plane->runway = taxiqueue_pick(plane);
+        // Fall through
+    case CMD_REQPOS:
+    case CMD_REQAHEAD:
+    case CMD_SUBSCRIBE:
+    case CMD_UNSUBSCRIBE:
+    case CMD_INAIR:
+        if (plane->runway > 0)
+            return runway_shard(plane->airport, plane->runway);
+        break;
+    }
+    return plane->shard;
+}
+
+static void plane_input(airplane *plane);
+
+static airplane *job_plane(work *job) {
+    return (airplane *)((char *)job - offsetof(airplane, job));
+}
+
+/************************************************************************
+ * run_pending runs the command a plane has waiting in "pending".
+ */
+static void run_pending(airplane *plane) {
+    if (plane->proto == PROTO_BINARY)
+        docommand_binary(plane, (unsigned char *)plane->pending,
+                         plane->pending_len);
+    else
+        runcommand(plane, plane->pending_cmd, plane->pending);
+}
+
+/************************************************************************
+ * Message handlers: run_away runs a plane's pending command on the shard
+ * that owns what it needs and sends the plane home again; run_home then
+ * carries on with the plane's input.
+ */
+static void run_home(work *job) {
+    plane_input(job_plane(job));
+}
+
+static void run_away(work *job) {
+    airplane *plane = job_plane(job);
+    run_pending(plane);
+    shard_send(plane, plane->shard, run_home);
+}
+
+/************************************************************************
+ * alist_foreach visitor that stops at the plane passed in as "arg".
+ */
+static int is_plane(void *item, void *arg) {
+    return item == arg;
+}
+
+/************************************************************************
+ * close_home takes a plane off its home shard's list, which destroys
+ * it. Must be run on the plane's home shard.
+ */
+static void close_home(work *job) {
+    airplane *plane = job_plane(job);
+    alist *planes = &shards[current_shard].planes;
+    alist_remove(planes, alist_foreach(planes, is_plane, plane));
+}
+
+/************************************************************************
+ * close_step takes a plane out of the system, visiting the owner of its
+ * runway (if it is still queued) and of the registry (if it registered)
+ * in turn, and then its home shard, where it is destroyed.
+ */
+static void close_step(work *job) {
+    airplane *plane = job_plane(job);
+
+    if (plane->taxi_ticket != 0) {
+        int owner = runway_shard(plane->airport, plane->runway);
+        if (owner != current_shard) {
+            shard_post(owner, job);
+            return;
+        }
+        taxiqueue_remove(plane);
+    }
+
+    if (plane->fid != FLIGHTID_NONE) {
+        if (current_shard != REGISTRY_SHARD) {
+            shard_post(REGISTRY_SHARD, job);
+            return;
+        }
+        planelist_unregister(plane);
+    }
+    shard_send(plane, plane->shard, close_home);
+}
+
+/************************************************************************
+ * close_plane takes a plane out of its shard's epoll set and starts it
+ * on its way out. Must be called on the plane's home shard.
+ */
+static void close_plane(airplane *plane) {
+    epoll_ctl(plane->epoll_fd, EPOLL_CTL_DEL, plane->fd, NULL);
+    shard_send(plane, plane->shard, close_step);
+}
+
+/************************************************************************
+ * plane_input runs the commands waiting in a plane's receive buffer, on
+ * the plane's home shard, until one of them has to run somewhere else
+ * (it then comes back here when done) or there are none left. Then the
+ * plane is closed or its socket re-armed.
+ */
+static void plane_input(airplane *plane) {
+    while (plane_state(plane) != PLANE_DONE) {
+        int got;
+        int cmd = PARSE_EMPTY;
+        char *input;
+        int len = 0;
+        if (plane->proto == PROTO_BINARY) {
+            if (((got = rxbuf_frame(&plane->rx, &input, &len)) > 0) && (len > 0))
+                cmd = (unsigned char)input[0];
+        } else {
+            char *line;
+            if ((got = rxbuf_next(&plane->rx, &line)) > 0)
+                cmd = parse_command(line, &input);
+        }
+
+        if (got == 0)
+            break;
+        if (got < 0) {
+            send_err(plane, ERR_TOOLONG);
+            continue;
+        }
+        if (cmd == PARSE_EMPTY)
+            continue;
+
+        // The input stays in the receive buffer, which nothing else
+        // touches until the plane is back
+        plane->pending_cmd = cmd;
+        plane->pending = input;
+        plane->pending_len = len;
+        int owner = command_shard(plane, cmd);
+        if (owner != plane->shard) {
+            shard_send(plane, owner, run_away);
+            return;
+        }
+        run_pending(plane);
+    }
+
+    if ((plane_state(plane) == PLANE_DONE) || plane->hangup) {
+        close_plane(plane);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = PLANE_EVENTS;
+    ev.data.ptr = plane;
+    if (epoll_ctl(plane->epoll_fd, EPOLL_CTL_MOD, plane->fd, &ev) < 0) {
+        perror("epoll_ctl - rearm");
+        close_plane(plane);
+    }
+}
+
+/************************************************************************
+ * handle_input reads what is available on a plane's socket, and runs
+ * its commands if there is a complete one (or the peer has gone), or
+ * else re-arms the socket. As in the epoll mode, the socket itself stays
+ * blocking for the FILE* sender, so reads use MSG_DONTWAIT.
+ */
+static void handle_input(airplane *plane) {
+    ssize_t n = rxbuf_fill(&plane->rx, plane->fd, MSG_DONTWAIT);
+    if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        plane->hangup = 1;   // Client disconnected
+
+    if (!plane->hangup &&
+        !rxbuf_ready(&plane->rx, plane->proto == PROTO_BINARY)) {
+        struct epoll_event ev;
+        ev.events = PLANE_EVENTS;
+        ev.data.ptr = plane;
+        epoll_ctl(plane->epoll_fd, EPOLL_CTL_MOD, plane->fd, &ev);
+        return;
+    }
+
+    plane_input(plane);
+}
+
+/************************************************************************
+ * handle_accept accepts every connection waiting on the shard's own
+ * listener, and makes each a plane at home on this shard.
+ */
+static void handle_accept(shard *sh) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int comm_fd;
+    while ((comm_fd=accept(sh->listen_fd, (struct sockaddr *)&client_addr,
+                           &client_addr_len)) >= 0) {
+        // Accepted sockets don't inherit the listener's O_NONBLOCK
+        airplane *new_client = new_airplane(comm_fd);
+        client_addr_len = sizeof(client_addr);
+        if (new_client == NULL)
+            continue;
+
+        new_client->thread = pthread_self();
+        new_client->epoll_fd = sh->epoll_fd;
+        new_client->shard = current_shard;
+        alist_add(&sh->planes, new_client);
+
+        printf("Got connection from %s (client %ld)\n",
+               inet_ntoa(((struct sockaddr_in *)&client_addr)->sin_addr),
+               new_client->thread);
+
+        struct epoll_event ev;
+        ev.events = PLANE_EVENTS;
+        ev.data.ptr = new_client;
+        if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, new_client->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close_home(&new_client->job);
+        }
+    }
+
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR) &&
+        (errno != ECONNABORTED))
+        perror("accept");
+}
+
+/************************************************************************
+ * handle_mail runs every message in the shard's mailbox, oldest first.
+ */
+static void handle_mail(shard *sh) {
+    eventfd_t count;
+    eventfd_read(sh->mail_fd, &count);
+
+    work *w = __atomic_exchange_n(&sh->mail, NULL, __ATOMIC_ACQUIRE);
+    work *oldest = NULL;
+    while (w != NULL) {
+        work *next = w->next;
+        w->next = oldest;
+        oldest = w;
+        w = next;
+    }
+
+    // A message can be posted again (even to this shard) while it runs,
+    // so its link must be read first
+    while (oldest != NULL) {
+        work *next = oldest->next;
+        oldest->run(oldest);
+        oldest = next;
+    }
+}
+
+/************************************************************************
+ * shard_main is the event loop run by each shard.
+ */
+static void *shard_main(void *arg) {
+    shard *sh = (shard *)arg;
+    current_shard = sh - shards;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int nready = epoll_wait(sh->epoll_fd, events, MAX_EVENTS, -1);
+        if (nready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i=0; i<nready; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &sh->listen_fd) {
+                handle_accept(sh);
+            } else if (ptr == &sh->mail_fd) {
+                handle_mail(sh);
+            } else if ((events[i].events & (EPOLLERR | EPOLLHUP)) &&
+                       !(events[i].events & EPOLLIN)) {
+                close_plane(ptr);
+            } else {
+                handle_input(ptr);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/************************************************************************
+ * Returns the number of shards to run: one per CPU this process may run
+ * on.
+ */
+int shard_count(void) {
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0)
+        return 1;
+    return CPU_COUNT(&cpus);
+}
+
+/************************************************************************
+ * shard_run starts "count" shards, shard i accepting on "listen_fds[i]"
+ * and pinned to the i'th CPU this process may run on, and then waits on
+ * them forever.
+ */
+void shard_run(int *listen_fds, int count) {
+    nshards = count;
+    shards = calloc(nshards, sizeof(shard));
+    if (shards == NULL) {
+        perror("shard_run");
+        exit(1);
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    int cpu = -1;
+
+    for (int i=0; i<nshards; i++) {
+        shard *sh = &shards[i];
+        sh->listen_fd = listen_fds[i];
+        fcntl(sh->listen_fd, F_SETFL, fcntl(sh->listen_fd, F_GETFL) | O_NONBLOCK);
+        if (((sh->epoll_fd = epoll_create1(0)) < 0) ||
+            ((sh->mail_fd = eventfd(0, EFD_NONBLOCK)) < 0)) {
+            perror("shard_run");
+            exit(1);
+        }
+        alist_init_unlocked(&sh->planes, airplane_free);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &sh->listen_fd;
+        epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->listen_fd, &ev);
+        ev.data.ptr = &sh->mail_fd;
+        epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, sh->mail_fd, &ev);
+
+        // Next CPU in the allowed set (wrapping round if there are more
+        // shards than CPUs)
+        do {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        } while (!CPU_ISSET(cpu, &allowed));
+        sh->cpu = cpu;
+    }
+
+    // Every mailbox has to exist before any shard can post to it
+    for (int i=0; i<nshards; i++) {
+        shard *sh = &shards[i];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        cpu_set_t mine;
+        CPU_ZERO(&mine);
+        CPU_SET(sh->cpu, &mine);
+        pthread_attr_setaffinity_np(&attr, sizeof(mine), &mine);
+        if (pthread_create(&sh->thread, &attr, shard_main, sh) != 0) {
+            perror("shard_run - pthread_create");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    for (int i=0; i<nshards; i++)
+        pthread_join(shards[i].thread, NULL);
+}
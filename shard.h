@@ -0,0 +1,9 @@
+// Function prototypes for the sharded (one reactor per core) server mode
+
+#ifndef _SHARD_H
+#define _SHARD_H
+
+int shard_count(void);
+void shard_run(int *listen_fds, int nshards);
+
+#endif  // _SHARD_H
@@ -1,163 +1,791 @@
 #include "taxiqueue.h"
-#include "alist.h"
 #include "airplane.h"
+#include "airport.h"
 #include "planelist.h"
 #include "airs_protocol.h"
+#include "timers.h"
+#include "metrics.h"
+#include "journal.h"
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdio.h>
 #include <stdlib.h>
 
-static alist taxi_queue;
-static pthread_mutex_t queue_mutex;
-static pthread_cond_t queue_cond;
-static pthread_t queue_manager_thread;
+// Every airport (see airport.h) has the same number of departure
+// runways, and each runway has its own taxi queue and lock, so departures
+// on different runways (or at different airports) never wait on each
+// other. A plane requesting taxi is sent to the runway at its airport
+// with the fewest planes queued, and stays on it.
+//
+// A runway clears one plane at a time. When the cleared plane takes off,
+// the next one may only be cleared after the separation interval, which
+// is done with a timer (see timers.c) rather than a sleeping thread: the
+// clearance happens right away if the runway has been free long enough,
+// or when the timer fires otherwise.
+//
+// Each runway's queue hands every plane a ticket (a sequence number that
+// only ever increases) when it joins. Tickets qhead..qtail-1 are in the
+// queue, and ticket t is stored in slot t-qbase of the slots array. A
+// plane that leaves from the middle (e.g. disconnects) just leaves a hole
+// behind, so nothing ever gets shifted on removal.
+//
+// With no holes, a plane's position is simply its ticket minus the head
+// ticket. Holes are accounted for with a Fenwick (binary indexed) tree
+// over the slots, holding a 1 for every live entry, so positions stay
+// O(log n) even then.
+//
+// For REQAHEAD, the whole queue is also kept pre-rendered as one string
+// ("ID1, ID2, ID3, ") and every entry remembers the offset where its id
+// starts. The planes ahead of any entry are then just a slice of that
+// string, so nothing has to be built per request. Appending to the queue
+// appends to the string and taking off the head costs nothing; only a
+// removal from the middle forces a re-render, and that is put off until
+// somebody actually asks.
+//
+// Planes can also subscribe to their position instead of polling REQPOS.
+// Whenever planes leave a runway's queue, everybody behind them moves up,
+// so one pass over the rest of the queue sends each subscriber its new
+// position. Planes that join at the tail don't move anybody.
+//
+// After a restart, the flights that were queued (according to the
+// journal, see journal.c) are put back in their old order as
+// placeholders: entries with an id but no plane yet. A plane that
+// registers that id again and requests taxi takes its placeholder over,
+// ticket and all, instead of joining at the tail. Placeholders nobody
+// has claimed within TAXIQUEUE_RESTORE_GRACE ms are dropped. Until then a
+// placeholder at the head holds its runway, just as a cleared plane that
+// hasn't taken off yet would.
 
-void *taxiqueue_manager(void *arg);
+#define QUEUE_DEF_CAPACITY 16
+#define RENDER_DEF_CAPACITY 256
+#define RENDER_SEP ", "
+#define RENDER_SEPLEN 2
 
-// Initialize the taxi queue
-void taxiqueue_init() {
-    alist_init(&taxi_queue, free);
-    pthread_mutex_init(&queue_mutex, NULL);
-    pthread_cond_init(&queue_cond, NULL);
-    pthread_create(&queue_manager_thread, NULL, taxiqueue_manager, NULL);
-}
+typedef struct {
+    flightid fid;    // Flight id (holding a reference), or FLIGHTID_NONE
+                     // once the entry has left
+    long roff;       // Offset of this entry's id in the rendered queue
+    airplane *sub;   // The plane, if it subscribed to position updates
+    int unclaimed;   // Set while the entry is a restored placeholder
+} queue_entry;
+
+typedef struct {
+    int airport;             // Airport the runway is at
+    int number;              // Runway number, starting at 1
+
+    queue_entry *slots;
+    int *live_tree;          // Fenwick tree over slots (1-based inside)
+    int qcap;                // Number of slots allocated
+    long qbase;              // Ticket stored in slot 0
+    long qhead;              // Ticket at the front of the queue
+    long qtail;              // Next ticket to hand out
+    int qholes;              // Removed entries between qhead and qtail
+    int nqueued;             // Live entries (read unlocked to pick runways)
+    int nsubscribed;         // Live entries with a subscriber
+
+    char *render;            // Rendered queue, see above
+    int render_cap;          // Bytes allocated for render
+    long render_base;        // Offset stored at render[0]
+    long render_end;         // Offset just past the last rendered id
+    int render_dirty;        // Set when a hole makes the rendering stale
+
+    long cleared_ticket;     // Ticket of the plane cleared for takeoff, or 0
+    long next_clear;         // Earliest time (timers_now) for the next clearance
+    timer clear_timer;       // Armed while waiting out the separation
+
+    pthread_mutex_t queue_mutex;
+} runway;
+
+static runway *runways[AIRPORT_MAX];  // Each airport's runways
+static int nrunways;
+static int separation_ms;
+
+// Unclaimed placeholders, indexed by flight id
 
-// Add a new flight to the taxi queue
-void taxiqueue_add(const char *flight_id) {
-    pthread_mutex_lock(&queue_mutex);
-    char *id_copy = strdup(flight_id); // Duplicate the ID string
-    alist_add(&taxi_queue, id_copy);
-    pthread_cond_signal(&queue_cond);
-    pthread_mutex_unlock(&queue_mutex);
+#define RESTORE_BUCKETS 1024
+
+typedef struct restored {
+    flightid fid;            // Holds a reference while unclaimed
+    int airport;
+    int runway;
+    long ticket;
+    struct restored *next;   // Next placeholder in the same bucket
+} restored;
+
+static restored *restore_index[RESTORE_BUCKETS];
+static int nrestored;        // Placeholders in the index (read unlocked)
+static pthread_mutex_t restore_lock = PTHREAD_MUTEX_INITIALIZER;
+static timer restore_timer;  // Drops whatever is left when the grace is up
+
+// Add "delta" to the live count of slot "slot" in the Fenwick tree
+static void tree_add(runway *rw, int slot, int delta) {
+    for (int i = slot + 1; i <= rw->qcap; i += i & -i)
+        rw->live_tree[i - 1] += delta;
 }
 
-// Get the position of a flight in the taxi queue
-int taxiqueue_getpos(const char *flight_id) {
-    pthread_mutex_lock(&queue_mutex);
+// Count the live entries in slots 0..slot (inclusive)
+static int tree_sum(runway *rw, int slot) {
+    int sum = 0;
+    for (int i = slot + 1; i > 0; i -= i & -i)
+        sum += rw->live_tree[i - 1];
+    return sum;
+}
 
-    int position = 0;
-    for (int i = 0; i < alist_size(&taxi_queue); i++) {
-        char *current_id = (char *)alist_get(&taxi_queue, i);
-        if (strcmp(current_id, flight_id) == 0) {
-            position = i + 1; // Position is 1-indexed  
-            break;
+// Find the slot holding the k'th live entry (k >= 1) in O(log n)
+static int tree_find(runway *rw, int k) {
+    int slot = 0;
+    int step = 1;
+    while (2 * step <= rw->qcap)
+        step *= 2;
+    for (; step > 0; step /= 2) {
+        if (slot + step <= rw->qcap && rw->live_tree[slot + step - 1] < k) {
+            slot += step;
+            k -= rw->live_tree[slot - 1];
         }
     }
+    return slot;
+}
 
-    pthread_mutex_unlock(&queue_mutex);
-    return position;  
+// Rebuild the whole Fenwick tree from the slots array in O(n)
+static void tree_rebuild(runway *rw) {
+    for (int i = 0; i < rw->qcap; i++)
+        rw->live_tree[i] = (rw->slots[i].fid != FLIGHTID_NONE);
+    for (int i = 1; i <= rw->qcap; i++) {
+        int parent = i + (i & -i);
+        if (parent <= rw->qcap)
+            rw->live_tree[parent - 1] += rw->live_tree[i - 1];
+    }
 }
 
+// Make room for one more ticket at the tail. Slots before the head are
+// dead, so if they make up at least half the array they are reclaimed by
+// sliding everything down; otherwise the array doubles. Either way the
+// cost is amortized O(1) per ticket.
+static void queue_makeroom(runway *rw) {
+    if (rw->qtail - rw->qbase < rw->qcap)
+        return;
 
-// Get a string listing all flights ahead of the given flight in the queue
-char *taxiqueue_getahead(const char *flight_id) {
-    pthread_mutex_lock(&queue_mutex);
+    int dead = rw->qhead - rw->qbase;
+    int used = rw->qtail - rw->qhead;
+    if (dead >= rw->qcap / 2) {
+        memmove(rw->slots, rw->slots + dead, used * sizeof(queue_entry));
+        memset(rw->slots + used, 0, (rw->qcap - used) * sizeof(queue_entry));
+        rw->qbase = rw->qhead;
+    } else {
+        int newcap = 2 * rw->qcap;
+        queue_entry *newslots = realloc(rw->slots, newcap * sizeof(queue_entry));
+        int *newtree = realloc(rw->live_tree, newcap * sizeof(int));
+        if (newslots == NULL || newtree == NULL) {
+            perror("taxiqueue - growing queue");
+            exit(1);
+        }
+        memset(newslots + rw->qcap, 0, (newcap - rw->qcap) * sizeof(queue_entry));
+        rw->slots = newslots;
+        rw->live_tree = newtree;
+        rw->qcap = newcap;
+    }
+    tree_rebuild(rw);
+}
+
+// Grow the rendered queue buffer until it holds at least "size" bytes
+static void render_grow(runway *rw, long size) {
+    int newcap = rw->render_cap;
+    while (size > newcap)
+        newcap *= 2;
+    if (newcap == rw->render_cap)
+        return;
+
+    char *newrender = realloc(rw->render, newcap);
+    if (newrender == NULL) {
+        perror("taxiqueue - growing rendered queue");
+        exit(1);
+    }
+    rw->render = newrender;
+    rw->render_cap = newcap;
+}
 
-    // Determine the position of the flight in the queue
-    int pos = 0;
-    int size = alist_size(&taxi_queue);
-    for (int i = 0; i < size; ++i) {
-        char *current_id = alist_get(&taxi_queue, i);
-        if (strcmp(current_id, flight_id) == 0) {
-            pos = i + 1; 
-            break;
+// Write an entry's id (plus separator) at the end of the rendered queue,
+// which must already have room for it
+static void render_put(runway *rw, queue_entry *entry, int len) {
+    char *dst = rw->render + (rw->render_end - rw->render_base);
+    memcpy(dst, flightid_name(entry->fid), len);
+    memcpy(dst + len, RENDER_SEP, RENDER_SEPLEN);
+    entry->roff = rw->render_end;
+    rw->render_end += len + RENDER_SEPLEN;
+}
+
+// Append an entry to the rendered queue. Text in front of the head is
+// dead, so it is dropped when that frees up at least half of the buffer;
+// otherwise the buffer doubles.
+static void render_append(runway *rw, queue_entry *entry) {
+    int len = strlen(flightid_name(entry->fid));
+    long used = rw->render_end - rw->render_base;
+    if (used + len + RENDER_SEPLEN > rw->render_cap) {
+        long live_start = (rw->qhead < rw->qtail) ?
+            rw->slots[rw->qhead - rw->qbase].roff : rw->render_end;
+        long dead = live_start - rw->render_base;
+        if (dead >= rw->render_cap / 2) {
+            memmove(rw->render, rw->render + dead, used - dead);
+            rw->render_base += dead;
+            used -= dead;
         }
+        render_grow(rw, used + len + RENDER_SEPLEN);
     }
+    render_put(rw, entry, len);
+}
 
-    // If the position is invalid or no planes are ahead, return an empty string
-    if (pos <= 1 || pos > size) {
-        pthread_mutex_unlock(&queue_mutex);
-        return strdup("");  // No planes ahead or invalid position
+// Render the live part of the queue again from scratch, after holes have
+// left removed ids in the rendering. Holes end up with an empty rendering
+// (the same offset as whatever follows them).
+static void render_rebuild(runway *rw) {
+    long size = 0;
+    for (long t = rw->qhead; t < rw->qtail; t++) {
+        queue_entry *entry = &rw->slots[t - rw->qbase];
+        if (entry->fid != FLIGHTID_NONE)
+            size += strlen(flightid_name(entry->fid)) + RENDER_SEPLEN;
     }
+    render_grow(rw, size);
 
-    // Calculate the length required for the response string
-    size_t length = 0;
-    for (int i = 0; i < pos - 1; ++i) {
-        char *current_id = alist_get(&taxi_queue, i);
-        length += strlen(current_id) + 2; 
+    rw->render_base = rw->render_end = 0;
+    for (long t = rw->qhead; t < rw->qtail; t++) {
+        queue_entry *entry = &rw->slots[t - rw->qbase];
+        if (entry->fid != FLIGHTID_NONE)
+            render_put(rw, entry, strlen(flightid_name(entry->fid)));
+        else
+            entry->roff = rw->render_end;
     }
+    rw->render_dirty = 0;
+}
 
-    // Allocate memory for the ahead list string
-    char *aheadList = malloc(length);
-    if (!aheadList) {
-        pthread_mutex_unlock(&queue_mutex);
-        return NULL;  // If failure
+// Returns the queue entry for "ticket", or NULL if it isn't in the queue
+static queue_entry *queue_entry_for(runway *rw, long ticket) {
+    if (ticket < rw->qhead || ticket >= rw->qtail)
+        return NULL;
+    queue_entry *entry = &rw->slots[ticket - rw->qbase];
+    return (entry->fid != FLIGHTID_NONE) ? entry : NULL;
+}
+
+// Returns the position (1-indexed) of a queued ticket
+static int queue_pos(runway *rw, long ticket) {
+    if (rw->qholes == 0)
+        return ticket - rw->qhead + 1;
+    return tree_sum(rw, ticket - rw->qbase);
+}
+
+// Returns the ticket of the k'th live entry from the head (k >= 0)
+static long queue_kth(runway *rw, int k) {
+    if (rw->qholes == 0)
+        return rw->qhead + k;
+    return rw->qbase + tree_find(rw, k + 1);
+}
+
+// Take "ticket" out of the queue. If it was at the head, the head moves
+// forward past it and any holes behind it. Must hold queue_mutex.
+static void queue_remove_ticket(runway *rw, long ticket) {
+    queue_entry *entry = queue_entry_for(rw, ticket);
+    if (entry == NULL)
+        return;
+
+    flightid_release(entry->fid);
+    entry->fid = FLIGHTID_NONE;
+    if (entry->sub != NULL) {
+        entry->sub = NULL;
+        rw->nsubscribed--;
+    }
+    tree_add(rw, ticket - rw->qbase, -1);
+    rw->nqueued--;
+
+    if (ticket != rw->qhead) {
+        rw->qholes++;
+        rw->render_dirty = 1;
+        return;
+    }
+
+    rw->qhead++;
+    while (rw->qhead < rw->qtail &&
+           rw->slots[rw->qhead - rw->qbase].fid == FLIGHTID_NONE) {
+        rw->qholes--;
+        rw->qhead++;
     }
 
-    // Construct the list of flights ahead
-    char *ptr = aheadList;
-    for (int i = 0; i < pos - 1; ++i) {
-        char *current_id = alist_get(&taxi_queue, i);
-        ptr += sprintf(ptr, "%s%s", current_id, (i < pos - 2 ? ", " : ""));
+    // An empty queue can start again at slot 0 for free: every slot is
+    // dead, so the Fenwick tree is already all zeros.
+    if (rw->qhead == rw->qtail) {
+        rw->qbase = rw->qhead;
+        rw->render_base = rw->render_end = 0;
+        rw->render_dirty = 0;
     }
+}
 
-    pthread_mutex_unlock(&queue_mutex);
-    return aheadList;
+// Send every subscriber behind "gone" (a ticket that just left the queue)
+// its new position, in a single pass over the rest of the queue. Must
+// hold queue_mutex.
+static void queue_notify(runway *rw, long gone) {
+    if (rw->nsubscribed == 0 || rw->qhead == rw->qtail)
+        return;
+
+    // Start from the live entries before "t", since the slot at "t" may
+    // itself have left already
+    long t = (gone < rw->qhead) ? rw->qhead : gone + 1;
+    int pos = (t == rw->qhead) ? 1 : tree_sum(rw, t - rw->qbase - 1) + 1;
+    for (; t < rw->qtail; t++) {
+        queue_entry *entry = &rw->slots[t - rw->qbase];
+        if (entry->fid == FLIGHTID_NONE)
+            continue;
+        if (entry->sub != NULL)
+            send_pos(entry->sub, pos);
+        pos++;
+    }
 }
 
+// Put flight "fid" at the tail of the queue, and return its ticket. The
+// entry takes a reference of its own. Must hold queue_mutex.
+static long queue_append(runway *rw, flightid fid) {
+    queue_makeroom(rw);
+    int slot = rw->qtail - rw->qbase;
+    flightid_hold(fid);
+    rw->slots[slot].fid = fid;
+    rw->slots[slot].unclaimed = 0;
+    tree_add(rw, slot, 1);
+    if (!rw->render_dirty)
+        render_append(rw, &rw->slots[slot]);
+    __atomic_store_n(&rw->nqueued, rw->nqueued + 1, __ATOMIC_RELAXED);
+    return rw->qtail++;
+}
 
-// Handle the situation when a plane is in the air
-void taxiqueue_inair(const char *flight_id) {
-    pthread_mutex_lock(&queue_mutex);
+// Returns the runway a plane is queued on, or NULL if it isn't queued.
+// The plane's runway only changes in taxiqueue_add, which is called from
+// the plane's own connection.
+static runway *plane_runway(airplane *plane) {
+    if (plane->runway < 1)
+        return NULL;
+    return &runways[plane->airport][plane->runway - 1];
+}
 
-    // Find the airplane in the queue and remove it
-    for (int i = 0; i < alist_size(&taxi_queue); i++) {
-        char *current_id = (char *)alist_get(&taxi_queue, i);
-        if (strcmp(current_id, flight_id) == 0) {
-            alist_remove(&taxi_queue, i);     // Remove from the queue
-            break;
-        }
+// Clear the plane at the head of the queue for takeoff. Must hold
+// queue_mutex, and the runway must not have a plane cleared already.
+// An unclaimed placeholder at the head holds the runway: a plane that
+// has registered its id but not taken it over yet isn't queued, so
+// nothing stops it from being destroyed under us.
+static void runway_clear_head(runway *rw) {
+    queue_entry *head = &rw->slots[rw->qhead - rw->qbase];
+    if (head->unclaimed)
+        return;
+    flightid next_fid = head->fid;
+    airplane *next_plane = planelist_find(next_fid);
+    if (next_plane == NULL ||
+        !plane_transition(next_plane, PLANE_TAXIING, PLANE_CLEAR)) {
+        // Only happens while the plane is on its way out of the queue,
+        // and the removal will schedule the next clearance
+        return;
     }
+    next_plane->cleared_at = metrics_now();
+    rw->cleared_ticket = rw->qhead;
+    journal_record(JOURNAL_CLEAR, rw->airport, rw->number, rw->qhead,
+                   flightid_name(next_fid));
+    send_takeoff(next_plane);
+    printf("Clearing flight %s for takeoff on runway %d.\n",
+           flightid_name(next_fid), rw->number);
+}
+
+// Clear the next plane if the runway is free and the separation interval
+// has passed, or arm the runway's timer for when it will have. Must hold
+// queue_mutex.
+static void runway_schedule(runway *rw) {
+    if (rw->cleared_ticket != 0 || rw->qhead == rw->qtail)
+        return;
 
-    pthread_cond_signal(&queue_cond); 
-    pthread_mutex_unlock(&queue_mutex);
+    if (timers_now() >= rw->next_clear)
+        runway_clear_head(rw);
+    else
+        timer_arm(&rw->clear_timer, rw->next_clear);
 }
 
+// Runs on the timer thread once a runway's separation interval is over
+static void runway_timer_fired(void *arg) {
+    runway *rw = (runway *)arg;
+    pthread_mutex_lock(&rw->queue_mutex);
+    runway_schedule(rw);
+    pthread_mutex_unlock(&rw->queue_mutex);
+}
 
-void *taxiqueue_manager(void *arg) {
-    while (1) {
-        pthread_mutex_lock(&queue_mutex);
+// Take a plane out of its runway's queue and, if it was the cleared
+// plane, free the runway up for the next one. "tookoff" starts the
+// separation interval; a cleared plane that just disconnected doesn't
+// need one.
+static void runway_remove(airplane *plane, int tookoff) {
+    runway *rw = plane_runway(plane);
+    if (rw == NULL)
+        return;
 
-        // Wait until there is at least one flight in the queue
-        while (alist_size(&taxi_queue) == 0) {
-            pthread_cond_wait(&queue_cond, &queue_mutex);
+    pthread_mutex_lock(&rw->queue_mutex);
+    long ticket = plane->taxi_ticket;
+    if (ticket != 0) {
+        queue_remove_ticket(rw, ticket);
+        plane->taxi_ticket = 0;
+        journal_record(tookoff ? JOURNAL_INAIR : JOURNAL_GONE, rw->airport,
+                       rw->number, ticket, flightid_name(plane->fid));
+        queue_notify(rw, ticket);
+        if (ticket == rw->cleared_ticket) {
+            rw->cleared_ticket = 0;
+            if (tookoff) {
+                rw->next_clear = timers_now() + separation_ms;
+                printf("Flight %s has taken off from runway %d.\n",
+                       flightid_name(plane->fid), rw->number);
+            }
         }
+        runway_schedule(rw);
+    }
+    pthread_mutex_unlock(&rw->queue_mutex);
+}
 
-        // Get the ID of the first flight in the queue
-        char *first_flight_id = (char *)alist_get(&taxi_queue, 0);
-        airplane *first_plane = planelist_find(first_flight_id);
-       
-        // Wait for the first plane to signal it's in the air
-        while (first_plane != NULL && first_plane->state != PLANE_INAIR) {
-            pthread_cond_wait(&queue_cond, &queue_mutex);
-            first_plane = planelist_find(first_flight_id); // Recheck the first flight
-        }
+// Runs when a plane reports INAIR (as a hook on entering PLANE_INAIR):
+// it leaves the queue, and its runway starts the separation interval
+static void plane_tookoff(airplane *plane, int from) {
+    runway_remove(plane, 1);
+}
+
+// Returns the link pointing at the unclaimed placeholder for flight
+// "fid" (pointing at NULL if there isn't one). Must hold restore_lock.
+static restored **restore_find(flightid fid) {
+    restored **rp = &restore_index[fid % RESTORE_BUCKETS];
+    while ((*rp != NULL) && ((*rp)->fid != fid))
+        rp = &(*rp)->next;
+    return rp;
+}
 
-        
-        if (first_plane != NULL && first_plane->state == PLANE_INAIR) {
-            alist_remove(&taxi_queue, 0);
-            printf("Flight %s has taken off.\n", first_flight_id);
+// Runs on the timer thread once the restore grace is up, and drops every
+// placeholder that hasn't been claimed
+static void restore_expire(void *arg) {
+    pthread_mutex_lock(&restore_lock);
+    restored *left = NULL;
+    for (int b = 0; b < RESTORE_BUCKETS; b++) {
+        while (restore_index[b] != NULL) {
+            restored *r = restore_index[b];
+            restore_index[b] = r->next;
+            r->next = left;
+            left = r;
         }
+    }
+    __atomic_store_n(&nrestored, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&restore_lock);
 
-        // Clear the next plane for takeoff if there is one
-        if (alist_size(&taxi_queue) > 0) {
-            // Sleep interval
-            pthread_mutex_unlock(&queue_mutex);
-            sleep(4); 
-            pthread_mutex_lock(&queue_mutex);
-            char *next_flight_id = (char *)alist_get(&taxi_queue, 0);
-            airplane *next_plane = planelist_find(next_flight_id);
-            if (next_plane != NULL && next_plane->state == PLANE_TAXIING) {
-                next_plane->state = PLANE_CLEAR;
-                fprintf(next_plane->fp_send, "TAKEOFF\n");
-                fflush(next_plane->fp_send); // Ensure the message is sent immediately
-                printf("Clearing flight %s for takeoff.\n", next_flight_id);
-                pthread_cond_signal(&queue_cond); // Signal that a plane has been cleared
-            }
+    while (left != NULL) {
+        restored *r = left;
+        left = r->next;
+
+        runway *rw = &runways[r->airport][r->runway - 1];
+        pthread_mutex_lock(&rw->queue_mutex);
+        queue_remove_ticket(rw, r->ticket);
+        journal_record(JOURNAL_GONE, rw->airport, rw->number, r->ticket,
+                       flightid_name(r->fid));
+        queue_notify(rw, r->ticket);
+        runway_schedule(rw);
+        pthread_mutex_unlock(&rw->queue_mutex);
+        printf("Flight %s did not return; dropped from runway %d.\n",
+               flightid_name(r->fid), rw->number);
+        flightid_release(r->fid);
+        free(r);
+    }
+}
+
+// Hand a plane the placeholder left for its flight id, if there is one.
+// Returns 1 if it got one (and so is queued), or 0. A plane that was
+// already cleared for takeoff (handed over from another process) stays
+// cleared, rather than being cleared again.
+static int restore_claim(airplane *plane) {
+    pthread_mutex_lock(&restore_lock);
+    restored **rp = restore_find(plane->fid);
+    restored *r = *rp;
+    if (r != NULL) {
+        *rp = r->next;
+        __atomic_store_n(&nrestored, nrestored - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&restore_lock);
+    if (r == NULL)
+        return 0;
+
+    runway *rw = &runways[r->airport][r->runway - 1];
+    pthread_mutex_lock(&rw->queue_mutex);
+    rw->slots[r->ticket - rw->qbase].unclaimed = 0;
+    plane->taxi_ticket = r->ticket;
+    plane->runway = rw->number;
+    if (plane_state(plane) == PLANE_CLEAR)
+        rw->cleared_ticket = r->ticket;
+    runway_schedule(rw);
+    pthread_mutex_unlock(&rw->queue_mutex);
+    flightid_release(r->fid);
+    free(r);
+    return 1;
+}
+
+// Initialize the taxi queues: "count" runways at every airport, with
+// "separation" ms between a takeoff and the next clearance on the same
+// runway. Each airport's queues are set up by taxiqueue_open. The timers
+// module must already be initialized.
+void taxiqueue_init(int count, int separation) {
+    nrunways = count;
+    separation_ms = separation;
+    timer_init(&restore_timer, restore_expire, NULL);
+    plane_on_enter(PLANE_INAIR, plane_tookoff);
+}
+
+// Set up the taxi queues, one per runway, of airport "airport" (called by
+// the airport module as it adds airports)
+void taxiqueue_open(int airport) {
+    runway *rws = calloc(nrunways, sizeof(runway));
+    if (rws == NULL) {
+        perror("taxiqueue_open");
+        exit(1);
+    }
+
+    for (int i = 0; i < nrunways; i++) {
+        runway *rw = &rws[i];
+        rw->airport = airport;
+        rw->number = i + 1;
+        rw->qcap = QUEUE_DEF_CAPACITY;
+        rw->slots = calloc(rw->qcap, sizeof(queue_entry));
+        rw->live_tree = calloc(rw->qcap, sizeof(int));
+        rw->render_cap = RENDER_DEF_CAPACITY;
+        rw->render = malloc(rw->render_cap);
+        if (rw->slots == NULL || rw->live_tree == NULL || rw->render == NULL) {
+            perror("taxiqueue_open");
+            exit(1);
         }
+        rw->qbase = rw->qhead = rw->qtail = 1;  // Ticket 0 means "not in the queue"
 
-        pthread_mutex_unlock(&queue_mutex);
+        rw->cleared_ticket = 0;
+        rw->next_clear = 0;
+        timer_init(&rw->clear_timer, runway_timer_fired, rw);
+        pthread_mutex_init(&rw->queue_mutex, NULL);
     }
-    return NULL;
+    runways[airport] = rws;
+}
+
+// Returns the number of departure runways (at each airport)
+int taxiqueue_runways(void) {
+    return nrunways;
+}
+
+// Returns the number of planes in the taxi queue of runway "number"
+// (counting from 1) at airport "airport". Doesn't lock, so is only a
+// snapshot.
+int taxiqueue_length(int airport, int number) {
+    return __atomic_load_n(&runways[airport][number - 1].nqueued,
+                           __ATOMIC_RELAXED);
+}
+
+// Put flight "id" back at the tail of the queue of runway "number" at
+// airport "airport" as a placeholder, after a restart. Placeholders have
+// to be restored in queue order, before any plane connects. Returns the
+// placeholder's ticket.
+long taxiqueue_restore(int airport, int number, const char *id) {
+    flightid fid = flightid_intern(airport, id);
+    runway *rw = &runways[airport][number - 1];
+    pthread_mutex_lock(&rw->queue_mutex);
+    long ticket = queue_append(rw, fid);
+    rw->slots[ticket - rw->qbase].unclaimed = 1;
+    pthread_mutex_unlock(&rw->queue_mutex);
+
+    restored *r = malloc(sizeof(restored));
+    if (r == NULL) {
+        perror("taxiqueue_restore");
+        exit(1);
+    }
+    r->fid = fid;
+    r->airport = airport;
+    r->runway = number;
+    r->ticket = ticket;
+
+    pthread_mutex_lock(&restore_lock);
+    unsigned int b = fid % RESTORE_BUCKETS;
+    r->next = restore_index[b];
+    restore_index[b] = r;
+    __atomic_store_n(&nrestored, nrestored + 1, __ATOMIC_RELAXED);
+    if (nrestored == 1)
+        timer_arm(&restore_timer, timers_now() + TAXIQUEUE_RESTORE_GRACE);
+    pthread_mutex_unlock(&restore_lock);
+    return ticket;
+}
+
+// Put a plane that was queued in another process (see handoff.c) back
+// in its place, which must have been restored with taxiqueue_restore.
+// Returns 0, or -1 if there is no place for it.
+int taxiqueue_adopt(airplane *plane) {
+    return restore_claim(plane) ? 0 : -1;
+}
+
+// Returns how long (ms) runway "number" at airport "airport" still has
+// to wait after its last takeoff before it may clear the next plane, or 0
+long taxiqueue_clear_in(int airport, int number) {
+    runway *rw = &runways[airport][number - 1];
+    pthread_mutex_lock(&rw->queue_mutex);
+    long wait = rw->next_clear - timers_now();
+    pthread_mutex_unlock(&rw->queue_mutex);
+    return (wait > 0) ? wait : 0;
+}
+
+// Make runway "number" at airport "airport" wait "wait" ms (from now)
+// before it clears the next plane, as it would after a takeoff
+void taxiqueue_set_clear_in(int airport, int number, long wait) {
+    runway *rw = &runways[airport][number - 1];
+    pthread_mutex_lock(&rw->queue_mutex);
+    long next_clear = timers_now() + wait;
+    if (next_clear > rw->next_clear)
+        rw->next_clear = next_clear;
+    pthread_mutex_unlock(&rw->queue_mutex);
+}
+
+// Call "visit" for every flight in the queue of runway "number" at
+// airport "airport", head first, with its ticket and the plane if it
+// subscribed to position updates. The runway is locked during the walk.
+void taxiqueue_export(int airport, int number, taxi_visitor visit,
+                      void *arg) {
+    runway *rw = &runways[airport][number - 1];
+    pthread_mutex_lock(&rw->queue_mutex);
+    for (long t = rw->qhead; t < rw->qtail; t++) {
+        queue_entry *entry = &rw->slots[t - rw->qbase];
+        if (entry->fid != FLIGHTID_NONE)
+            visit(flightid_name(entry->fid), t, entry->sub, arg);
+    }
+    pthread_mutex_unlock(&rw->queue_mutex);
+}
+
+// Returns the number of the runway a plane should taxi to: the one its
+// placeholder is on, if it has one, or else the least loaded runway at
+// its airport. The loads are read without locking, so two planes
+// arriving together may both pick the same runway; that only matters
+// until the next arrival evens things out again.
+int taxiqueue_pick(airplane *plane) {
+    if (__atomic_load_n(&nrestored, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&restore_lock);
+        restored *r = *restore_find(plane->fid);
+        int number = (r != NULL) ? r->runway : 0;
+        pthread_mutex_unlock(&restore_lock);
+        if (number > 0)
+            return number;
+    }
+
+    runway *rws = runways[plane->airport];
+    runway *rw = &rws[0];
+    for (int i = 1; i < nrunways; i++) {
+        if (__atomic_load_n(&rws[i].nqueued, __ATOMIC_RELAXED) <
+            __atomic_load_n(&rw->nqueued, __ATOMIC_RELAXED))
+            rw = &rws[i];
+    }
+    return rw->number;
+}
+
+// Add a new flight to the taxi queue of the least loaded runway, giving
+// it the next ticket on that runway. The plane must already be in the
+// PLANE_TAXIING state, since it may be cleared for takeoff (and sent
+// TAKEOFF) before this returns. A plane that already has a runway (picked
+// beforehand with taxiqueue_pick) joins that one instead, and a plane
+// with a placeholder from before a restart takes that over.
+void taxiqueue_add(airplane *plane) {
+    if ((__atomic_load_n(&nrestored, __ATOMIC_RELAXED) > 0) &&
+        restore_claim(plane))
+        return;
+
+    int number = (plane->runway > 0) ? plane->runway : taxiqueue_pick(plane);
+    runway *rw = &runways[plane->airport][number - 1];
+
+    pthread_mutex_lock(&rw->queue_mutex);
+    plane->taxi_ticket = queue_append(rw, plane->fid);
+    plane->runway = rw->number;
+    journal_record(JOURNAL_TAXI, rw->airport, rw->number, plane->taxi_ticket,
+                   flightid_name(plane->fid));
+    runway_schedule(rw);
+    pthread_mutex_unlock(&rw->queue_mutex);
+}
+
+// Get the position of a flight in its runway's taxi queue (1-indexed), or
+// 0 if it isn't in a queue
+int taxiqueue_getpos(airplane *plane) {
+    runway *rw = plane_runway(plane);
+    if (rw == NULL)
+        return 0;
+
+    pthread_mutex_lock(&rw->queue_mutex);
+    int position = 0;
+    long ticket = plane->taxi_ticket;
+    if (queue_entry_for(rw, ticket) != NULL)
+        position = queue_pos(rw, ticket);
+    pthread_mutex_unlock(&rw->queue_mutex);
+    return position;
+}
+
+// Turn position updates for a plane on or off. If "tell" is set, a plane
+// subscribing is also sent its current position (so it knows where it
+// starts). That goes out with the queue still locked, so an update from
+// a departure can't get ahead of it.
+void taxiqueue_subscribe(airplane *plane, int on, int tell) {
+    runway *rw = plane_runway(plane);
+    if (rw == NULL)
+        return;
+
+    pthread_mutex_lock(&rw->queue_mutex);
+    long ticket = plane->taxi_ticket;
+    queue_entry *entry = queue_entry_for(rw, ticket);
+    if (entry != NULL) {
+        if (on && entry->sub == NULL)
+            rw->nsubscribed++;
+        else if (!on && entry->sub != NULL)
+            rw->nsubscribed--;
+        entry->sub = on ? plane : NULL;
+        if (on && tell)
+            send_pos(plane, queue_pos(rw, ticket));
+    }
+    pthread_mutex_unlock(&rw->queue_mutex);
+}
+
+// Give "emit" the list of flights ahead of the given flight on its runway,
+// as a slice of the rendered queue ("ID1, ID2"), without copying it
+// anywhere. At most "max" flights are included (max < 0 means no limit),
+// starting "skip" flights back from the head. The slice is only valid
+// during the call, which is made with the queue locked. Returns the
+// number of flights passed to emit, or -1 (without calling emit) if the
+// flight isn't in a queue.
+int taxiqueue_getahead(airplane *plane, int max, int skip,
+                       ahead_emitter emit) {
+    runway *rw = plane_runway(plane);
+    if (rw == NULL)
+        return -1;
+
+    pthread_mutex_lock(&rw->queue_mutex);
+
+    long ticket = plane->taxi_ticket;
+    queue_entry *mine = queue_entry_for(rw, ticket);
+    if (mine == NULL) {
+        pthread_mutex_unlock(&rw->queue_mutex);
+        return -1;
+    }
+    if (rw->render_dirty)
+        render_rebuild(rw);
+
+    int nahead = queue_pos(rw, ticket) - 1;
+    int first = (skip < nahead) ? skip : nahead;
+    int last = (max < 0 || max > nahead - first) ? nahead : first + max;
+
+    int len = 0;
+    const char *list = "";
+    if (first < last) {
+        long start = rw->slots[queue_kth(rw, first) - rw->qbase].roff;
+        long end = (last == nahead) ? mine->roff :
+            rw->slots[queue_kth(rw, last) - rw->qbase].roff;
+        list = rw->render + (start - rw->render_base);
+        len = end - start - RENDER_SEPLEN;
+    }
+
+    emit(plane, list, len, last - first);
+    pthread_mutex_unlock(&rw->queue_mutex);
+    return last - first;
+}
+
+
+// Take a plane out of its taxi queue wherever it is (e.g., because it
+// disconnected). Does nothing if the plane isn't in a queue.
+void taxiqueue_remove(airplane *plane) {
+    runway_remove(plane, 0);
 }
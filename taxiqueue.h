@@ -3,11 +3,51 @@
 
 #include <pthread.h>
 
-void taxiqueue_init();
-void taxiqueue_add(const char *flight_id);
-int taxiqueue_getpos(const char *flight_id);
-char *taxiqueue_getahead(const char *flight_id);
-void taxiqueue_inair(const char *flight_id);
-void *taxiqueue_manager(void *arg);
+#include "airplane.h"
+
+// Number of departure runways when none is given on the command line
+
+#define TAXIQUEUE_DEF_RUNWAYS 1
+
+// Default time between a takeoff and the next clearance on a runway (ms)
+
+#define TAXIQUEUE_DEF_SEPARATION 4000
+
+// How long flights restored from the journal have to come back and claim
+// their old place in the queue (ms)
+
+#define TAXIQUEUE_RESTORE_GRACE 30000
+
+void taxiqueue_init(int nrunways, int separation_ms);
+void taxiqueue_open(int airport);
+int taxiqueue_runways(void);
+int taxiqueue_length(int airport, int number);
+int taxiqueue_pick(airplane *plane);
+long taxiqueue_restore(int airport, int number, const char *id);
+int taxiqueue_adopt(airplane *plane);
+long taxiqueue_clear_in(int airport, int number);
+void taxiqueue_set_clear_in(int airport, int number, long wait);
+
+// Called by taxiqueue_export for each flight in a queue, in order. "sub"
+// is the plane if it subscribed to position updates, or NULL.
+
+typedef void (*taxi_visitor)(const char *id, long ticket, airplane *sub,
+                             void *arg);
+
+void taxiqueue_export(int airport, int number, taxi_visitor visit,
+                      void *arg);
+
+void taxiqueue_add(airplane *plane);
+int taxiqueue_getpos(airplane *plane);
+void taxiqueue_subscribe(airplane *plane, int on, int tell);
+
+// Called by taxiqueue_getahead with a list of "len" bytes (not NUL
+// terminated) of the "count" flights ahead of a plane
+
+typedef void (*ahead_emitter)(airplane *plane, const char *list, int len,
+                              int count);
+
+int taxiqueue_getahead(airplane *plane, int max, int skip, ahead_emitter emit);
+void taxiqueue_remove(airplane *plane);
 
 #endif // TAXIQUEUE_H
@@ -0,0 +1,208 @@
+// The timers module runs deadline events (runway clearances, and later
+// things like timeouts) without tying up a thread per event. All armed
+// timers sit in a binary min-heap ordered by deadline, and a single timer
+// thread sleeps until the earliest deadline, fires everything that is
+// due, and goes back to sleep. Arming, re-arming and cancelling are all
+// O(log n), and deadlines have millisecond resolution.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timers.h"
+
+#define HEAP_DEF_CAPACITY 64
+
+static timer **heap;
+static int heap_size;
+static int heap_capacity;
+
+static pthread_mutex_t timers_lock;
+static pthread_cond_t timers_cond;  // Uses CLOCK_MONOTONIC
+static pthread_t timers_thread;
+
+// Held by the timer thread while a callback runs (see timers_freeze)
+
+static pthread_mutex_t fire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/************************************************************************
+ * timers_now returns the current time in milliseconds on the monotonic
+ * clock that all timer deadlines are measured against.
+ */
+long timers_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/************************************************************************
+ * Heap helpers. These all require timers_lock to be held.
+ */
+static void heap_place(int index, timer *t) {
+    heap[index] = t;
+    t->heap_index = index;
+}
+
+static void heap_up(int index) {
+    timer *t = heap[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (heap[parent]->deadline <= t->deadline)
+            break;
+        heap_place(index, heap[parent]);
+        index = parent;
+    }
+    heap_place(index, t);
+}
+
+static void heap_down(int index) {
+    timer *t = heap[index];
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= heap_size)
+            break;
+        if ((child + 1 < heap_size) &&
+            (heap[child + 1]->deadline < heap[child]->deadline))
+            child++;
+        if (t->deadline <= heap[child]->deadline)
+            break;
+        heap_place(index, heap[child]);
+        index = child;
+    }
+    heap_place(index, t);
+}
+
+static void heap_delete(timer *t) {
+    int index = t->heap_index;
+    timer *last = heap[--heap_size];
+    t->heap_index = -1;
+    if (last == t)
+        return;
+
+    heap_place(index, last);
+    heap_up(index);
+    heap_down(last->heap_index);
+}
+
+/************************************************************************
+ * The timer thread: sleep until the earliest deadline (or until a new
+ * earlier timer is armed), then fire every timer that is due. Callbacks
+ * are run without timers_lock held, so they are free to arm timers.
+ */
+static void *timers_main(void *arg) {
+    pthread_mutex_lock(&timers_lock);
+    while (1) {
+        if (heap_size == 0) {
+            pthread_cond_wait(&timers_cond, &timers_lock);
+            continue;
+        }
+
+        timer *first = heap[0];
+        long now = timers_now();
+        if (first->deadline > now) {
+            struct timespec until;
+            until.tv_sec = first->deadline / 1000;
+            until.tv_nsec = (first->deadline % 1000) * 1000000L;
+            pthread_cond_timedwait(&timers_cond, &timers_lock, &until);
+            continue;
+        }
+
+        heap_delete(first);
+        pthread_mutex_unlock(&timers_lock);
+        pthread_mutex_lock(&fire_lock);
+        first->fire(first->arg);
+        pthread_mutex_unlock(&fire_lock);
+        pthread_mutex_lock(&timers_lock);
+    }
+    return NULL;
+}
+
+/************************************************************************
+ * timers_init sets up the timer heap and starts the timer thread. Should
+ * be called once at startup, before any timer is armed.
+ */
+void timers_init(void) {
+    heap_capacity = HEAP_DEF_CAPACITY;
+    heap_size = 0;
+    if ((heap=malloc(heap_capacity * sizeof(timer *))) == NULL) {
+        perror("timers_init");
+        exit(1);
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timers_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&timers_lock, NULL);
+
+    pthread_create(&timers_thread, NULL, timers_main, NULL);
+}
+
+/************************************************************************
+ * timer_init sets up a timer (not armed) that will call "fire" with
+ * "arg" each time it goes off.
+ */
+void timer_init(timer *t, timer_fn fire, void *arg) {
+    t->deadline = 0;
+    t->heap_index = -1;
+    t->fire = fire;
+    t->arg = arg;
+}
+
+/************************************************************************
+ * timer_arm arms "t" to fire at absolute time "deadline" (in timers_now()
+ * milliseconds). A deadline in the past fires as soon as possible. If the
+ * timer is already armed, it is moved to the new deadline.
+ */
+void timer_arm(timer *t, long deadline) {
+    pthread_mutex_lock(&timers_lock);
+    if (t->heap_index >= 0)
+        heap_delete(t);
+
+    if (heap_size == heap_capacity) {
+        timer **newheap = realloc(heap, 2 * heap_capacity * sizeof(timer *));
+        if (newheap == NULL) {
+            perror("timer_arm - growing heap");
+            exit(1);
+        }
+        heap = newheap;
+        heap_capacity *= 2;
+    }
+
+    t->deadline = deadline;
+    heap_place(heap_size++, t);
+    heap_up(t->heap_index);
+
+    // Only an armed timer that is now the earliest changes how long the
+    // timer thread should sleep
+    if (t->heap_index == 0)
+        pthread_cond_signal(&timers_cond);
+    pthread_mutex_unlock(&timers_lock);
+}
+
+/************************************************************************
+ * timer_cancel disarms "t" if it is armed. A timer whose callback has
+ * already started is not affected, so callbacks should re-check whatever
+ * state they act on.
+ */
+void timer_cancel(timer *t) {
+    pthread_mutex_lock(&timers_lock);
+    if (t->heap_index >= 0)
+        heap_delete(t);
+    pthread_mutex_unlock(&timers_lock);
+}
+
+/************************************************************************
+ * timers_freeze waits for any callback in progress to finish, and then
+ * holds every other callback back until timers_thaw. Timers can still
+ * be armed and cancelled meanwhile.
+ */
+void timers_freeze(void) {
+    pthread_mutex_lock(&fire_lock);
+}
+
+void timers_thaw(void) {
+    pthread_mutex_unlock(&fire_lock);
+}
@@ -0,0 +1,30 @@
+// Function prototypes and types for the deadline timer module
+
+#ifndef _TIMERS_H
+#define _TIMERS_H
+
+// A timer fires its callback once, on the timer thread, at (or just after)
+// its deadline. Timers are embedded in whatever struct owns them, so
+// arming one never allocates. Callbacks must be short and must not block,
+// since every timer in the process shares the one thread.
+
+typedef void (*timer_fn)(void *arg);
+
+typedef struct {
+    long deadline;    // Absolute time in ms on the timers_now() clock
+    int heap_index;   // Position in the timer heap, or -1 when not armed
+    timer_fn fire;
+    void *arg;
+} timer;
+
+void timers_init(void);
+long timers_now(void);
+
+void timer_init(timer *t, timer_fn fire, void *arg);
+void timer_arm(timer *t, long deadline);
+void timer_cancel(timer *t);
+
+void timers_freeze(void);
+void timers_thaw(void);
+
+#endif  // _TIMERS_H
@@ -0,0 +1,603 @@
+// The uring module is a third way of running the connections, next to
+// the thread-per-connection model in gndcontrol.c and the epoll event
+// loop in eventloop.c. Each I/O thread owns an io_uring instance, and
+// does all of its socket work through it without any blocking calls:
+//
+//   - Every ring has a multishot accept on the (shared) listening
+//     socket, so the kernel spreads new connections over the threads and
+//     each accept needs no new request.
+//   - Receives are multishot too, and take their buffers from a ring of
+//     buffers provided up front, so an idle connection holds no buffer.
+//     The received bytes are copied into the plane's rxbuf and run as
+//     commands right there on the I/O thread, which then hands the
+//     buffer straight back to the kernel.
+//   - A plane's stdio sender is a cookie stream that just appends to an
+//     output buffer. The I/O thread sends that buffer as a chain of
+//     linked sends (so the pieces go out in order), while anything
+//     written in the meantime collects in a second buffer for the next
+//     chain. Writes from other threads (like the timer thread clearing
+//     a plane for takeoff) wake the ring up through an eventfd. A plane
+//     with more than OUTQ_MAX_BYTES waiting is dropped as a slow
+//     consumer, as in the other modes (see outq.c).
+//
+// Commands never wait on the network, so they are run on the I/O
+// threads themselves rather than on the worker pool.
+//
+// Whether this can be built is decided by the Makefile (it needs
+// liburing), and whether it can run by the kernel. uring_run returns
+// straight away if either says no, and the caller carries on with the
+// epoll event loop instead.
+
+#define _GNU_SOURCE      // For fopencookie
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "uring.h"
+
+#ifdef HAVE_LIBURING
+
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <liburing.h>
+
+#include "airplane.h"
+#include "airs_protocol.h"
+#include "metrics.h"
+#include "outq.h"
+#include "planelist.h"
+#include "taxiqueue.h"
+
+// Ring size, and the provided receive buffers (per ring)
+
+#define RING_ENTRIES 256
+#define BUF_GROUP 1
+#define BUF_COUNT 512
+#define BUF_SIZE 2048
+
+// Output is sent in chains of at most SEND_LINKS linked sends, each at
+// least SEND_CHUNK bytes (but bigger if that's what it takes)
+
+#define SEND_CHUNK 4096
+#define SEND_LINKS 16
+
+// What a completion is for, kept in the low bits of its user_data (the
+// rest is the uconn or ring it belongs to, which are malloc()ed and so
+// 8-byte aligned). A user_data of 0 is a cancel, and needs nothing done.
+
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_WAKE 4
+#define OP_MASK 7
+
+struct uconn;
+
+// Per I/O thread state
+
+typedef struct ring {
+    pthread_t thread;
+    struct io_uring uring;
+    int listen_fd;
+    struct io_uring_buf_ring *bufring;
+    char *bufs;                // BUF_COUNT buffers of BUF_SIZE bytes
+    int wake_fd;               // eventfd other threads write to wake us
+    uint64_t wake_val;         // Where the eventfd read lands
+    pthread_mutex_t lock;      // Protects "wakes" and every uconn's "out"
+    struct uconn *wakes;       // Connections with new output to send
+} ring;
+
+// Per connection state. Lives from the accept until the plane is gone
+// and the kernel has finished with the socket, which can be a while
+// after the plane itself has been destroyed.
+
+typedef struct uconn {
+    airplane *plane;           // NULL once the plane has been closed
+    ring *ring;
+    int fd;
+    char *out;                 // Written, not yet sent (ring lock)
+    int outlen, outcap;
+    char *sending;             // Being sent by the kernel
+    int sendcap;
+    int sends;                 // Sends in flight
+    int send_failed;           // Connection can't be sent to any more
+    int dropped;               // Dropped as a slow consumer (ring lock)
+    int recv_live;             // A receive is armed
+    int queued;                // On the ring's wake list (ring lock)
+    int closing;               // Plane closed; free once the kernel is done
+    struct uconn *wnext;       // Next connection on the wake list
+} uconn;
+
+// Multishot receives need a newer kernel than the rest; if the kernel
+// turns one down, every connection uses one-shot receives instead
+
+static int recv_multishot = 1;
+
+// The ring of the I/O thread we are on (NULL on other threads)
+
+static __thread ring *current_ring;
+
+/************************************************************************
+ * get_sqe gets a submission queue entry, submitting what is already
+ * queued if there is no room for another.
+ */
+static struct io_uring_sqe *get_sqe(ring *r) {
+    struct io_uring_sqe *sqe;
+    while ((sqe = io_uring_get_sqe(&r->uring)) == NULL)
+        io_uring_submit(&r->uring);
+    return sqe;
+}
+
+/************************************************************************
+ * Arm the multishot accept, the eventfd read and a connection's receive.
+ */
+static void arm_accept(ring *r) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    io_uring_prep_multishot_accept(sqe, r->listen_fd, NULL, NULL, 0);
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)r | OP_ACCEPT);
+}
+
+static void arm_wake(ring *r) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    io_uring_prep_read(sqe, r->wake_fd, &r->wake_val, sizeof(r->wake_val), 0);
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)r | OP_WAKE);
+}
+
+static void arm_recv(uconn *u) {
+    struct io_uring_sqe *sqe = get_sqe(u->ring);
+    if (recv_multishot)
+        io_uring_prep_recv_multishot(sqe, u->fd, NULL, 0, 0);
+    else
+        io_uring_prep_recv(sqe, u->fd, NULL, 0, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+    sqe->buf_group = BUF_GROUP;
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)u | OP_RECV);
+    u->recv_live = 1;
+}
+
+/************************************************************************
+ * conn_write is the write function of a plane's cookie stream, and can
+ * be called from any thread. It only queues the bytes; the I/O thread
+ * sends them.
+ */
+static ssize_t conn_write(void *cookie, const char *buf, size_t size) {
+    uconn *u = (uconn *)cookie;
+    ring *r = u->ring;
+
+    pthread_mutex_lock(&r->lock);
+    if (u->dropped) {
+        pthread_mutex_unlock(&r->lock);
+        return size;
+    }
+    if (u->outlen + (int)size > OUTQ_MAX_BYTES) {
+        // A slow consumer (see outq.h): its reader will see it hang up
+        u->dropped = 1;
+        u->outlen = 0;
+        shutdown(u->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&r->lock);
+        metrics_count(MET_SLOW_DROPS);
+        return size;
+    }
+    if (u->outlen + (int)size > u->outcap) {
+        int newcap = (u->outcap > 0) ? u->outcap : 256;
+        while (newcap < u->outlen + (int)size)
+            newcap *= 2;
+        char *newout = realloc(u->out, newcap);
+        if (newout == NULL) {
+            perror("conn_write");
+            exit(1);
+        }
+        u->out = newout;
+        u->outcap = newcap;
+    }
+    memcpy(u->out + u->outlen, buf, size);
+    u->outlen += size;
+
+    int wake = !u->queued;
+    if (wake) {
+        u->queued = 1;
+        u->wnext = r->wakes;
+        r->wakes = u;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    // The I/O thread looks at its wake list before waiting again anyway
+    if (wake && (current_ring != r))
+        eventfd_write(r->wake_fd, 1);
+    return size;
+}
+
+/************************************************************************
+ * conn_close is the close function of a plane's cookie stream, called
+ * when the plane is destroyed (after the stream's last bytes have gone
+ * to conn_write). The socket stays open until they have been sent.
+ */
+static int conn_close(void *cookie) {
+    uconn *u = (uconn *)cookie;
+    u->closing = 1;
+    return 0;
+}
+
+/************************************************************************
+ * maybe_free closes and frees a connection whose plane has been closed,
+ * once nothing is left in flight.
+ */
+static void maybe_free(uconn *u) {
+    if (!u->closing || u->recv_live || (u->sends > 0))
+        return;
+
+    pthread_mutex_lock(&u->ring->lock);
+    int busy = u->queued ||
+        ((u->outlen > 0) && !u->send_failed && !u->dropped);
+    pthread_mutex_unlock(&u->ring->lock);
+    if (busy)
+        return;
+
+    close(u->fd);
+    free(u->out);
+    free(u->sending);
+    free(u);
+}
+
+/************************************************************************
+ * start_send sends whatever a connection has written, as one chain of
+ * linked sends, unless a chain is still in flight (in which case this is
+ * called again when it finishes).
+ */
+static void start_send(uconn *u) {
+    if (u->sends > 0)
+        return;
+
+    // Swap the buffers, so writers carry on into the empty one
+    pthread_mutex_lock(&u->ring->lock);
+    int len = u->outlen;
+    if (u->send_failed || u->dropped)
+        u->outlen = 0;
+    if ((len == 0) || u->send_failed || u->dropped) {
+        pthread_mutex_unlock(&u->ring->lock);
+        return;
+    }
+    char *buf = u->out;
+    int cap = u->outcap;
+    u->out = u->sending;
+    u->outcap = u->sendcap;
+    u->outlen = 0;
+    u->sending = buf;
+    u->sendcap = cap;
+    pthread_mutex_unlock(&u->ring->lock);
+
+    int chunk = (len + SEND_LINKS - 1) / SEND_LINKS;
+    if (chunk < SEND_CHUNK)
+        chunk = SEND_CHUNK;
+    int nlinks = (len + chunk - 1) / chunk;
+
+    // A chain has to go to the kernel in one submit
+    if ((int)io_uring_sq_space_left(&u->ring->uring) < nlinks)
+        io_uring_submit(&u->ring->uring);
+
+    // With MSG_WAITALL each send either sends all of its piece or fails,
+    // and a failure cancels the rest of the chain
+    for (int off=0; off<len; off+=chunk) {
+        int n = (len - off < chunk) ? len - off : chunk;
+        struct io_uring_sqe *sqe = get_sqe(u->ring);
+        io_uring_prep_send(sqe, u->fd, buf + off, n,
+                           MSG_WAITALL | MSG_NOSIGNAL);
+        if (off + n < len)
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)u | OP_SEND);
+        u->sends++;
+    }
+}
+
+/************************************************************************
+ * flush_wakes starts sending for every connection on the ring's wake
+ * list.
+ */
+static void flush_wakes(ring *r) {
+    pthread_mutex_lock(&r->lock);
+    uconn *list = r->wakes;
+    r->wakes = NULL;
+    for (uconn *u=list; u!=NULL; u=u->wnext)
+        u->queued = 0;
+    pthread_mutex_unlock(&r->lock);
+
+    // Nothing else changes wnext until queued is set again, which only
+    // conn_write does, and that puts it at the front of the new list
+    while (list != NULL) {
+        uconn *u = list;
+        list = u->wnext;
+        start_send(u);
+        maybe_free(u);
+    }
+}
+
+/************************************************************************
+ * close_conn takes a plane out of the taxi queue and the system, and
+ * cancels its receive. The connection itself goes once the kernel is
+ * done with it (see maybe_free).
+ */
+static void close_conn(uconn *u) {
+    airplane *plane = u->plane;
+    u->plane = NULL;
+    taxiqueue_remove(plane);
+    planelist_remove(plane);   // Closes the cookie stream
+
+    if (u->recv_live) {
+        struct io_uring_sqe *sqe = get_sqe(u->ring);
+        io_uring_prep_cancel64(sqe, (uint64_t)(uintptr_t)u | OP_RECV, 0);
+        io_uring_sqe_set_data64(sqe, 0);
+    }
+    maybe_free(u);
+}
+
+/************************************************************************
+ * new_conn sets up a plane for a freshly accepted socket.
+ */
+static void new_conn(ring *r, int fd) {
+    uconn *u = calloc(1, sizeof(uconn));
+    if (u == NULL) {
+        perror("new_conn");
+        exit(1);
+    }
+    u->ring = r;
+    u->fd = fd;
+
+    cookie_io_functions_t io = { NULL, conn_write, NULL, conn_close };
+    FILE *sender = fopencookie(u, "w", io);
+    if (sender == NULL) {
+        perror("new_conn fopencookie");
+        close(fd);
+        free(u);
+        return;
+    }
+
+    airplane *plane = new_airplane_writer(fd, sender);
+    plane->thread = r->thread;
+    u->plane = plane;
+    planelist_add(plane);
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) == 0)
+        printf("Got connection from %s (client %ld)\n",
+               inet_ntoa(addr.sin_addr), plane->thread);
+
+    arm_recv(u);
+}
+
+/************************************************************************
+ * handle_recv runs what a completed receive brought in, and hands its
+ * buffer back to the kernel.
+ */
+static void handle_recv(uconn *u, struct io_uring_cqe *cqe) {
+    ring *r = u->ring;
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        u->recv_live = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *bytes = r->bufs + bid * BUF_SIZE;
+        int len = (cqe->res > 0) ? cqe->res : 0;
+
+        // The rxbuf may not take it all at once; commands are run to
+        // make room
+        airplane *plane = u->plane;
+        while ((plane != NULL) && (len > 0) &&
+               (plane_state(plane) != PLANE_DONE)) {
+            int n = rxbuf_put(&plane->rx, bytes, len);
+            bytes += n;
+            len -= n;
+            doinput(plane);
+        }
+
+        io_uring_buf_ring_add(r->bufring, r->bufs + bid * BUF_SIZE, BUF_SIZE,
+                              bid, io_uring_buf_ring_mask(BUF_COUNT), 0);
+        io_uring_buf_ring_advance(r->bufring, 1);
+    }
+
+    if (u->closing) {
+        maybe_free(u);
+        return;
+    }
+
+    int hangup = 0;
+    if (cqe->res == 0) {
+        hangup = 1;   // Client disconnected
+    } else if (cqe->res == -EINVAL && recv_multishot) {
+        recv_multishot = 0;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+        hangup = 1;
+    }
+
+    if (hangup || (plane_state(u->plane) == PLANE_DONE))
+        close_conn(u);
+    else if (!u->recv_live)
+        arm_recv(u);
+}
+
+/************************************************************************
+ * handle_send counts off a finished send, and starts the next chain (or
+ * lets the connection go) once the whole chain has finished.
+ */
+static void handle_send(uconn *u, struct io_uring_cqe *cqe) {
+    u->sends--;
+    if (cqe->res < 0)
+        u->send_failed = 1;
+
+    if (u->sends == 0) {
+        start_send(u);
+        maybe_free(u);
+    }
+}
+
+/************************************************************************
+ * handle_accept sets up a new connection for each accepted socket, and
+ * re-arms the accept if the kernel has stopped it.
+ */
+static void handle_accept(ring *r, struct io_uring_cqe *cqe) {
+    if (cqe->res >= 0) {
+        new_conn(r, cqe->res);
+    } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR &&
+               cqe->res != -EAGAIN) {
+        // As in the other modes, a failing accept stops accepting
+        fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        arm_accept(r);
+}
+
+/************************************************************************
+ * ring_thread_main is the completion loop run by each I/O thread.
+ */
+static void *ring_thread_main(void *arg) {
+    ring *r = (ring *)arg;
+    current_ring = r;
+
+    while (1) {
+        flush_wakes(r);
+
+        int ret = io_uring_submit_and_wait(&r->uring, 1);
+        if ((ret < 0) && (ret != -EINTR)) {
+            fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+            exit(1);
+        }
+
+        struct io_uring_cqe *cqe;
+        while (io_uring_peek_cqe(&r->uring, &cqe) == 0) {
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            void *ptr = (void *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+            switch (data & OP_MASK) {
+            case OP_ACCEPT:
+                handle_accept(ptr, cqe);
+                break;
+            case OP_RECV:
+                handle_recv(ptr, cqe);
+                break;
+            case OP_SEND:
+                handle_send(ptr, cqe);
+                break;
+            case OP_WAKE:
+                arm_wake(r);
+                break;
+            }
+            io_uring_cqe_seen(&r->uring, cqe);
+        }
+    }
+
+    return NULL;
+}
+
+/************************************************************************
+ * ring_setup creates a ring for "listen_fd", with its provided buffers,
+ * accept and eventfd read queued up. Returns 0, or -1 (having printed
+ * why, and freed everything) if the kernel doesn't support what's
+ * needed.
+ */
+static int ring_setup(ring *r, int listen_fd) {
+    r->listen_fd = listen_fd;
+    r->wakes = NULL;
+    pthread_mutex_init(&r->lock, NULL);
+
+    int ret = io_uring_queue_init(RING_ENTRIES, &r->uring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    r->bufring = io_uring_setup_buf_ring(&r->uring, BUF_COUNT, BUF_GROUP,
+                                         0, &ret);
+    if (r->bufring == NULL) {
+        fprintf(stderr, "io_uring_setup_buf_ring: %s\n", strerror(-ret));
+        io_uring_queue_exit(&r->uring);
+        return -1;
+    }
+
+    r->bufs = malloc(BUF_COUNT * BUF_SIZE);
+    if (r->bufs == NULL) {
+        perror("ring_setup");
+        exit(1);
+    }
+    for (int i=0; i<BUF_COUNT; i++)
+        io_uring_buf_ring_add(r->bufring, r->bufs + i * BUF_SIZE, BUF_SIZE,
+                              i, io_uring_buf_ring_mask(BUF_COUNT), i);
+    io_uring_buf_ring_advance(r->bufring, BUF_COUNT);
+
+    if ((r->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+
+    arm_accept(r);
+    arm_wake(r);
+    io_uring_submit(&r->uring);
+
+    // With nothing to accept yet, the only completion there can be is
+    // the kernel turning the multishot accept down
+    struct io_uring_cqe *cqe;
+    if ((io_uring_peek_cqe(&r->uring, &cqe) == 0) && (cqe->res < 0)) {
+        fprintf(stderr, "io_uring multishot accept: %s\n", strerror(-cqe->res));
+        io_uring_queue_exit(&r->uring);
+        free(r->bufs);
+        close(r->wake_fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/************************************************************************
+ * uring_run sets up one ring per I/O thread ("nthreads" of them) on
+ * "listen_fd", and then runs them forever. Returns -1 straight away if
+ * io_uring isn't available, so the caller can use another mode.
+ */
+int uring_run(int listen_fd, int nthreads) {
+    ring *rings = malloc(nthreads * sizeof(ring));
+    if (rings == NULL) {
+        perror("uring_run");
+        exit(1);
+    }
+
+    // Set every ring up before starting any, so that falling back never
+    // leaves some of them running
+    for (int i=0; i<nthreads; i++) {
+        if (ring_setup(&rings[i], listen_fd) < 0) {
+            while (--i >= 0) {
+                io_uring_queue_exit(&rings[i].uring);
+                free(rings[i].bufs);
+                close(rings[i].wake_fd);
+            }
+            free(rings);
+            fprintf(stderr, "io_uring not available; using epoll\n");
+            return -1;
+        }
+    }
+
+    for (int i=0; i<nthreads; i++)
+        pthread_create(&rings[i].thread, NULL, ring_thread_main, &rings[i]);
+
+    // The rings do all of the accepting; nothing left for this thread
+    for (int i=0; i<nthreads; i++)
+        pthread_join(rings[i].thread, NULL);
+    return 0;
+}
+
+#else  // !HAVE_LIBURING
+
+/************************************************************************
+ * Without liburing there is no io_uring mode; the caller falls back.
+ */
+int uring_run(int listen_fd, int nthreads) {
+    fprintf(stderr, "Built without io_uring support; using epoll\n");
+    return -1;
+}
+
+#endif  // HAVE_LIBURING
@@ -0,0 +1,8 @@
+// Function prototypes for the io_uring server mode
+
+#ifndef _URING_H
+#define _URING_H
+
+int uring_run(int listen_fd, int nthreads);
+
+#endif  // _URING_H
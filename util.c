@@ -29,4 +29,4 @@ char *trim(char *line) {
         line++;
 
     return line;
-}
\ No newline at end of file
+}
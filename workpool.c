@@ -0,0 +1,173 @@
+// The workpool module is a fixed-size pool of worker threads that run
+// work items handed to them by other threads (in the event-driven server
+// mode, the I/O threads hand over planes with commands to run).
+//
+// Every worker has a queue of its own, and each item is submitted to one
+// of them, so submitters and workers mostly touch different locks. A
+// worker whose queue is empty steals from the others before going to
+// sleep, so a burst that lands on one queue is still spread across the
+// whole pool. The pool makes no ordering promises between items; callers
+// that need order (like the commands of one plane) must not submit the
+// next item until the previous one has run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    work *head;            // Queue of items, oldest first
+    work *tail;
+    pthread_mutex_t run_lock;  // Held while running an item (see workpool_freeze)
+} worker;
+
+static worker *workers;
+static int nworkers;
+
+// Sleeping workers wait on idle_cond. "queued" counts items in all the
+// queues and "sleepers" counts workers asleep (or about to be); both are
+// only changed with atomics, so a submit only takes idle_lock when there
+// is a worker to wake up.
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static long queued;
+static int sleepers;
+
+/************************************************************************
+ * queue_pop takes the oldest item off a worker's queue, or returns NULL
+ * if it is empty.
+ */
+static work *queue_pop(worker *wk) {
+    pthread_mutex_lock(&wk->lock);
+    work *w = wk->head;
+    if (w != NULL) {
+        wk->head = w->next;
+        if (wk->head == NULL)
+            wk->tail = NULL;
+    }
+    pthread_mutex_unlock(&wk->lock);
+
+    if (w != NULL)
+        __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    return w;
+}
+
+/************************************************************************
+ * next_work finds the next item for worker "me": from its own queue if
+ * there is one there, or else stolen from the other workers' queues,
+ * starting with the next worker along so the thieves spread out.
+ */
+static work *next_work(int me) {
+    work *w = queue_pop(&workers[me]);
+    for (int i=1; (w == NULL) && (i < nworkers); i++) {
+        worker *victim = &workers[(me + i) % nworkers];
+        if (__atomic_load_n(&victim->head, __ATOMIC_RELAXED) != NULL)
+            w = queue_pop(victim);
+    }
+    return w;
+}
+
+/************************************************************************
+ * worker_main is the loop run by each worker thread.
+ */
+static void *worker_main(void *arg) {
+    int me = (int)(long)arg;
+
+    while (1) {
+        work *w = next_work(me);
+        if (w != NULL) {
+            pthread_mutex_lock(&workers[me].run_lock);
+            w->run(w);
+            pthread_mutex_unlock(&workers[me].run_lock);
+            continue;
+        }
+
+        // Announce the sleep before the last look at "queued"; a
+        // submitter bumps "queued" before looking at "sleepers", so one
+        // of the two always sees the other
+        pthread_mutex_lock(&idle_lock);
+        __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0)
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&idle_lock);
+    }
+
+    return NULL;
+}
+
+/************************************************************************
+ * workpool_init starts "count" worker threads. Should be called once,
+ * before anything is submitted.
+ */
+void workpool_init(int count) {
+    nworkers = count;
+    workers = calloc(nworkers, sizeof(worker));
+    if (workers == NULL) {
+        perror("workpool_init");
+        exit(1);
+    }
+
+    for (int i=0; i<nworkers; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        pthread_mutex_init(&workers[i].run_lock, NULL);
+    }
+    for (int i=0; i<nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+                           (void *)(long)i) != 0) {
+            perror("workpool_init - pthread_create");
+            exit(1);
+        }
+    }
+}
+
+/************************************************************************
+ * Returns the number of workers (0 if the pool was never started).
+ */
+int workpool_size(void) {
+    return nworkers;
+}
+
+/************************************************************************
+ * workpool_submit queues "w" to be run on a worker. "hint" picks the
+ * worker whose queue it goes on (anything stable for the same caller or
+ * object, to keep related work on one worker while the pool isn't busy).
+ */
+void workpool_submit(work *w, unsigned int hint) {
+    worker *wk = &workers[hint % nworkers];
+    w->next = NULL;
+
+    pthread_mutex_lock(&wk->lock);
+    if (wk->tail != NULL)
+        wk->tail->next = w;
+    else
+        wk->head = w;
+    wk->tail = w;
+    pthread_mutex_unlock(&wk->lock);
+
+    __atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+/************************************************************************
+ * workpool_freeze waits for every item being run to finish, and then
+ * holds the workers back (items can still be submitted, and stay queued)
+ * until workpool_thaw.
+ */
+void workpool_freeze(void) {
+    for (int i=0; i<nworkers; i++)
+        pthread_mutex_lock(&workers[i].run_lock);
+}
+
+void workpool_thaw(void) {
+    for (int i=0; i<nworkers; i++)
+        pthread_mutex_unlock(&workers[i].run_lock);
+}
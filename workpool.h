@@ -0,0 +1,22 @@
+// Types and function prototypes for the worker thread pool
+
+#ifndef _WORKPOOL_H
+#define _WORKPOOL_H
+
+// A unit of work for the pool. It is embedded in whatever struct it
+// works on (so submitting never allocates), and "run" finds that struct
+// again from the work pointer. A work item must not be submitted again
+// until it has started running.
+
+typedef struct work {
+    struct work *next;             // Next item in a worker's queue
+    void (*run)(struct work *w);
+} work;
+
+void workpool_init(int nworkers);
+int workpool_size(void);
+void workpool_submit(work *w, unsigned int hint);
+void workpool_freeze(void);
+void workpool_thaw(void);
+
+#endif  // _WORKPOOL_H